@@ -0,0 +1,19 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/* Message types understood by bench-server.  PING is the library's
+   own MSG_TYPE_PING. */
+
+/* Client sends a buffer, server echoes it back. */
+#define BENCH_PAYLOAD 1
+
+/* Client sends a uint32 count and that many strings, server answers
+   with the uint32 total length of the strings. */
+#define BENCH_STRINGS 2
+
+/* Server answers with an open fd, which the client closes. */
+#define BENCH_FD      3
+
+#define BENCH_SOCKET "@dispatch-bench"
+
+#endif /* !_BENCH_H_ */
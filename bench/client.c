@@ -0,0 +1,401 @@
+#include <config.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dispatch.h>
+#include "bench.h"
+
+/* Load generator for bench-server.  Every request is a full
+   msg_open/write/read/msg_close cycle, which is what real clients
+   pay.  Results go to stdout as one JSON document. */
+
+enum tests {TEST_PING,TEST_PAYLOAD,TEST_STRINGS,TEST_FD,TEST_MAX};
+
+static const char *test_names[TEST_MAX]={"ping","payload","strings","fd"};
+
+struct run
+{
+  const char *service;
+  enum tests test;
+  size_t size;
+  size_t requests;
+  const void *payload;
+  char **strings;
+  size_t string_count;
+};
+
+struct worker
+{
+  pthread_t thread;
+  const struct run *run;
+  uint64_t *latencies;
+  size_t done;
+  size_t errors;
+};
+
+static uint64_t
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+
+  return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static int
+one_request(const struct run *run,void *reply)
+{
+  struct msg_connection *conn;
+  int err=-1;
+
+  conn=msg_open(NULL,run->service,0);
+  if(!conn)
+    return -1;
+
+  switch(run->test)
+    {
+    case TEST_PING:
+      {
+        uint8_t val;
+
+        if(msg_write_type(conn,MSG_TYPE_PING)>0
+           && msg_read_uint8(conn,&val)>0)
+          err=0;
+      }
+      break;
+
+    case TEST_PAYLOAD:
+      {
+        size_t length;
+
+        if(msg_write_type(conn,BENCH_PAYLOAD)>0
+           && msg_write_buffer_length(conn,run->size)>0
+           && msg_write_buffer(conn,run->payload,run->size)>0
+           && msg_read_buffer_length(conn,&length)>0
+           && length==run->size
+           && msg_read_buffer(conn,reply,length)>0)
+          err=0;
+      }
+      break;
+
+    case TEST_STRINGS:
+      {
+        uint32_t total;
+        size_t i;
+
+        if(msg_write_type(conn,BENCH_STRINGS)<1
+           || msg_write_uint32(conn,run->string_count)<1)
+          break;
+
+        for(i=0;i<run->string_count;i++)
+          if(msg_write_string(conn,run->strings[i])<1)
+            break;
+
+        if(i==run->string_count && msg_read_uint32(conn,&total)>0)
+          err=0;
+      }
+      break;
+
+    case TEST_FD:
+      {
+        int fd;
+
+        if(msg_write_type(conn,BENCH_FD)>0 && msg_read_fd(conn,&fd)>0)
+          {
+            close(fd);
+            err=0;
+          }
+      }
+      break;
+
+    default:
+      break;
+    }
+
+  if(err)
+    msg_poison(conn);
+
+  msg_close(conn);
+
+  return err;
+}
+
+static void *
+worker_thread(void *w)
+{
+  struct worker *worker=w;
+  void *reply;
+  size_t i;
+
+  reply=malloc(worker->run->size?worker->run->size:1);
+  if(!reply)
+    return NULL;
+
+  for(i=0;i<worker->run->requests;i++)
+    {
+      uint64_t start=now();
+
+      if(one_request(worker->run,reply)==-1)
+        worker->errors++;
+      else
+        worker->latencies[worker->done++]=now()-start;
+    }
+
+  free(reply);
+
+  return NULL;
+}
+
+static int
+compare_latency(const void *a,const void *b)
+{
+  uint64_t la=*(const uint64_t *)a,lb=*(const uint64_t *)b;
+
+  return la<lb?-1:la>lb;
+}
+
+static double
+percentile(const uint64_t *sorted,size_t count,double pct)
+{
+  size_t idx;
+
+  if(!count)
+    return 0;
+
+  idx=(size_t)(pct*count);
+  if(idx>=count)
+    idx=count-1;
+
+  return sorted[idx]/1000.0;
+}
+
+static int
+do_run(const struct run *run,size_t concurrency,int first)
+{
+  struct worker *workers;
+  uint64_t *all,start,elapsed;
+  size_t i,count=0,errors=0;
+  double seconds;
+
+  workers=calloc(concurrency,sizeof(*workers));
+  all=calloc(concurrency*run->requests+1,sizeof(*all));
+  if(!workers || !all)
+    {
+      fprintf(stderr,"Out of memory\n");
+      return -1;
+    }
+
+  start=now();
+
+  for(i=0;i<concurrency;i++)
+    {
+      workers[i].run=run;
+      workers[i].latencies=&all[i*run->requests];
+
+      if(pthread_create(&workers[i].thread,NULL,worker_thread,&workers[i]))
+        {
+          fprintf(stderr,"Unable to create thread\n");
+          return -1;
+        }
+    }
+
+  for(i=0;i<concurrency;i++)
+    pthread_join(workers[i].thread,NULL);
+
+  elapsed=now()-start;
+
+  /* Squeeze the gaps left by failed requests out of the array. */
+  for(i=0;i<concurrency;i++)
+    {
+      memmove(&all[count],workers[i].latencies,
+              workers[i].done*sizeof(*all));
+      count+=workers[i].done;
+      errors+=workers[i].errors;
+    }
+
+  qsort(all,count,sizeof(*all),compare_latency);
+
+  seconds=elapsed/1e9;
+
+  printf("%s    {\"service\": \"%s\", \"test\": \"%s\", \"size\": %zu,"
+         " \"concurrency\": %zu, \"requests\": %zu, \"errors\": %zu,"
+         " \"seconds\": %.6f, \"throughput\": %.1f, \"p50_us\": %.3f,"
+         " \"p99_us\": %.3f, \"p999_us\": %.3f}",first?"":",\n",
+         run->service,test_names[run->test],run->size,concurrency,count,
+         errors,seconds,seconds>0?count/seconds:0.0,
+         percentile(all,count,0.50),percentile(all,count,0.99),
+         percentile(all,count,0.999));
+  fflush(stdout);
+
+  free(all);
+  free(workers);
+
+  return 0;
+}
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr,"Usage: %s [-s service]... [-c concurrency]"
+          " [-n requests] [-t tests] [-p sizes] [-k strings]"
+          " [-l string_length]\n"
+          "  tests is a comma separated list of ping,payload,strings,fd\n"
+          "  sizes is a comma separated list of payload sizes in bytes\n",
+          name);
+  exit(1);
+}
+
+int
+main(int argc,char *argv[])
+{
+  const char *services[64];
+  size_t nservices=0,concurrency=1,requests=10000,string_count=32;
+  size_t string_length=16,sizes[64],nsizes=0,max_size=0,i,j,k;
+  int arg,want[TEST_MAX]={0},any=0,first=1;
+  struct run run;
+  char *payload,**strings,*tok;
+
+  while((arg=getopt(argc,argv,"s:c:n:t:p:k:l:"))!=-1)
+    switch(arg)
+      {
+      case 's':
+        if(nservices==sizeof(services)/sizeof(services[0]))
+          usage(argv[0]);
+        services[nservices++]=optarg;
+        break;
+
+      case 'c':
+        concurrency=strtoul(optarg,NULL,10);
+        break;
+
+      case 'n':
+        requests=strtoul(optarg,NULL,10);
+        break;
+
+      case 't':
+        for(tok=strtok(optarg,",");tok;tok=strtok(NULL,","))
+          {
+            for(i=0;i<TEST_MAX;i++)
+              if(strcmp(tok,test_names[i])==0)
+                break;
+
+            if(i==TEST_MAX)
+              usage(argv[0]);
+
+            want[i]=any=1;
+          }
+        break;
+
+      case 'p':
+        for(tok=strtok(optarg,",");tok;tok=strtok(NULL,","))
+          {
+            if(nsizes==sizeof(sizes)/sizeof(sizes[0]))
+              usage(argv[0]);
+            sizes[nsizes++]=strtoul(tok,NULL,10);
+          }
+        break;
+
+      case 'k':
+        string_count=strtoul(optarg,NULL,10);
+        break;
+
+      case 'l':
+        string_length=strtoul(optarg,NULL,10);
+        break;
+
+      default:
+        usage(argv[0]);
+      }
+
+  if(!concurrency || !requests)
+    usage(argv[0]);
+
+  if(!nservices)
+    services[nservices++]=BENCH_SOCKET;
+
+  if(!any)
+    for(i=0;i<TEST_MAX;i++)
+      want[i]=1;
+
+  if(!nsizes)
+    {
+      /* The edges of the 1, 2 and 5 byte length encodings, and a
+         couple of bulk sizes. */
+      static const size_t default_sizes[]={0,191,192,8383,8384,65536,1048576};
+
+      for(i=0;i<sizeof(default_sizes)/sizeof(default_sizes[0]);i++)
+        sizes[nsizes++]=default_sizes[i];
+    }
+
+  for(i=0;i<nsizes;i++)
+    if(sizes[i]>max_size)
+      max_size=sizes[i];
+
+  payload=malloc(max_size?max_size:1);
+  strings=calloc(string_count+1,sizeof(*strings));
+  if(!payload || !strings)
+    {
+      fprintf(stderr,"Out of memory\n");
+      return 1;
+    }
+
+  for(i=0;i<max_size;i++)
+    payload[i]=i;
+
+  for(i=0;i<string_count;i++)
+    {
+      strings[i]=malloc(string_length+1);
+      if(!strings[i])
+        {
+          fprintf(stderr,"Out of memory\n");
+          return 1;
+        }
+
+      memset(strings[i],'a'+i%26,string_length);
+      strings[i][string_length]='\0';
+    }
+
+  printf("{\n  \"version\": \"%s\",\n  \"results\": [\n",PACKAGE_VERSION);
+
+  for(i=0;i<nservices;i++)
+    for(j=0;j<TEST_MAX;j++)
+      {
+        if(!want[j])
+          continue;
+
+        memset(&run,0,sizeof(run));
+        run.service=services[i];
+        run.test=j;
+        run.requests=requests;
+        run.payload=payload;
+        run.strings=strings;
+        run.string_count=string_count;
+
+        for(k=0;k<(j==TEST_PAYLOAD?nsizes:1);k++)
+          {
+            if(j==TEST_PAYLOAD)
+              run.size=sizes[k];
+            else if(j==TEST_STRINGS)
+              run.size=string_count*string_length;
+
+            if(do_run(&run,concurrency,first)==-1)
+              return 1;
+
+            first=0;
+          }
+      }
+
+  printf("\n  ]\n}\n");
+
+  for(i=0;i<string_count;i++)
+    free(strings[i]);
+  free(strings);
+  free(payload);
+
+  return 0;
+}
@@ -0,0 +1,423 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <dispatch.h>
+#include "conn.h"
+
+/* Microbenchmarks for the typed readers and writers in types.c.  Each
+   codec is run in batches: write a batch into one end, then read it
+   back from the other.  The socketpair transport shows what the
+   encoding costs in syscalls, and the memory transport shows the
+   encoding work alone. */
+
+#define BATCH 64
+
+static char string_16[17]="0123456789abcdef";
+static char string_1000[1001];
+static unsigned char buffer_64[64];
+static uint32_t array_256[256];
+
+struct codec
+{
+  const char *name;
+  int (*write)(struct msg_connection *conn);
+  int (*read)(struct msg_connection *conn);
+  unsigned int needs_socket:1;
+};
+
+static int
+write_length_1(struct msg_connection *conn)
+{
+  return msg_write_buffer_length(conn,100);
+}
+
+static int
+write_length_2(struct msg_connection *conn)
+{
+  return msg_write_buffer_length(conn,1000);
+}
+
+static int
+write_length_5(struct msg_connection *conn)
+{
+  return msg_write_buffer_length(conn,100000);
+}
+
+static int
+read_length(struct msg_connection *conn)
+{
+  size_t length;
+
+  return msg_read_buffer_length(conn,&length);
+}
+
+static int
+write_uint8(struct msg_connection *conn)
+{
+  return msg_write_uint8(conn,0xA5);
+}
+
+static int
+read_uint8(struct msg_connection *conn)
+{
+  uint8_t val;
+
+  return msg_read_uint8(conn,&val);
+}
+
+static int
+write_uint16(struct msg_connection *conn)
+{
+  return msg_write_uint16(conn,0xA5A5);
+}
+
+static int
+read_uint16(struct msg_connection *conn)
+{
+  uint16_t val;
+
+  return msg_read_uint16(conn,&val);
+}
+
+static int
+write_int32(struct msg_connection *conn)
+{
+  return msg_write_int32(conn,-123456789);
+}
+
+static int
+read_int32(struct msg_connection *conn)
+{
+  int32_t val;
+
+  return msg_read_int32(conn,&val);
+}
+
+static int
+write_uint32(struct msg_connection *conn)
+{
+  return msg_write_uint32(conn,0xA5A5A5A5);
+}
+
+static int
+read_uint32(struct msg_connection *conn)
+{
+  uint32_t val;
+
+  return msg_read_uint32(conn,&val);
+}
+
+static int
+write_int64(struct msg_connection *conn)
+{
+  return msg_write_int64(conn,-1234567890123456789LL);
+}
+
+static int
+read_int64(struct msg_connection *conn)
+{
+  int64_t val;
+
+  return msg_read_int64(conn,&val);
+}
+
+static int
+write_uint64(struct msg_connection *conn)
+{
+  return msg_write_uint64(conn,0xA5A5A5A5A5A5A5A5ULL);
+}
+
+static int
+read_uint64(struct msg_connection *conn)
+{
+  uint64_t val;
+
+  return msg_read_uint64(conn,&val);
+}
+
+static int
+write_varint64_small(struct msg_connection *conn)
+{
+  return msg_write_varint64(conn,-42);
+}
+
+static int
+write_varint64_large(struct msg_connection *conn)
+{
+  return msg_write_varint64(conn,-1234567890123456789LL);
+}
+
+static int
+read_varint64(struct msg_connection *conn)
+{
+  int64_t val;
+
+  return msg_read_varint64(conn,&val);
+}
+
+static int
+write_string_null(struct msg_connection *conn)
+{
+  return msg_write_string(conn,NULL);
+}
+
+static int
+write_string_16(struct msg_connection *conn)
+{
+  return msg_write_string(conn,string_16);
+}
+
+static int
+write_string_1000(struct msg_connection *conn)
+{
+  return msg_write_string(conn,string_1000);
+}
+
+static int
+read_string(struct msg_connection *conn)
+{
+  char *string;
+  int err;
+
+  err=msg_read_string(conn,&string);
+  free(string);
+
+  return err;
+}
+
+static int
+write_buffer_64(struct msg_connection *conn)
+{
+  int err;
+
+  err=msg_write_buffer_length(conn,sizeof(buffer_64));
+  if(err<1)
+    return err;
+
+  return msg_write_buffer(conn,buffer_64,sizeof(buffer_64));
+}
+
+static int
+read_buffer_64(struct msg_connection *conn)
+{
+  unsigned char buffer[sizeof(buffer_64)];
+  size_t length;
+  int err;
+
+  err=msg_read_buffer_length(conn,&length);
+  if(err<1)
+    return err;
+
+  if(length!=sizeof(buffer))
+    return -1;
+
+  return msg_read_buffer(conn,buffer,length);
+}
+
+static int
+write_uint32_array_256(struct msg_connection *conn)
+{
+  return msg_write_uint32_array(conn,array_256,256);
+}
+
+static int
+read_uint32_array_256(struct msg_connection *conn)
+{
+  uint32_t vals[256];
+  size_t count;
+  int err;
+
+  err=msg_read_array_length(conn,&count);
+  if(err<1)
+    return err;
+
+  if(count!=256)
+    return -1;
+
+  return msg_read_uint32_array(conn,vals,count);
+}
+
+static int
+write_fd(struct msg_connection *conn)
+{
+  static int fd=-1;
+
+  if(fd==-1)
+    fd=open("/dev/null",O_RDONLY|O_CLOEXEC);
+
+  return msg_write_fd(conn,fd);
+}
+
+static int
+read_fd(struct msg_connection *conn)
+{
+  int fd,err;
+
+  err=msg_read_fd(conn,&fd);
+  if(err>0)
+    close(fd);
+
+  return err;
+}
+
+static const struct codec codecs[]=
+  {
+    {"length_1",write_length_1,read_length},
+    {"length_2",write_length_2,read_length},
+    {"length_5",write_length_5,read_length},
+    {"uint8",write_uint8,read_uint8},
+    {"uint16",write_uint16,read_uint16},
+    {"int32",write_int32,read_int32},
+    {"uint32",write_uint32,read_uint32},
+    {"int64",write_int64,read_int64},
+    {"uint64",write_uint64,read_uint64},
+    {"varint64_small",write_varint64_small,read_varint64},
+    {"varint64_large",write_varint64_large,read_varint64},
+    {"string_null",write_string_null,read_string},
+    {"string_16",write_string_16,read_string},
+    {"string_1000",write_string_1000,read_string},
+    {"buffer_64",write_buffer_64,read_buffer_64},
+    {"uint32_array_256",write_uint32_array_256,read_uint32_array_256},
+    {"fd",write_fd,read_fd,1},
+    {NULL}
+  };
+
+static uint64_t
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+
+  return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static int
+run_codec(const struct codec *codec,const char *transport,
+          struct msg_connection *writer,struct msg_connection *reader,
+          size_t iterations,int first)
+{
+  uint64_t write_ns=0,read_ns=0,start;
+  unsigned long write_calls,read_calls;
+  size_t done,i;
+
+  write_calls=writer->syscalls.writes+writer->syscalls.reads;
+  read_calls=reader->syscalls.writes+reader->syscalls.reads;
+
+  for(done=0;done<iterations;done+=BATCH)
+    {
+      start=now();
+      for(i=0;i<BATCH;i++)
+        if((codec->write)(writer)<1)
+          {
+            fprintf(stderr,"%s write failed on %s: %s\n",codec->name,
+                    transport,strerror(errno));
+            return -1;
+          }
+      write_ns+=now()-start;
+
+      start=now();
+      for(i=0;i<BATCH;i++)
+        if((codec->read)(reader)<1)
+          {
+            fprintf(stderr,"%s read failed on %s: %s\n",codec->name,
+                    transport,strerror(errno));
+            return -1;
+          }
+      read_ns+=now()-start;
+    }
+
+  write_calls=writer->syscalls.writes+writer->syscalls.reads-write_calls;
+  read_calls=reader->syscalls.writes+reader->syscalls.reads-read_calls;
+
+  printf("%s    {\"codec\": \"%s\", \"transport\": \"%s\", \"ops\": %zu,"
+         " \"write_ns_per_op\": %.1f, \"read_ns_per_op\": %.1f,"
+         " \"write_syscalls_per_op\": %.2f, \"read_syscalls_per_op\": %.2f}",
+         first?"":",\n",codec->name,transport,done,
+         (double)write_ns/done,(double)read_ns/done,
+         (double)write_calls/done,(double)read_calls/done);
+
+  return 0;
+}
+
+int
+main(int argc,char *argv[])
+{
+  size_t iterations=100000,i;
+  struct msg_connection *memory,sockets[2];
+  int sv[2],arg,first=1;
+  const char *only=NULL;
+
+  while((arg=getopt(argc,argv,"n:c:"))!=-1)
+    switch(arg)
+      {
+      case 'n':
+        iterations=strtoul(optarg,NULL,10);
+        break;
+
+      case 'c':
+        only=optarg;
+        break;
+
+      default:
+        fprintf(stderr,"Usage: %s [-n iterations] [-c codec]\n",argv[0]);
+        return 1;
+      }
+
+  memset(string_1000,'x',sizeof(string_1000)-1);
+
+  memory=memory_connection(4096);
+  if(!memory)
+    {
+      fprintf(stderr,"Out of memory\n");
+      return 1;
+    }
+
+  if(socketpair(AF_LOCAL,SOCK_STREAM,0,sv)==-1)
+    {
+      fprintf(stderr,"Unable to make socketpair: %s\n",strerror(errno));
+      return 1;
+    }
+
+  memset(sockets,0,sizeof(sockets));
+  sockets[0].fd=sv[0];
+  sockets[0].bits.internal=1;
+  sockets[1].fd=sv[1];
+  sockets[1].bits.internal=1;
+
+  printf("{\n  \"version\": \"%s\",\n  \"results\": [\n",PACKAGE_VERSION);
+
+  for(i=0;codecs[i].name;i++)
+    {
+      if(only && strcmp(only,codecs[i].name)!=0)
+        continue;
+
+      if(!codecs[i].needs_socket)
+        {
+          if(run_codec(&codecs[i],"memory",memory,memory,iterations,first))
+            return 1;
+
+          first=0;
+        }
+
+      if(run_codec(&codecs[i],"socketpair",&sockets[0],&sockets[1],
+                   iterations,first))
+        return 1;
+
+      first=0;
+    }
+
+  printf("\n  ]\n}\n");
+
+  msg_close(memory);
+  close_connection(&sockets[0]);
+  close_connection(&sockets[1]);
+
+  return 0;
+}
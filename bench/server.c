@@ -0,0 +1,136 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dispatch.h>
+#include "bench.h"
+
+/* The reference server for bench-client.  It listens on every service
+   named on the command line, so path and abstract sockets can be
+   measured against the same process. */
+
+static int
+do_payload(uint16_t type,struct msg_connection *conn)
+{
+  size_t length;
+  void *buffer;
+  int err=-1;
+
+  if(msg_read_buffer_length(conn,&length)<1)
+    return -1;
+
+  buffer=malloc(length?length:1);
+  if(!buffer)
+    return -1;
+
+  if(msg_read_buffer(conn,buffer,length)>0
+     && msg_write_buffer_length(conn,length)>0
+     && msg_write_buffer(conn,buffer,length)>0)
+    err=0;
+
+  free(buffer);
+
+  return err;
+}
+
+static int
+do_strings(uint16_t type,struct msg_connection *conn)
+{
+  uint32_t count,total=0;
+
+  if(msg_read_uint32(conn,&count)<1)
+    return -1;
+
+  while(count--)
+    {
+      char *string;
+
+      if(msg_read_string(conn,&string)<1)
+        return -1;
+
+      if(string)
+        total+=strlen(string);
+
+      free(string);
+    }
+
+  return msg_write_uint32(conn,total)>0?0:-1;
+}
+
+static int
+do_fd(uint16_t type,struct msg_connection *conn)
+{
+  int fd,err;
+
+  fd=open("/dev/null",O_RDONLY|O_CLOEXEC);
+  if(fd==-1)
+    return -1;
+
+  err=msg_write_fd(conn,fd);
+
+  close(fd);
+
+  return err>0?0:-1;
+}
+
+static struct msg_handler handlers[]=
+  {
+    {BENCH_PAYLOAD,do_payload},
+    {BENCH_STRINGS,do_strings},
+    {BENCH_FD,do_fd},
+    {0,NULL}
+  };
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr,"Usage: %s [-c max_concurrency] [-b backlog]"
+          " [service ...]\n",name);
+  exit(1);
+}
+
+int
+main(int argc,char *argv[])
+{
+  struct msg_config config;
+  int arg,i;
+
+  msg_config_init(&config);
+
+  while((arg=getopt(argc,argv,"c:b:"))!=-1)
+    switch(arg)
+      {
+      case 'c':
+        config.max_concurrency=strtoul(optarg,NULL,10);
+        break;
+
+      case 'b':
+        config.listen_backlog=atoi(optarg);
+        break;
+
+      default:
+        usage(argv[0]);
+      }
+
+  msg_init(&config);
+
+  for(i=optind;i==optind || i<argc;i++)
+    {
+      const char *service=i<argc?argv[i]:BENCH_SOCKET;
+
+      if(msg_listen(NULL,service,0,handlers)==-1)
+        {
+          fprintf(stderr,"Unable to listen on socket %s: %s\n",
+                  service,strerror(errno));
+          return 1;
+        }
+    }
+
+  for(;;)
+    pause();
+
+  return 0;
+}
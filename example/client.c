@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <dispatch.h>
 #include "common.h"
+#include "greeting.h"
 
 int
 main(int argc,char *argv[])
@@ -11,6 +12,8 @@ main(int argc,char *argv[])
   struct msg_connection *conn;
   int err;
   struct msg_peerinfo info;
+  uint32_t numbers[]={1,2,3};
+  struct greeting greeting={"Hello from the client",numbers,3};
 
   printf("Sending message 1...\n");
 
@@ -30,6 +33,26 @@ main(int argc,char *argv[])
     printf("\tPeer info: PID %u.  Peer UID %u.  Peer GID %u.\n",
            info.local.pid,info.local.uid,info.local.gid);
 
+  msg_close(conn);
+
+  printf("Sending a greeting...\n");
+
+  conn=msg_open(NULL,MY_SOCKET,0);
+  if(!conn)
+    {
+      fprintf(stderr,"Unable to open socket %s: %s\n",
+              MY_SOCKET,strerror(errno));
+      goto fail;
+    }
+
+  err=msg_write_type(conn,GREETING_TYPE);
+  if(err<1)
+    goto fail;
+
+  err=greeting_write(conn,&greeting);
+  if(err<1)
+    goto fail;
+
  fail:
   msg_close(conn);
 
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <dispatch.h>
 #include "common.h"
+#include "greeting.h"
 
 static int
 do_msg_1(uint16_t type,struct msg_connection *conn)
@@ -20,6 +21,25 @@ do_msg_1(uint16_t type,struct msg_connection *conn)
   return 0;
 }
 
+static int
+do_greeting(uint16_t type,struct msg_connection *conn)
+{
+  struct greeting greeting;
+  size_t i;
+
+  if(greeting_read(conn,&greeting)<1)
+    return -1;
+
+  printf("I'm in greeting: %s\n",greeting.text?greeting.text:"(null)");
+
+  for(i=0;i<greeting.numbers_count;i++)
+    printf("\tNumber %zu is %"PRIu32"\n",i,greeting.numbers[i]);
+
+  greeting_free(&greeting);
+
+  return 0;
+}
+
 static int
 do_panic(uint16_t type,struct msg_connection *conn)
 {
@@ -31,6 +51,7 @@ do_panic(uint16_t type,struct msg_connection *conn)
 static struct msg_handler handlers[]=
   {
     {MY_MSG_1,do_msg_1},
+    {GREETING_TYPE,do_greeting},
     {MSG_TYPE_PANIC,do_panic},
     {0,NULL}
   };
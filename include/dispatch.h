@@ -11,12 +11,45 @@ extern "C" {
 /* Some types */
 struct msg_connection;
 
+/* Where and how the worker threads for a message type run. */
+struct msg_sched
+{
+  /* The message type.  0 ends a table of these. */
+  uint16_t type;
+
+  /* CPUs the workers may run on, as a list like "0-7,16-23".  A
+     worker starts on them, so on a NUMA machine its stack comes from
+     their node.  Only the stack: the connection it is handed was set
+     up by the accept thread, and its memory is local to accept_cpus.
+     NULL leaves it to the scheduler. */
+  const char *cpus;
+
+  /* A scheduling policy such as SCHED_FIFO, with its priority.  0
+     (SCHED_OTHER) leaves the policy alone. */
+  int policy;
+  int priority;
+
+  /* A nice level for each worker.  0 leaves it alone. */
+  int nice;
+};
+
 /* The handler callback should return 0 for success, and -1 for
    failure. */
 struct msg_handler
 {
   uint16_t type;
   int (*handler)(uint16_t type,struct msg_connection *conn);
+
+  /* For a handler whose reply depends on nothing but the request:
+     keep replies this many milliseconds, and answer the same request
+     from the cache without calling the handler.  0 never caches.
+     See msg_cache_stats(). */
+  unsigned int cache_ttl;
+
+  /* For the same kind of handler: while it runs, park any identical
+     requests that arrive, and answer them all with its one reply
+     instead of calling it again for each. */
+  unsigned int coalesce;
 };
 
 struct msg_config
@@ -32,8 +65,121 @@ struct msg_config
   {
     unsigned int failed_accept;
   } log_on;
+  struct
+  {
+    /* Number of events each thread keeps in its flight recorder
+       ring.  Rounded up to a power of two.  0 disables tracing. */
+    size_t events;
+
+    /* If nonzero, the signal that makes the process dump its flight
+       recorder on demand, to file below. */
+    int signal;
+
+    /* Where dumps go, as file.1, file.2 and so on.  Each is a new
+       file, and nothing already there is written over.  NULL writes
+       no dumps, though msg_trace_dump() still works. */
+    const char *file;
+  } trace;
+  struct
+  {
+    /* One of the MSG_COMPRESS_* codecs.  A client uses it for
+       connections opened with MSG_COMPRESS.  A server uses it to
+       answer clients that asked for the same codec. */
+    int codec;
+
+    /* Codec specific.  For zlib, 1 (fastest) to 9 (smallest). */
+    int level;
+
+    /* Strings and buffers shorter than this are never compressed. */
+    size_t threshold;
+  } compress;
+  struct
+  {
+    /* CPUs the accept thread runs on, in the same form as
+       msg_sched.cpus.  With MSG_NORETURN that is the caller's thread.
+       NULL leaves it alone. */
+    const char *accept_cpus;
+
+    /* How worker threads run.  The type is ignored. */
+    struct msg_sched workers;
+
+    /* Overrides for some message types, ended by an entry with type
+       0.  Anything an entry leaves as 0 or NULL comes from workers.
+       The table is not copied, and must outlive the listeners. */
+    const struct msg_sched *types;
+  } sched;
+
+  struct
+  {
+    /* If set, the limit on concurrent handlers follows their latency
+       between min and max_concurrency, rather than sitting at
+       max_concurrency.  It grows while handlers keep up, and shrinks
+       when their average latency rises more than tolerance times
+       above the best seen (2.0 lets it double). */
+    int adaptive;
+    size_t min;
+    size_t initial;
+    double tolerance;
+  } limit;
+
+  struct
+  {
+    /* Bytes of replies kept for handlers with a cache_ttl. */
+    size_t size;
+  } cache;
+
+  struct
+  {
+    /* Bytes of requests a server takes in one batch. */
+    size_t size;
+  } batch;
+
+  struct
+  {
+    /* If set, each request's CPU time, syscalls and bytes are added
+       up by type and by peer, for msg_usage_types() and
+       msg_usage_peers().  With log_interval, every that many seconds
+       the log_top types and peers using the most CPU are logged. */
+    int enabled;
+    unsigned int log_interval;
+    size_t log_top;
+  } account;
+
+  struct
+  {
+    /* If set, the server hands its listening socket to processes of
+       the same user that ask with msg_handoff_receive(). */
+    int enabled;
+  } handoff;
+
+  struct
+  {
+    /* If set, listeners take subscribers for msg_publish().  Others
+       refuse them with EOPNOTSUPP. */
+    int enabled;
+
+    /* Subscribers the process keeps at once.  Each holds a socket
+       open, so past this many new ones are refused with EAGAIN.  0 is
+       no limit. */
+    size_t subscribers;
+
+    /* Messages that may wait to go out to one subscriber.  Past that
+       it misses new ones, or with disconnect, is cut off.  0 is no
+       limit. */
+    size_t queue;
+    int disconnect;
+  } publish;
+
+  /* Milliseconds a read or write may wait on a stalled peer before
+     failing with ETIMEDOUT, on connections both opened and accepted.
+     0 waits forever. */
+  unsigned int io_timeout;
 };
 
+/* Compression codecs */
+#define MSG_COMPRESS_NONE 0
+#define MSG_COMPRESS_ZLIB 1
+
 /* Fill in a msg_config structure with the default values. */
 
 void msg_config_init(struct msg_config *config);
@@ -50,6 +196,79 @@ int msg_init(const struct msg_config *config);
 
 struct msg_connection *msg_open(const char *host,const char *service,int flags);
 
+/* The same, giving the request timeout milliseconds.  The deadline
+   goes to the server, which drops the request unhandled if it is
+   already past when the request is accepted, and which hands the
+   handler msg_deadline_remaining().  Reads and writes past it fail
+   with ETIMEDOUT at either end.  Only a server that has said it reads
+   deadlines gets one, which takes a ping the first time a service is
+   opened this way and every minute after.  Others, and services that
+   don't answer, still get the request, and the deadline is only kept
+   by the client. */
+
+struct msg_connection *msg_open_timeout(const char *host,const char *service,
+                                        int flags,unsigned int timeout);
+
+/* Milliseconds left before the connection's deadline, 0 if it has
+   passed, or -1 if it has none.  A handler can pass this on to
+   msg_open_timeout() for the calls it makes in turn. */
+
+long msg_deadline_remaining(struct msg_connection *conn);
+
+/* A group is a set of services that are replicas of each other.
+   Each msg_group_open() picks one by the policy below and opens a
+   connection to it, moving on to another if that fails.  A service
+   that fails to open or to answer a ping sits out for a while.
+
+   interval is how often, in milliseconds, a thread sends each
+   service MSG_TYPE_PING.  Besides finding dead services, the ping
+   times tell which are running hot, and the two load aware policies
+   send those fewer requests.  0 means no pings: services are only
+   found dead by failing to open.
+
+   Every connection from a group must be closed before
+   msg_group_free(). */
+
+struct msg_group;
+
+/* Selection policies */
+#define MSG_GROUP_ROUND_ROBIN       0
+#define MSG_GROUP_LEAST_OUTSTANDING 1  /* Fewest open connections */
+#define MSG_GROUP_TWO_CHOICES       2  /* The better of two at random */
+#define MSG_GROUP_HASH              3  /* Same key, same service */
+
+struct msg_group *msg_group_new(const char *const *services,size_t count,
+                                int policy,unsigned int interval);
+
+/* key is only used by MSG_GROUP_HASH.  Without one it acts like
+   MSG_GROUP_ROUND_ROBIN. */
+
+struct msg_connection *msg_group_open(struct msg_group *group,
+                                      const char *key,int flags);
+void msg_group_free(struct msg_group *group);
+
+/* Hedged calls.  msg_group_call() sends type and the contents of the
+   request builder to a member, and returns the connection once the
+   reply starts to arrive, ready for the caller to read.  If type has
+   been marked with msg_group_hedge() and no reply comes within the
+   percentile of recent reply times, the same request goes to a
+   second member too.  Whichever answers first is returned, and the
+   other is poisoned and closed.  Mark only types that are safe to run
+   twice.
+
+   Hedging is held to budget percent of calls, so it can't double the
+   load on a group that is already slow.  It never starts sooner than
+   min_delay milliseconds.  The defaults are the 95th percentile, a
+   budget of 5%, and 1ms. */
+
+int msg_group_hedge(struct msg_group *group,uint16_t type);
+int msg_group_hedging(struct msg_group *group,double percentile,
+                      double budget,unsigned int min_delay);
+struct msg_connection *msg_group_call(struct msg_group *group,const char *key,
+                                      uint16_t type,
+                                      struct msg_connection *request,
+                                      int flags);
+
 /* Possible flags are:
 
    No longer used, but ignored for backwards compatibility. */
@@ -64,6 +283,13 @@ struct msg_connection *msg_open(const char *host,const char *service,int flags);
 /* Retry on EINTR */
 #define MSG_RETRY 8
 
+/* Compress large strings and buffers in both directions, using the
+   codec from msg_config.  The client first pings the service, at
+   most once a minute, and only compresses what it sends if the
+   answer says the server reads it.  Replies are compressed only by
+   servers that do. */
+#define MSG_COMPRESS 16
+
 /* TODO: add the getaddrinfo flags here, a la NUMERICHOST, etc. */
 
 /* Read and write to an open connection.  Treat these as you would
@@ -86,17 +312,102 @@ int msg_poison(struct msg_connection *conn);
 
 int msg_close(struct msg_connection *conn);
 
+/* The limit on concurrent handlers in force right now.  With
+   msg_config.limit.adaptive, this is what it has settled on. */
+
+size_t msg_concurrency_limit(void);
+
+/* The reply cache.  A request is found in the cache only if it is
+   already waiting in the socket when the server looks, so clients
+   should send cacheable requests in one write, with a builder.
+   Replies to handlers that read after they start writing, or pass
+   fds, are never cached.  The same holds for coalescing, and
+   coalesced counts the requests answered by another's handler. */
+
+struct msg_cache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t coalesced;
+  size_t entries;
+  size_t bytes;
+};
+
+/* Drop the cached replies for a type, or for every type if 0. */
+void msg_cache_invalidate(uint16_t type);
+void msg_cache_stats(struct msg_cache_stats *stats);
+
+/* What requests have cost the server, with msg_config.account.  A
+   peer is a local process; requests over the network only count
+   towards their type.  Both calls fill in up to count entries,
+   costliest in CPU first, and return how many there are in all. */
+
+struct msg_usage
+{
+  uint64_t requests;
+  uint64_t cpu_ns;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+};
+
+struct msg_type_usage
+{
+  uint16_t type;
+  struct msg_usage usage;
+};
+
+struct msg_peer_usage
+{
+  pid_t pid;
+  uid_t uid;
+  struct msg_usage usage;
+};
+
+size_t msg_usage_types(struct msg_type_usage *usage,size_t count);
+size_t msg_usage_peers(struct msg_peer_usage *usage,size_t count);
+void msg_usage_reset(void);
+
 /* Listen on host/service. Same flags as msg_open. */
 int msg_listen(const char *host,const char *service,int flags,
                struct msg_handler *handlers);
 
+/* Serve from a socket that is already listening, such as one passed
+   in by systemd or a supervisor, or one from msg_handoff_receive().
+   On success the socket belongs to dispatch.  It fails with EINVAL if
+   fd is not listening. */
+int msg_listen_fd(int fd,int flags,struct msg_handler *handlers);
+
+/* Ask the server at service for its listening socket, so a
+   replacement can serve it with msg_listen_fd() without a moment
+   where connections are refused.  A server with
+   msg_config.handoff.enabled answers MSG_TYPE_HANDOFF from processes
+   running as the same user (others get EPERM), and then keeps
+   accepting too, so both serve the socket until the old one exits.
+   A handler for MSG_TYPE_HANDOFF in its table is called after the
+   socket has been sent, as the cue to wind down.  Servers without
+   handoff refuse with EOPNOTSUPP and carry on.  Returns the socket,
+   or -1 with errno set. */
+int msg_handoff_receive(const char *service);
+
 /* The handler function should return 1 for success, and -1 for failure. */
 
 #define msg_read_type(_c,_v) msg_read_uint16(_c,_v)
 #define msg_write_type(_c,_v) msg_write_uint16(_c,_v)
 
-/* Some predefined types */
+/* Some predefined types.  MSG_TYPE_SUBSCRIBE, MSG_TYPE_BATCH and
+   MSG_TYPE_HANDOFF took over 65531 to 65533, which applications were
+   free to use before.  A handler registered for any of them still
+   gets it, and that server goes without the built in, except that
+   with msg_config.handoff.enabled the handoff handler becomes the cue
+   above.  New types should stay below
+   65531. */
 #define MSG_TYPE_RESERVED 0
+#define MSG_TYPE_SUBSCRIBE 65531
+#define MSG_TYPE_BATCH    65532
+#define MSG_TYPE_HANDOFF  65533
 #define MSG_TYPE_PING     65534
 #define MSG_TYPE_PANIC    65535  /* Must not return */
 
@@ -142,9 +453,140 @@ int msg_read_uint64(struct msg_connection *conn,uint64_t *val);
 int msg_write_uint64(struct msg_connection *conn,uint64_t val);
 #define msg_skip_uint64(_c) msg_skip_bytes((_c),8)
 
+/* Variable length integers.  These take 1 byte for values under 128
+   and grow by a byte per 7 bits, so they are a good deal smaller than
+   the fixed width types when values are usually small.  The signed
+   versions are zigzag encoded, so small negative values are short as
+   well.  They return the number of bytes used on success.  A value
+   too large for a 32 bit reader fails with ERANGE.  These are not
+   interchangeable with the fixed width types on the wire. */
+
+int msg_read_varuint32(struct msg_connection *conn,uint32_t *val);
+int msg_write_varuint32(struct msg_connection *conn,uint32_t val);
+
+int msg_read_varint32(struct msg_connection *conn,int32_t *val);
+int msg_write_varint32(struct msg_connection *conn,int32_t val);
+
+int msg_read_varuint64(struct msg_connection *conn,uint64_t *val);
+int msg_write_varuint64(struct msg_connection *conn,uint64_t val);
+
+int msg_read_varint64(struct msg_connection *conn,int64_t *val);
+int msg_write_varint64(struct msg_connection *conn,int64_t val);
+
 int msg_read_fd(struct msg_connection *conn,int *fd);
 int msg_write_fd(struct msg_connection *conn,int fd);
 
+/* Arrays of integers are sent as one block: the element count, then
+   the elements.  msg_write_*_array() sends both.  To receive, call
+   msg_read_array_length() for the count, make room for that many
+   elements, and then msg_read_*_array() decodes straight into it. */
+
+int msg_read_array_length(struct msg_connection *conn,size_t *count);
+
+int msg_read_uint8_array(struct msg_connection *conn,uint8_t *vals,
+                         size_t count);
+int msg_write_uint8_array(struct msg_connection *conn,const uint8_t *vals,
+                          size_t count);
+
+int msg_read_uint16_array(struct msg_connection *conn,uint16_t *vals,
+                          size_t count);
+int msg_write_uint16_array(struct msg_connection *conn,const uint16_t *vals,
+                           size_t count);
+
+int msg_read_int32_array(struct msg_connection *conn,int32_t *vals,
+                         size_t count);
+int msg_write_int32_array(struct msg_connection *conn,const int32_t *vals,
+                          size_t count);
+
+int msg_read_uint32_array(struct msg_connection *conn,uint32_t *vals,
+                          size_t count);
+int msg_write_uint32_array(struct msg_connection *conn,const uint32_t *vals,
+                           size_t count);
+
+int msg_read_int64_array(struct msg_connection *conn,int64_t *vals,
+                         size_t count);
+int msg_write_int64_array(struct msg_connection *conn,const int64_t *vals,
+                          size_t count);
+
+int msg_read_uint64_array(struct msg_connection *conn,uint64_t *vals,
+                          size_t count);
+int msg_write_uint64_array(struct msg_connection *conn,const uint64_t *vals,
+                           size_t count);
+
+/* The same for strings.  Each entry of the array read is allocated
+   and must be freed by the caller.  NULL entries are preserved. */
+
+int msg_read_string_array(struct msg_connection *conn,char **strings,
+                          size_t count);
+int msg_write_string_array(struct msg_connection *conn,char *const *strings,
+                           size_t count);
+
+/* Builders and readers are connections that live in memory.  Every
+   msg_write_* function works on a builder, appending to its buffer,
+   and the whole message can then go out with msg_builder_send() in a
+   single write.  A builder can be sent any number of times, so a
+   message that never changes only needs encoding once.  A reader
+   decodes a buffer already in hand (such as a captured request) with
+   the msg_read_* functions, and runs out with EOF.  Neither can carry
+   file descriptors.  Free both with msg_close(). */
+
+struct msg_connection *msg_builder_new(size_t size_hint);
+const void *msg_builder_data(struct msg_connection *builder,size_t *length);
+int msg_builder_send(struct msg_connection *builder,
+                     struct msg_connection *conn);
+void msg_builder_reset(struct msg_connection *builder);
+
+/* The reader does not copy buffer, which must stay put until the
+   reader is closed. */
+
+struct msg_connection *msg_reader_new(const void *buffer,size_t length);
+
+/* Batches send many requests of one type over one connection.  Each
+   msg_batch_add() returns a builder to write the next request into,
+   which is only good until the next add or the commit.
+   msg_batch_commit() sends them all, in one write, to a connection
+   the caller has opened and not written to.  The server runs the
+   handler on each in turn and answers in order; each
+   msg_batch_next() returns the next reply as a reader, to be closed
+   by the caller, or NULL if the handler failed on that request.  A
+   handler has failed when it returns a negative value; 0 and 1 are
+   both success, as they are everywhere else in dispatch.  It
+   returns 0 once every reply has been read.  Batched handlers must
+   read all of their request and only then write their reply, and
+   can't pass fds.  Otherwise each request is served as if it came on
+   a connection of its own: through the cache, counted by
+   msg_config.account under its type, and with msg_peerinfo() giving
+   the batch's peer.  The connection is the caller's to close, after
+   msg_batch_free(). */
+
+struct msg_batch;
+
+struct msg_batch *msg_batch_begin(uint16_t type);
+struct msg_connection *msg_batch_add(struct msg_batch *batch);
+int msg_batch_commit(struct msg_batch *batch,struct msg_connection *conn);
+int msg_batch_next(struct msg_batch *batch,struct msg_connection **reply);
+void msg_batch_free(struct msg_batch *batch);
+
+/* Publish/subscribe.  msg_subscribe() opens a connection to a server
+   that stays open to carry every message later published under topic
+   in that server's process.  msg_subscription_read() waits for the
+   next, and returns it as a reader for the caller to close, or 0 once
+   the server has gone.
+
+   msg_publish() sends the contents of a builder to every subscriber
+   to topic, and returns how many it was queued for.  It is encoded
+   once and shared, and a thread of its own writes it out, so
+   publish never waits on a subscriber.  msg_config.publish turns
+   subscribing on, and limits how many may subscribe and how far one
+   may fall behind.  msg_subscribe() fails with the server's errno
+   if it refuses. */
+
+struct msg_connection *msg_subscribe(const char *host,const char *service,
+                                     const char *topic,int flags);
+int msg_subscription_read(struct msg_connection *conn,
+                          struct msg_connection **message);
+int msg_publish(const char *topic,struct msg_connection *message);
+
 enum msg_peerinfo_types {MSG_PEERINFO_LOCAL};
 
 struct msg_peerinfo
@@ -160,6 +602,13 @@ struct msg_peerinfo
 
 int msg_peerinfo(struct msg_connection *conn,struct msg_peerinfo *info);
 
+/* Write the flight recorder of every thread to fd.  The dump is a
+   binary file that dispatch-trace turns into a timeline.  With
+   msg_config.trace.file set, this is done automatically on a
+   panic. */
+
+int msg_trace_dump(int fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,500 @@
+#ifndef _DISPATCH_HPP_
+#define _DISPATCH_HPP_
+
+/* A header-only C++17 layer over dispatch.h.  Everything here is an
+   inline wrapper that resolves at compile time to the C function it
+   stands for: no virtual calls, no exceptions, and no allocation
+   beyond what the C function itself does.  Return values follow the
+   C conventions (-1 on error with errno set, 0 on EOF, >0 on
+   success).
+
+   Reading and writing picks the codec from the type:
+
+     uint32_t count;
+     std::string name;
+
+     if(dispatch::read(conn,count)<1 || dispatch::read(conn,name)<1)
+       return -1;
+
+   A handler table is built from a list of types and functions:
+
+     using table=dispatch::handler_table<
+       dispatch::handler<MSG_GET,do_get,1000,true>,
+       dispatch::handler<MSG_PUT,do_put>>;
+
+   where MSG_GET's replies are cached for a second and identical
+   requests are coalesced.
+
+     dispatch::listen<table>("/tmp/service");
+
+   If std::span is available (C++20), spans of integers are sent and
+   received as arrays. */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if __cplusplus>=202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define DISPATCH_HAVE_SPAN 1
+#endif
+#endif
+
+#include <dispatch.h>
+
+namespace dispatch
+{
+  /* An open connection, closed when it goes out of scope.  It can be
+     moved but not copied. */
+
+  class connection
+  {
+  public:
+    connection() noexcept : conn_(nullptr)
+    {
+    }
+
+    /* Take ownership of a connection from msg_open(). */
+    explicit connection(msg_connection *conn) noexcept : conn_(conn)
+    {
+    }
+
+    explicit connection(const char *service,int flags=0) noexcept
+      : conn_(msg_open(nullptr,service,flags))
+    {
+    }
+
+    connection(connection &&other) noexcept : conn_(other.release())
+    {
+    }
+
+    connection &
+    operator=(connection &&other) noexcept
+    {
+      if(this!=&other)
+        reset(other.release());
+
+      return *this;
+    }
+
+    connection(const connection &)=delete;
+    connection &operator=(const connection &)=delete;
+
+    ~connection()
+    {
+      reset();
+    }
+
+    msg_connection *
+    get() const noexcept
+    {
+      return conn_;
+    }
+
+    /* False if the open failed.  errno says why. */
+    explicit operator bool() const noexcept
+    {
+      return conn_!=nullptr;
+    }
+
+    operator msg_connection *() const noexcept
+    {
+      return conn_;
+    }
+
+    msg_connection *
+    release() noexcept
+    {
+      msg_connection *conn=conn_;
+
+      conn_=nullptr;
+
+      return conn;
+    }
+
+    void
+    reset(msg_connection *conn=nullptr) noexcept
+    {
+      if(conn_)
+        msg_close(conn_);
+
+      conn_=conn;
+    }
+
+    /* Close without letting the connection be reused. */
+    void
+    poison() noexcept
+    {
+      if(conn_)
+        msg_poison(conn_);
+    }
+
+  private:
+    msg_connection *conn_;
+  };
+
+  /* Wrappers that pick a different codec for the same C++ type. */
+
+  template<typename T>
+  struct varint
+  {
+    T value;
+  };
+
+  struct fd
+  {
+    int value;
+  };
+
+  /* codec<T> knows how to read and write a T.  Unsupported types fail
+     to compile. */
+
+  template<typename T,typename Enable=void>
+  struct codec;
+
+#define DISPATCH_CODEC(_type,_name)                                     \
+  template<>                                                            \
+  struct codec<_type>                                                   \
+  {                                                                     \
+    static int                                                          \
+    read(msg_connection *conn,_type &val) noexcept                      \
+    {                                                                   \
+      return msg_read_##_name(conn,&val);                               \
+    }                                                                   \
+                                                                        \
+    static int                                                          \
+    write(msg_connection *conn,_type val) noexcept                      \
+    {                                                                   \
+      return msg_write_##_name(conn,val);                               \
+    }                                                                   \
+  };
+
+  DISPATCH_CODEC(uint8_t,uint8)
+  DISPATCH_CODEC(uint16_t,uint16)
+  DISPATCH_CODEC(int32_t,int32)
+  DISPATCH_CODEC(uint32_t,uint32)
+  DISPATCH_CODEC(int64_t,int64)
+  DISPATCH_CODEC(uint64_t,uint64)
+
+#undef DISPATCH_CODEC
+
+#define DISPATCH_WRAPPED_CODEC(_type,_name)                             \
+  template<>                                                            \
+  struct codec<_type>                                                   \
+  {                                                                     \
+    static int                                                          \
+    read(msg_connection *conn,_type &val) noexcept                      \
+    {                                                                   \
+      return msg_read_##_name(conn,&val.value);                         \
+    }                                                                   \
+                                                                        \
+    static int                                                          \
+    write(msg_connection *conn,_type val) noexcept                      \
+    {                                                                   \
+      return msg_write_##_name(conn,val.value);                         \
+    }                                                                   \
+  };
+
+  DISPATCH_WRAPPED_CODEC(varint<uint32_t>,varuint32)
+  DISPATCH_WRAPPED_CODEC(varint<int32_t>,varint32)
+  DISPATCH_WRAPPED_CODEC(varint<uint64_t>,varuint64)
+  DISPATCH_WRAPPED_CODEC(varint<int64_t>,varint64)
+  DISPATCH_WRAPPED_CODEC(fd,fd)
+
+#undef DISPATCH_WRAPPED_CODEC
+
+  /* Strings and buffers share a wire format, so a string_view goes out
+     as a buffer, straight from wherever it points. */
+
+  template<>
+  struct codec<std::string_view>
+  {
+    static int
+    write(msg_connection *conn,std::string_view val) noexcept
+    {
+      int err=msg_write_buffer_length(conn,val.size());
+
+      if(err<1)
+        return err;
+
+      return msg_write_buffer(conn,val.data(),val.size());
+    }
+  };
+
+  template<>
+  struct codec<std::string>
+  {
+    /* A NULL string reads as empty. */
+    static int
+    read(msg_connection *conn,std::string &val)
+    {
+      size_t length;
+      int err=msg_read_buffer_length(conn,&length);
+
+      if(err<1)
+        return err;
+
+      val.resize(length);
+
+      return msg_read_buffer(conn,val.data(),length);
+    }
+
+    static int
+    write(msg_connection *conn,const std::string &val) noexcept
+    {
+      return codec<std::string_view>::write(conn,val);
+    }
+  };
+
+  template<>
+  struct codec<const char *>
+  {
+    static int
+    write(msg_connection *conn,const char *val) noexcept
+    {
+      return msg_write_string(conn,val);
+    }
+  };
+
+#ifdef DISPATCH_HAVE_SPAN
+
+  /* Arrays of integers.  Reading fills the span, which must be exactly
+     as long as the array sent.  Use read_array_length() first to find
+     out how long that is. */
+
+  namespace detail
+  {
+#define DISPATCH_ARRAY(_type,_name)                                     \
+    inline int                                                          \
+    read_array(msg_connection *conn,_type *vals,size_t count) noexcept  \
+    {                                                                   \
+      return msg_read_##_name##_array(conn,vals,count);                 \
+    }                                                                   \
+                                                                        \
+    inline int                                                          \
+    write_array(msg_connection *conn,const _type *vals,                 \
+                size_t count) noexcept                                  \
+    {                                                                   \
+      return msg_write_##_name##_array(conn,vals,count);                \
+    }
+
+    DISPATCH_ARRAY(uint8_t,uint8)
+    DISPATCH_ARRAY(uint16_t,uint16)
+    DISPATCH_ARRAY(int32_t,int32)
+    DISPATCH_ARRAY(uint32_t,uint32)
+    DISPATCH_ARRAY(int64_t,int64)
+    DISPATCH_ARRAY(uint64_t,uint64)
+
+#undef DISPATCH_ARRAY
+  }
+
+  template<typename T>
+  struct codec<std::span<T>,std::enable_if_t<std::is_integral_v<T>>>
+  {
+    static int
+    read(msg_connection *conn,std::span<T> vals) noexcept
+    {
+      static_assert(!std::is_const_v<T>,"can't read into a const span");
+
+      return detail::read_array(conn,vals.data(),vals.size());
+    }
+
+    static int
+    write(msg_connection *conn,std::span<T> vals) noexcept
+    {
+      return detail::write_array(conn,vals.data(),vals.size());
+    }
+  };
+
+  /* Bytes go out as a buffer, and read into a span that must be
+     exactly as long as the buffer sent. */
+
+  template<>
+  struct codec<std::span<const std::byte>>
+  {
+    static int
+    write(msg_connection *conn,std::span<const std::byte> bytes) noexcept
+    {
+      int err=msg_write_buffer_length(conn,bytes.size());
+
+      if(err<1)
+        return err;
+
+      return msg_write_buffer(conn,bytes.data(),bytes.size());
+    }
+  };
+
+  template<>
+  struct codec<std::span<std::byte>>
+  {
+    static int
+    read(msg_connection *conn,std::span<std::byte> bytes) noexcept
+    {
+      return msg_read_buffer(conn,bytes.data(),bytes.size());
+    }
+
+    static int
+    write(msg_connection *conn,std::span<std::byte> bytes) noexcept
+    {
+      return codec<std::span<const std::byte>>::write(conn,bytes);
+    }
+  };
+
+#endif /* DISPATCH_HAVE_SPAN */
+
+  /* read() and write() for any type with a codec. */
+
+  template<typename T>
+  inline int
+  read(msg_connection *conn,T &&val)
+  {
+    return codec<std::decay_t<T>>::read(conn,std::forward<T>(val));
+  }
+
+  template<typename T>
+  inline int
+  write(msg_connection *conn,const T &val)
+  {
+    /* String literals and char pointers are C strings. */
+    using type=std::conditional_t<std::is_same_v<std::decay_t<T>,char *>
+                                  || std::is_same_v<std::decay_t<T>,
+                                                    const char *>,
+                                  const char *,T>;
+
+    return codec<type>::write(conn,val);
+  }
+
+  /* Several values in order, stopping at the first failure. */
+
+  template<typename... T>
+  inline int
+  read_all(msg_connection *conn,T &... vals)
+  {
+    int err=1;
+
+    (void)(((err=read(conn,vals))>0) && ...);
+
+    return err;
+  }
+
+  template<typename... T>
+  inline int
+  write_all(msg_connection *conn,const T &... vals)
+  {
+    int err=1;
+
+    (void)(((err=write(conn,vals))>0) && ...);
+
+    return err;
+  }
+
+  inline int
+  read_array_length(msg_connection *conn,size_t &count) noexcept
+  {
+    return msg_read_array_length(conn,&count);
+  }
+
+  inline int
+  read_buffer_length(msg_connection *conn,size_t &length) noexcept
+  {
+    return msg_read_buffer_length(conn,&length);
+  }
+
+  inline int
+  write_type(msg_connection *conn,uint16_t type) noexcept
+  {
+    return msg_write_type(conn,type);
+  }
+
+  inline int
+  read_type(msg_connection *conn,uint16_t &type) noexcept
+  {
+    return msg_read_type(conn,&type);
+  }
+
+  /* One entry of a handler table.  CacheTtl and Coalesce are the
+     msg_handler fields of the same names. */
+
+  template<uint16_t Type,int (*Function)(uint16_t,msg_connection *),
+           unsigned int CacheTtl=0,bool Coalesce=false>
+  struct handler
+  {
+    static_assert(Type!=MSG_TYPE_RESERVED,"type 0 is reserved");
+
+    static constexpr uint16_t type=Type;
+    static constexpr unsigned int cache_ttl=CacheTtl;
+    static constexpr unsigned int coalesce=Coalesce;
+
+    static int
+    call(uint16_t msg_type,msg_connection *conn)
+    {
+      return Function(msg_type,conn);
+    }
+  };
+
+  namespace detail
+  {
+    template<typename... Handlers>
+    constexpr bool
+    unique_types()
+    {
+      constexpr uint16_t types[]={Handlers::type...};
+
+      for(size_t i=0;i<sizeof...(Handlers);i++)
+        for(size_t j=i+1;j<sizeof...(Handlers);j++)
+          if(types[i]==types[j])
+            return false;
+
+      return true;
+    }
+  }
+
+  /* A handler table fixed at compile time, with its types checked
+     for clashes.  table is ready for msg_listen(), and each entry
+     calls its function directly. */
+
+  template<typename... Handlers>
+  struct handler_table
+  {
+    static_assert(sizeof...(Handlers)>0,"a table needs handlers");
+    static_assert(detail::unique_types<Handlers...>(),
+                  "a type appears in the table twice");
+
+    static inline msg_handler table[]=
+      {
+        {Handlers::type,&Handlers::call,Handlers::cache_ttl,
+         Handlers::coalesce}...,
+        {0,nullptr,0,0}
+      };
+
+    static constexpr size_t size=sizeof...(Handlers);
+
+    static constexpr bool
+    contains(uint16_t msg_type) noexcept
+    {
+      return ((msg_type==Handlers::type) || ...);
+    }
+  };
+
+  template<typename Table>
+  inline int
+  listen(const char *service,int flags=0)
+  {
+    return msg_listen(nullptr,service,flags,Table::table);
+  }
+
+  /* Serve a socket that is already listening, such as one from
+     msg_handoff_receive(). */
+  template<typename Table>
+  inline int
+  listen(int fd,int flags=0)
+  {
+    return msg_listen_fd(fd,flags,Table::table);
+  }
+}
+
+#endif /* !_DISPATCH_HPP_ */
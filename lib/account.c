@@ -0,0 +1,312 @@
+#include <config.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <dispatch.h>
+#include "conn.h"
+#include "account.h"
+
+extern struct msg_config *_config;
+
+#define ACCOUNT_BUCKETS 256
+
+/* Peers come and go, types don't.  Past this many, new peers are all
+   counted under pid 0 and uid -1. */
+#define ACCOUNT_PEERS 1024
+
+struct type_entry
+{
+  struct type_entry *next;
+  struct msg_type_usage usage;
+};
+
+struct peer_entry
+{
+  struct peer_entry *next;
+  struct msg_peer_usage usage;
+};
+
+static pthread_mutex_t account_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct type_entry *types[ACCOUNT_BUCKETS];
+static struct peer_entry *peers[ACCOUNT_BUCKETS];
+static size_t type_count,peer_count;
+static uint64_t last_log;
+
+uint64_t
+thread_cpu_ns(void)
+{
+  struct timespec ts;
+
+  if(clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts)==-1)
+    return 0;
+
+  return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void
+add_usage(struct msg_usage *usage,const struct msg_usage *request)
+{
+  usage->requests+=request->requests;
+  usage->cpu_ns+=request->cpu_ns;
+  usage->reads+=request->reads;
+  usage->writes+=request->writes;
+  usage->bytes_in+=request->bytes_in;
+  usage->bytes_out+=request->bytes_out;
+}
+
+static struct type_entry *
+find_type(uint16_t type)
+{
+  struct type_entry *entry;
+
+  for(entry=types[type%ACCOUNT_BUCKETS];entry;entry=entry->next)
+    if(entry->usage.type==type)
+      return entry;
+
+  entry=calloc(1,sizeof(*entry));
+  if(!entry)
+    return NULL;
+
+  entry->usage.type=type;
+  entry->next=types[type%ACCOUNT_BUCKETS];
+  types[type%ACCOUNT_BUCKETS]=entry;
+  type_count++;
+
+  return entry;
+}
+
+static struct peer_entry *
+find_peer(pid_t pid,uid_t uid)
+{
+  struct peer_entry *entry;
+  size_t bucket;
+
+  if(peer_count>=ACCOUNT_PEERS)
+    {
+      pid=0;
+      uid=(uid_t)-1;
+    }
+
+  bucket=((size_t)pid*31+uid)%ACCOUNT_BUCKETS;
+  for(entry=peers[bucket];entry;entry=entry->next)
+    if(entry->usage.pid==pid && entry->usage.uid==uid)
+      return entry;
+
+  entry=calloc(1,sizeof(*entry));
+  if(!entry)
+    return NULL;
+
+  entry->usage.pid=pid;
+  entry->usage.uid=uid;
+  entry->next=peers[bucket];
+  peers[bucket]=entry;
+  peer_count++;
+
+  return entry;
+}
+
+static int
+compare_types(const void *a,const void *b)
+{
+  const struct msg_type_usage *ta=a,*tb=b;
+
+  return ta->usage.cpu_ns<tb->usage.cpu_ns?1:
+    ta->usage.cpu_ns>tb->usage.cpu_ns?-1:0;
+}
+
+static int
+compare_peers(const void *a,const void *b)
+{
+  const struct msg_peer_usage *pa=a,*pb=b;
+
+  return pa->usage.cpu_ns<pb->usage.cpu_ns?1:
+    pa->usage.cpu_ns>pb->usage.cpu_ns?-1:0;
+}
+
+static void
+log_usage(const char *what,const struct msg_usage *usage)
+{
+  syslog(LOG_DAEMON|LOG_INFO,"Dispatch usage %s: %"PRIu64" requests, "
+         "%"PRIu64"us cpu, %"PRIu64" reads, %"PRIu64" writes, "
+         "%"PRIu64" bytes in, %"PRIu64" bytes out",what,usage->requests,
+         usage->cpu_ns/1000,usage->reads,usage->writes,usage->bytes_in,
+         usage->bytes_out);
+}
+
+static void
+log_top(size_t top)
+{
+  struct msg_type_usage *type_usage;
+  struct msg_peer_usage *peer_usage;
+  size_t count,i;
+
+  type_usage=calloc(top,sizeof(*type_usage));
+  peer_usage=calloc(top,sizeof(*peer_usage));
+
+  if(type_usage && peer_usage)
+    {
+      count=msg_usage_types(type_usage,top);
+      for(i=0;i<count && i<top;i++)
+        {
+          char what[32];
+
+          snprintf(what,sizeof(what),"type %u",type_usage[i].type);
+          log_usage(what,&type_usage[i].usage);
+        }
+
+      count=msg_usage_peers(peer_usage,top);
+      for(i=0;i<count && i<top;i++)
+        {
+          char what[64];
+
+          snprintf(what,sizeof(what),"pid %ld uid %ld",
+                   (long)peer_usage[i].pid,(long)peer_usage[i].uid);
+          log_usage(what,&peer_usage[i].usage);
+        }
+    }
+
+  free(type_usage);
+  free(peer_usage);
+}
+
+void
+account_request(uint16_t type,struct msg_connection *conn,uint64_t cpu_ns)
+{
+  struct msg_usage request;
+  struct msg_peerinfo info;
+  struct type_entry *type_entry;
+  struct peer_entry *peer_entry=NULL;
+  int have_peer;
+  uint64_t now=0,interval;
+  int report=0;
+
+  request.requests=1;
+  request.cpu_ns=cpu_ns;
+  request.reads=conn->syscalls.reads;
+  request.writes=conn->syscalls.writes;
+  request.bytes_in=conn->bytes.in;
+  request.bytes_out=conn->bytes.out;
+
+  /* Only local sockets know who is on the other end.  A batched
+     request asks the batch's. */
+  have_peer=((conn->fd!=-1 || conn->outer) && conn_peerinfo(conn,&info)==0);
+
+  interval=(uint64_t)_config->account.log_interval*1000000000;
+  if(interval)
+    now=monotonic_ns();
+
+  pthread_mutex_lock(&account_lock);
+
+  type_entry=find_type(type);
+  if(type_entry)
+    add_usage(&type_entry->usage.usage,&request);
+
+  if(have_peer)
+    peer_entry=find_peer(info.local.pid,info.local.uid);
+  if(peer_entry)
+    add_usage(&peer_entry->usage.usage,&request);
+
+  if(now && now-last_log>=interval)
+    {
+      report=(last_log!=0);
+      last_log=now;
+    }
+
+  pthread_mutex_unlock(&account_lock);
+
+  /* The first interval starts with the first request. */
+  if(report)
+    log_top(_config->account.log_top);
+}
+
+size_t
+msg_usage_types(struct msg_type_usage *usage,size_t count)
+{
+  struct msg_type_usage *all;
+  struct type_entry *entry;
+  size_t total,i,n=0;
+
+  pthread_mutex_lock(&account_lock);
+
+  total=type_count;
+  all=malloc((total?total:1)*sizeof(*all));
+  if(all)
+    for(i=0;i<ACCOUNT_BUCKETS;i++)
+      for(entry=types[i];entry;entry=entry->next)
+        all[n++]=entry->usage;
+
+  pthread_mutex_unlock(&account_lock);
+
+  if(!all)
+    return 0;
+
+  qsort(all,n,sizeof(*all),compare_types);
+  memcpy(usage,all,(n<count?n:count)*sizeof(*all));
+  free(all);
+
+  return n;
+}
+
+size_t
+msg_usage_peers(struct msg_peer_usage *usage,size_t count)
+{
+  struct msg_peer_usage *all;
+  struct peer_entry *entry;
+  size_t total,i,n=0;
+
+  pthread_mutex_lock(&account_lock);
+
+  total=peer_count;
+  all=malloc((total?total:1)*sizeof(*all));
+  if(all)
+    for(i=0;i<ACCOUNT_BUCKETS;i++)
+      for(entry=peers[i];entry;entry=entry->next)
+        all[n++]=entry->usage;
+
+  pthread_mutex_unlock(&account_lock);
+
+  if(!all)
+    return 0;
+
+  qsort(all,n,sizeof(*all),compare_peers);
+  memcpy(usage,all,(n<count?n:count)*sizeof(*all));
+  free(all);
+
+  return n;
+}
+
+void
+msg_usage_reset(void)
+{
+  size_t i;
+
+  pthread_mutex_lock(&account_lock);
+
+  for(i=0;i<ACCOUNT_BUCKETS;i++)
+    {
+      while(types[i])
+        {
+          struct type_entry *next=types[i]->next;
+
+          free(types[i]);
+          types[i]=next;
+        }
+
+      while(peers[i])
+        {
+          struct peer_entry *next=peers[i]->next;
+
+          free(peers[i]);
+          peers[i]=next;
+        }
+    }
+
+  type_count=peer_count=0;
+
+  pthread_mutex_unlock(&account_lock);
+}
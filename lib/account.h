@@ -0,0 +1,18 @@
+#ifndef _ACCOUNT_H_
+#define _ACCOUNT_H_
+
+#include <inttypes.h>
+
+/* Per-request accounting, for msg_config.account.  A worker takes
+   thread_cpu_ns() before and after a request, and hands the
+   difference to account_request() with the connection, whose syscall
+   and byte counts cover the whole request.  Totals are kept by type
+   and by local peer. */
+
+struct msg_connection;
+
+uint64_t thread_cpu_ns(void);
+void account_request(uint16_t type,struct msg_connection *conn,
+                     uint64_t cpu_ns);
+
+#endif /* !_ACCOUNT_H_ */
@@ -0,0 +1,281 @@
+#include <config.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <dispatch.h>
+#include "affinity.h"
+
+struct affinity_plan
+{
+#ifdef __linux__
+  cpu_set_t accept_cpus;
+#endif
+  unsigned int has_accept_cpus:1;
+
+  /* entries[0] is the default for types with no entry of their own. */
+  size_t count;
+  struct affinity_entry entries[];
+};
+
+#ifdef __linux__
+
+/* Parse a list like "0-3,8,10-11" into set.  A set with none of the
+   CPUs we may run on fails here, rather than in every
+   pthread_create(). */
+
+static int
+parse_cpus(const char *list,cpu_set_t *set)
+{
+  cpu_set_t allowed;
+
+  if(sched_getaffinity(0,sizeof(allowed),&allowed)==-1)
+    return -1;
+
+  CPU_ZERO(set);
+
+  for(;;)
+    {
+      char *end;
+      unsigned long first,last;
+
+      first=last=strtoul(list,&end,10);
+      if(end==list)
+        goto bad;
+
+      if(*end=='-')
+        {
+          list=end+1;
+          last=strtoul(list,&end,10);
+          if(end==list || last<first)
+            goto bad;
+        }
+
+      if(last>=CPU_SETSIZE)
+        goto bad;
+
+      for(;first<=last;first++)
+        CPU_SET(first,set);
+
+      if(*end=='\0')
+        {
+          CPU_AND(&allowed,&allowed,set);
+          if(CPU_COUNT(&allowed)==0)
+            goto bad;
+
+          return 0;
+        }
+
+      if(*end!=',')
+        goto bad;
+
+      list=end+1;
+    }
+
+ bad:
+  errno=EINVAL;
+  return -1;
+}
+
+#endif
+
+/* Entries start from the workers default, and fill in only what they
+   set themselves. */
+
+static int
+init_entry(struct affinity_entry *entry,const struct msg_sched *sched,
+           const struct msg_sched *defaults,const struct msg_config *config)
+{
+  const char *cpus=sched->cpus?sched->cpus:defaults->cpus;
+  int err;
+
+  entry->type=sched->type;
+  entry->policy=sched->policy?sched->policy:defaults->policy;
+  entry->priority=sched->policy?sched->priority:defaults->priority;
+  entry->nice=sched->nice?sched->nice:defaults->nice;
+  entry->warned=0;
+
+#ifndef __linux__
+  /* Elsewhere setpriority() would renice the whole process. */
+  if(entry->nice)
+    {
+      errno=ENOTSUP;
+      return -1;
+    }
+#endif
+
+  err=pthread_attr_init(&entry->attr);
+  if(!err)
+    err=pthread_attr_setdetachstate(&entry->attr,PTHREAD_CREATE_DETACHED);
+  if(!err && config->stacksize)
+    err=pthread_attr_setstacksize(&entry->attr,config->stacksize);
+  if(err)
+    {
+      errno=err;
+      return -1;
+    }
+
+  if(cpus)
+    {
+#ifdef __linux__
+      cpu_set_t set;
+
+      if(parse_cpus(cpus,&set)==-1)
+        return -1;
+
+      /* The thread starts on these CPUs, so its stack (which nothing
+         touches before then) is faulted in on their NUMA node. */
+      err=pthread_attr_setaffinity_np(&entry->attr,sizeof(set),&set);
+      if(err)
+        {
+          errno=err;
+          return -1;
+        }
+#else
+      errno=ENOTSUP;
+      return -1;
+#endif
+    }
+
+  return 0;
+}
+
+struct affinity_plan *
+affinity_plan_new(const struct msg_config *config)
+{
+  const struct msg_sched *types=config->sched.types;
+  struct affinity_plan *plan;
+  size_t i,count=1;
+
+  if(types)
+    for(i=0;types[i].type;i++)
+      count++;
+
+  plan=calloc(1,sizeof(*plan)+count*sizeof(plan->entries[0]));
+  if(!plan)
+    return NULL;
+
+  if(config->sched.accept_cpus)
+    {
+#ifdef __linux__
+      if(parse_cpus(config->sched.accept_cpus,&plan->accept_cpus)==-1)
+        goto fail;
+
+      plan->has_accept_cpus=1;
+#else
+      errno=ENOTSUP;
+      goto fail;
+#endif
+    }
+
+  for(i=0;i<count;i++)
+    {
+      if(init_entry(&plan->entries[i],i?&types[i-1]:&config->sched.workers,
+                    &config->sched.workers,config)==-1)
+        goto fail;
+
+      plan->count++;
+    }
+
+  plan->entries[0].type=0;
+
+  return plan;
+
+ fail:
+  {
+    int save_errno=errno;
+
+    affinity_plan_free(plan);
+    errno=save_errno;
+  }
+
+  return NULL;
+}
+
+void
+affinity_plan_free(struct affinity_plan *plan)
+{
+  size_t i;
+
+  if(!plan)
+    return;
+
+  for(i=0;i<plan->count;i++)
+    pthread_attr_destroy(&plan->entries[i].attr);
+
+  free(plan);
+}
+
+int
+affinity_pin_accept(struct affinity_plan *plan)
+{
+#ifdef __linux__
+  if(plan->has_accept_cpus)
+    {
+      int err=pthread_setaffinity_np(pthread_self(),sizeof(plan->accept_cpus),
+                                     &plan->accept_cpus);
+      if(err)
+        {
+          errno=err;
+          return -1;
+        }
+    }
+#endif
+
+  return 0;
+}
+
+struct affinity_entry *
+affinity_lookup(struct affinity_plan *plan,uint16_t type)
+{
+  size_t i;
+
+  for(i=1;i<plan->count;i++)
+    if(plan->entries[i].type==type)
+      return &plan->entries[i];
+
+  return &plan->entries[0];
+}
+
+void
+affinity_apply(struct affinity_entry *entry)
+{
+  const char *what=NULL;
+  int err=0;
+
+  if(entry->policy)
+    {
+      struct sched_param param;
+
+      memset(&param,0,sizeof(param));
+      param.sched_priority=entry->priority;
+
+      err=pthread_setschedparam(pthread_self(),entry->policy,&param);
+      if(err)
+        what="policy";
+    }
+
+#ifdef __linux__
+  if(!err && entry->nice)
+    {
+      /* Linux keeps a nice level per thread. */
+      if(setpriority(PRIO_PROCESS,syscall(SYS_gettid),entry->nice)==-1)
+        {
+          err=errno;
+          what="nice level";
+        }
+    }
+#endif
+
+  if(err && !entry->warned)
+    {
+      entry->warned=1;
+      syslog(LOG_DAEMON|LOG_ERR,"Dispatch could not set the %s for type %u:"
+             " %s",what,(unsigned int)entry->type,strerror(err));
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/* Where worker and accept threads run, and at what priority, from
+   msg_config.sched. */
+
+struct msg_config;
+struct affinity_plan;
+
+/* How the workers for one message type are created and set up.  The
+   attr is ready for pthread_create(). */
+struct affinity_entry
+{
+  uint16_t type;
+  int policy;
+  int priority;
+  int nice;
+  int warned;
+  pthread_attr_t attr;
+};
+
+/* Turn config->sched into thread attributes, once per listener.
+   Fails with EINVAL for a bad CPU list, and ENOTSUP where CPU sets or
+   per-thread nice levels aren't available. */
+struct affinity_plan *affinity_plan_new(const struct msg_config *config);
+void affinity_plan_free(struct affinity_plan *plan);
+
+/* Run the calling thread on the accept CPUs, if there are any. */
+int affinity_pin_accept(struct affinity_plan *plan);
+
+struct affinity_entry *affinity_lookup(struct affinity_plan *plan,uint16_t type);
+
+/* Called by a worker as it starts, to set its policy and nice level.
+   Failure is logged once per entry, and the worker carries on. */
+void affinity_apply(struct affinity_entry *entry);
+
+#endif /* !_AFFINITY_H_ */
@@ -0,0 +1,416 @@
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <dispatch.h>
+#include "conn.h"
+#include "batch.h"
+#include "cache.h"
+#include "account.h"
+
+extern struct msg_config *_config;
+
+/* Replies are sent whenever this many bytes of them are waiting. */
+#define BATCH_FLUSH 65536
+
+/* On the wire a batch is MSG_TYPE_BATCH, the type of its requests
+   and their count, then one buffer holding each request as a buffer.
+   The replies come back in buffers of a few at a time.  Each is an
+   int32 status, -1 if the handler failed and 0 otherwise, followed by
+   what it wrote as a buffer.  Either side gets through many requests
+   a read. */
+
+struct msg_batch
+{
+  uint16_t type;
+  uint32_t count;
+
+  /* The requests added so far, framed. */
+  struct msg_connection *requests;
+
+  /* The request being added, not yet framed. */
+  struct msg_connection *request;
+
+  /* Set by msg_batch_commit(). */
+  struct msg_connection *conn;
+  uint32_t replies;
+
+  /* The replies read but not yet returned. */
+  struct msg_connection *chunk;
+};
+
+struct msg_batch *
+msg_batch_begin(uint16_t type)
+{
+  struct msg_batch *batch;
+
+  batch=calloc(1,sizeof(*batch));
+  if(!batch)
+    return NULL;
+
+  batch->type=type;
+  batch->requests=msg_builder_new(0);
+  if(!batch->requests)
+    {
+      free(batch);
+      return NULL;
+    }
+
+  return batch;
+}
+
+/* Move the request being added onto the end of the others. */
+
+static int
+frame_request(struct msg_batch *batch)
+{
+  const void *data;
+  size_t length;
+  int err;
+
+  if(!batch->request)
+    return 1;
+
+  data=msg_builder_data(batch->request,&length);
+
+  err=msg_write_buffer_length(batch->requests,length);
+  if(err>0)
+    err=msg_write_buffer(batch->requests,data,length);
+  if(err<1)
+    return err;
+
+  msg_close(batch->request);
+  batch->request=NULL;
+  batch->count++;
+
+  return 1;
+}
+
+struct msg_connection *
+msg_batch_add(struct msg_batch *batch)
+{
+  if(batch->conn)
+    {
+      errno=EINVAL;
+      return NULL;
+    }
+
+  if(frame_request(batch)<1)
+    return NULL;
+
+  batch->request=msg_builder_new(0);
+
+  return batch->request;
+}
+
+int
+msg_batch_commit(struct msg_batch *batch,struct msg_connection *conn)
+{
+  struct msg_connection *header;
+  const void *data;
+  size_t length;
+  int err;
+
+  if(batch->conn)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  err=frame_request(batch);
+  if(err<1)
+    return err;
+
+  /* The whole batch goes out in one write. */
+  data=msg_builder_data(batch->requests,&length);
+  header=msg_builder_new(length+16);
+  if(!header)
+    return -1;
+
+  err=msg_write_type(header,MSG_TYPE_BATCH);
+  if(err>0)
+    err=msg_write_type(header,batch->type);
+  if(err>0)
+    err=msg_write_uint32(header,batch->count);
+  if(err>0)
+    err=msg_write_buffer_length(header,length);
+  if(err>0)
+    err=msg_write_buffer(header,data,length);
+  if(err>0)
+    err=msg_builder_send(header,conn);
+
+  msg_close(header);
+
+  if(err<1)
+    return err;
+
+  batch->conn=conn;
+
+  return 1;
+}
+
+/* Read the next buffer of replies. */
+
+static int
+read_chunk(struct msg_batch *batch)
+{
+  size_t length;
+  int err;
+
+  if(batch->chunk)
+    msg_close(batch->chunk);
+
+  batch->chunk=NULL;
+
+  err=msg_read_buffer_length(batch->conn,&length);
+  if(err<1)
+    return err;
+
+  batch->chunk=msg_builder_new(length);
+  if(!batch->chunk)
+    return -1;
+
+  err=msg_read_buffer(batch->conn,batch->chunk->memory.data,length);
+  if(err<1)
+    return err;
+
+  batch->chunk->memory.length=length;
+
+  return 1;
+}
+
+int
+msg_batch_next(struct msg_batch *batch,struct msg_connection **reply)
+{
+  struct msg_connection *builder;
+  int32_t status;
+  size_t length;
+  int err;
+
+  if(!batch->conn)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  if(batch->replies==batch->count)
+    return 0;
+
+  if(!batch->chunk || batch->chunk->memory.length==0)
+    {
+      err=read_chunk(batch);
+      if(err<1)
+        return err;
+    }
+
+  err=msg_read_int32(batch->chunk,&status);
+  if(err>0)
+    err=msg_read_buffer_length(batch->chunk,&length);
+  if(err<1)
+    goto short_chunk;
+
+  builder=msg_builder_new(length);
+  if(!builder)
+    return -1;
+
+  err=msg_read_buffer(batch->chunk,builder->memory.data,length);
+  if(err<1)
+    {
+      msg_close(builder);
+      goto short_chunk;
+    }
+
+  builder->memory.length=length;
+  batch->replies++;
+
+  if(status)
+    {
+      msg_close(builder);
+      builder=NULL;
+    }
+
+  *reply=builder;
+
+  return 1;
+
+ short_chunk:
+  errno=EPROTO;
+  return -1;
+}
+
+void
+msg_batch_free(struct msg_batch *batch)
+{
+  if(!batch)
+    return;
+
+  if(batch->request)
+    msg_close(batch->request);
+
+  if(batch->chunk)
+    msg_close(batch->chunk);
+
+  msg_close(batch->requests);
+  free(batch);
+}
+
+/* Run the handler in entry on one request from conn, with a memory
+   connection standing in for the socket, and add its status and reply
+   to replies.  The CPU time it took is added to *cpu_ns, if it is
+   being counted. */
+
+static int
+serve_one(const struct msg_handler *entry,uint16_t type,
+          const unsigned char *request,size_t length,
+          struct msg_connection *conn,struct msg_connection *replies,
+          uint64_t *cpu_ns)
+{
+  struct msg_connection *item;
+  const void *data;
+  uint64_t cpu=0;
+  size_t reply;
+  int ret,err;
+
+  item=memory_connection(length);
+  if(!item)
+    return -1;
+
+  if(length && memory_write(item,request,length)!=length)
+    {
+      msg_close(item);
+      return -1;
+    }
+
+  item->outer=conn;
+  item->deadline=conn->deadline;
+
+  if(_config->account.enabled)
+    cpu=thread_cpu_ns();
+
+  ret=cache_call(entry->handler,type,entry->cache_ttl,entry->coalesce,item);
+
+  /* A handler that reads all of its request leaves only its reply.
+     A failed one leaves nothing worth sending. */
+  data=msg_builder_data(item,&reply);
+  if(ret<0)
+    reply=0;
+
+  if(_config->account.enabled)
+    {
+      cpu=thread_cpu_ns()-cpu;
+      *cpu_ns+=cpu;
+
+      item->bytes.in=length;
+      item->bytes.out=reply;
+      account_request(type,item,cpu);
+    }
+
+  err=msg_write_int32(replies,ret<0?-1:0);
+  if(err>0)
+    err=msg_write_buffer_length(replies,reply);
+  if(err>0)
+    err=msg_write_buffer(replies,data,reply);
+
+  msg_close(item);
+
+  return err>0?0:-1;
+}
+
+int
+batch_serve(struct msg_handler *handlers,struct msg_connection *conn,
+            uint64_t *cpu_ns)
+{
+  struct msg_handler *entry=NULL;
+  struct msg_connection *reader=NULL,*replies=NULL;
+  unsigned char *requests=NULL;
+  size_t total,length,waiting;
+  uint16_t type;
+  uint32_t count,i;
+  int ret=-1;
+
+  if(msg_read_type(conn,&type)<1 || msg_read_uint32(conn,&count)<1
+     || msg_read_buffer_length(conn,&total)<1)
+    return -1;
+
+  for(i=0;handlers[i].type;i++)
+    if(handlers[i].type==type)
+      entry=&handlers[i];
+
+  if(!entry || type==MSG_TYPE_BATCH)
+    {
+      errno=ENOENT;
+      return -1;
+    }
+
+  if(total>_config->batch.size)
+    {
+      errno=EMSGSIZE;
+      return -1;
+    }
+
+  /* Every request is read before any is answered, so a client can
+     send the whole batch before it reads replies without either side
+     filling its socket buffers and waiting on the other. */
+  requests=malloc(total?total:1);
+  if(!requests)
+    return -1;
+
+  if(msg_read_buffer(conn,requests,total)<1)
+    goto out;
+
+  reader=msg_reader_new(requests,total);
+  replies=msg_builder_new(0);
+  if(!reader || !replies)
+    goto out;
+
+  for(i=0;i<count;i++)
+    {
+      const void *request;
+
+      if(conn->deadline && monotonic_ns()>=conn->deadline)
+        {
+          errno=ETIMEDOUT;
+          goto out;
+        }
+
+      if(msg_read_buffer_length(reader,&length)<1)
+        goto short_batch;
+
+      request=msg_builder_data(reader,&waiting);
+      if(length>waiting)
+        goto short_batch;
+
+      if(serve_one(entry,type,request,length,conn,replies,cpu_ns)==-1)
+        goto out;
+
+      reader->memory.offset+=length;
+
+      msg_builder_data(replies,&waiting);
+      if(waiting>=BATCH_FLUSH || i==count-1)
+        {
+          const void *data=msg_builder_data(replies,&waiting);
+
+          if(msg_write_buffer_length(conn,waiting)<1
+             || msg_write_buffer(conn,data,waiting)<1)
+            goto out;
+
+          msg_builder_reset(replies);
+        }
+    }
+
+  ret=0;
+
+ out:
+  if(reader)
+    msg_close(reader);
+  if(replies)
+    msg_close(replies);
+  free(requests);
+
+  return ret;
+
+ short_batch:
+  errno=EPROTO;
+  goto out;
+}
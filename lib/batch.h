@@ -0,0 +1,20 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <inttypes.h>
+
+/* Serves a MSG_TYPE_BATCH connection, whose type has been read, with
+   the handler in handlers for the type the batch carries.  The
+   requests are run one after another on the calling thread, through
+   the cache like any other, and replies go out in the same order, a
+   few at a time.  With accounting on, each request is counted under
+   its type, and *cpu_ns gets the CPU time they took between them.
+   Returns 0, or -1 with errno set once the batch can't go on. */
+
+struct msg_connection;
+struct msg_handler;
+
+int batch_serve(struct msg_handler *handlers,struct msg_connection *conn,
+                uint64_t *cpu_ns);
+
+#endif /* !_BATCH_H_ */
@@ -0,0 +1,640 @@
+#include <config.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <dispatch.h>
+#include "conn.h"
+#include "cache.h"
+#include "trace.h"
+
+extern struct msg_config *_config;
+
+#define CACHE_BUCKETS 4096
+
+/* The most request bytes a worker looks at to find a hit. */
+#define CACHE_PEEK 4096
+
+/* Request lengths remembered per handler and type.  Every length is
+   a separate lookup on each request, so there are few of them. */
+#define CACHE_LENGTHS 8
+
+typedef int (*msg_handler_t)(uint16_t type,struct msg_connection *conn);
+
+struct capture
+{
+  unsigned char *data;
+  size_t size;
+  size_t request;
+  size_t reply;
+  size_t limit;
+  unsigned int spoiled:1;
+};
+
+struct cache_entry
+{
+  struct cache_entry *next;
+  struct cache_entry *lru_prev;
+  struct cache_entry *lru_next;
+  msg_handler_t handler;
+  uint64_t hash;
+  uint64_t expires;
+  uint16_t type;
+  size_t request;
+  size_t reply;
+
+  /* The request, then the reply. */
+  unsigned char data[];
+};
+
+/* The request lengths seen for a handler and type. */
+struct cache_shape
+{
+  struct cache_shape *next;
+  msg_handler_t handler;
+  uint16_t type;
+  size_t count;
+  size_t lengths[CACHE_LENGTHS];
+};
+
+/* A handler run that identical requests can wait on instead of
+   running it themselves.  It is freed by whoever is last to look at
+   it, the run or a waiter. */
+struct flight
+{
+  struct flight *next;
+  msg_handler_t handler;
+  uint16_t type;
+  size_t waiters;
+  unsigned int landed:1;
+  unsigned int usable:1;
+
+  /* The captured request and reply, once landed and usable. */
+  unsigned char *data;
+  size_t request;
+  size_t reply;
+
+  /* What was waiting in the socket when the run started. */
+  size_t length;
+  unsigned char key[];
+};
+
+static pthread_mutex_t cache_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static struct cache_entry *lru_head,*lru_tail;
+static struct cache_shape *shapes;
+static struct flight *flights;
+static pthread_cond_t flight_cond;
+static pthread_once_t flight_once=PTHREAD_ONCE_INIT;
+static struct msg_cache_stats stats;
+
+static uint64_t
+hash_request(msg_handler_t handler,uint16_t type,const unsigned char *data,
+             size_t length)
+{
+  uint64_t hash=0xCBF29CE484222325ULL^(uintptr_t)handler^type;
+  size_t i;
+
+  for(i=0;i<length;i++)
+    {
+      hash^=data[i];
+      hash*=0x100000001B3ULL;
+    }
+
+  return hash;
+}
+
+static size_t
+entry_size(const struct cache_entry *entry)
+{
+  return sizeof(*entry)+entry->request+entry->reply;
+}
+
+static void
+lru_unlink(struct cache_entry *entry)
+{
+  if(entry->lru_prev)
+    entry->lru_prev->lru_next=entry->lru_next;
+  else
+    lru_head=entry->lru_next;
+
+  if(entry->lru_next)
+    entry->lru_next->lru_prev=entry->lru_prev;
+  else
+    lru_tail=entry->lru_prev;
+}
+
+static void
+lru_push(struct cache_entry *entry)
+{
+  entry->lru_prev=NULL;
+  entry->lru_next=lru_head;
+  if(lru_head)
+    lru_head->lru_prev=entry;
+  else
+    lru_tail=entry;
+  lru_head=entry;
+}
+
+static void
+remove_entry(struct cache_entry *entry)
+{
+  struct cache_entry **link=&buckets[entry->hash%CACHE_BUCKETS];
+
+  while(*link!=entry)
+    link=&(*link)->next;
+
+  *link=entry->next;
+  lru_unlink(entry);
+
+  stats.entries--;
+  stats.bytes-=entry_size(entry);
+  free(entry);
+}
+
+static struct cache_shape *
+find_shape(msg_handler_t handler,uint16_t type)
+{
+  struct cache_shape *shape;
+
+  for(shape=shapes;shape;shape=shape->next)
+    if(shape->handler==handler && shape->type==type)
+      return shape;
+
+  return NULL;
+}
+
+/* Consume a request of the given length, which is known to be
+   waiting, and write reply for it.  buf has room for the request. */
+
+static int
+send_reply(struct msg_connection *conn,unsigned char *buf,size_t request,
+           const unsigned char *reply,size_t length)
+{
+  ssize_t got=1;
+
+  if(request)
+    got=read_raw(conn,buf,request);
+  if(got>0 && length)
+    got=write_raw(conn,reply,length);
+
+  return got>0?0:-1;
+}
+
+/* Look for a cached reply to the request in peek, which is what is
+   waiting on conn, and send it if there is one.  Returns 1 for a hit,
+   0 for a miss, and -1 if the hit couldn't be sent. */
+
+static int
+serve_hit(msg_handler_t handler,uint16_t type,struct msg_connection *conn,
+          unsigned char *peek,size_t got)
+{
+  struct cache_shape *shape;
+  struct cache_entry *entry=NULL;
+  unsigned char *reply;
+  size_t i,request=0,length;
+  int ret;
+
+  pthread_mutex_lock(&cache_lock);
+
+  /* A handler that consumed a request and no more will do the same
+     for any request that starts with it, so a cached request only
+     has to be a prefix of what is waiting. */
+  shape=find_shape(handler,type);
+  for(i=0;shape && i<shape->count && !entry;i++)
+    {
+      uint64_t hash;
+
+      request=shape->lengths[i];
+      if(request>got)
+        continue;
+
+      hash=hash_request(handler,type,peek,request);
+      for(entry=buckets[hash%CACHE_BUCKETS];entry;entry=entry->next)
+        if(entry->hash==hash && entry->handler==handler
+           && entry->type==type && entry->request==request
+           && memcmp(entry->data,peek,request)==0)
+          break;
+    }
+
+  if(entry && monotonic_ns()>=entry->expires)
+    {
+      remove_entry(entry);
+      entry=NULL;
+    }
+
+  if(!entry)
+    {
+      stats.misses++;
+      pthread_mutex_unlock(&cache_lock);
+      return 0;
+    }
+
+  stats.hits++;
+  lru_unlink(entry);
+  lru_push(entry);
+
+  /* The entry may be evicted once the lock is dropped. */
+  length=entry->reply;
+  reply=malloc(length?length:1);
+  if(reply)
+    memcpy(reply,entry->data+entry->request,length);
+
+  pthread_mutex_unlock(&cache_lock);
+
+  if(!reply)
+    return -1;
+
+  trace_event(TRACE_CACHE_HIT,type,conn->fd,0);
+
+  ret=send_reply(conn,peek,request,reply,length);
+  free(reply);
+
+  return ret==0?1:-1;
+}
+
+static void
+init_flight_cond(void)
+{
+  pthread_condattr_t attr;
+
+  /* Waits are bounded by request deadlines, which are monotonic. */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+  pthread_cond_init(&flight_cond,&attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void
+free_flight(struct flight *flight)
+{
+  free(flight->data);
+  free(flight);
+}
+
+/* Find a handler already running on the same request as the one in
+   peek, and wait for its reply.  Returns 1 if that reply was sent,
+   -1 on failure, and 0 if this worker has to run the handler itself.
+   If no one else was running it, *flight is set to a new one that
+   land() must be called on once the handler returns. */
+
+static int
+join_flight(msg_handler_t handler,uint16_t type,struct msg_connection *conn,
+            unsigned char *peek,size_t got,struct flight **flight)
+{
+  struct flight *found;
+  unsigned char *reply=NULL;
+  size_t request=0,length=0;
+  int landed,usable,ret;
+
+  pthread_once(&flight_once,init_flight_cond);
+
+  pthread_mutex_lock(&cache_lock);
+
+  for(found=flights;found;found=found->next)
+    if(found->handler==handler && found->type==type && found->length==got
+       && memcmp(found->key,peek,got)==0)
+      break;
+
+  if(!found)
+    {
+      found=calloc(1,sizeof(*found)+got);
+      if(found)
+        {
+          found->handler=handler;
+          found->type=type;
+          found->length=got;
+          memcpy(found->key,peek,got);
+          found->next=flights;
+          flights=found;
+        }
+
+      pthread_mutex_unlock(&cache_lock);
+
+      *flight=found;
+      return 0;
+    }
+
+  found->waiters++;
+  while(!found->landed)
+    {
+      if(conn->deadline)
+        {
+          struct timespec ts;
+
+          ts.tv_sec=conn->deadline/1000000000;
+          ts.tv_nsec=conn->deadline%1000000000;
+          if(pthread_cond_timedwait(&flight_cond,&cache_lock,&ts)==ETIMEDOUT)
+            break;
+        }
+      else
+        pthread_cond_wait(&flight_cond,&cache_lock);
+    }
+
+  landed=found->landed;
+  usable=found->usable;
+  if(usable)
+    {
+      request=found->request;
+      length=found->reply;
+      reply=malloc(length?length:1);
+      if(reply)
+        memcpy(reply,found->data+request,length);
+      stats.coalesced++;
+    }
+
+  if(--found->waiters==0 && landed)
+    free_flight(found);
+
+  pthread_mutex_unlock(&cache_lock);
+
+  if(!landed)
+    {
+      errno=ETIMEDOUT;
+      return -1;
+    }
+
+  /* The other run went wrong somehow.  This one might not. */
+  if(!usable)
+    return 0;
+
+  if(!reply)
+    return -1;
+
+  trace_event(TRACE_COALESCED,type,conn->fd,0);
+
+  ret=send_reply(conn,peek,request,reply,length);
+  free(reply);
+
+  return ret==0?1:-1;
+}
+
+/* Hand the result of a flight's run to everyone waiting on it. */
+
+static void
+land(struct flight *flight,int ret,struct capture *capture)
+{
+  struct flight **link;
+
+  pthread_mutex_lock(&cache_lock);
+
+  for(link=&flights;*link!=flight;link=&(*link)->next)
+    ;
+  *link=flight->next;
+
+  /* The waiters can replay the run only if it read nothing beyond
+     what they have seen waiting for them too. */
+  flight->landed=1;
+  flight->usable=(ret>=0 && !capture->spoiled
+                  && capture->request<=flight->length);
+  if(flight->usable)
+    {
+      flight->data=capture->data;
+      flight->request=capture->request;
+      flight->reply=capture->reply;
+      capture->data=NULL;
+    }
+
+  pthread_cond_broadcast(&flight_cond);
+
+  if(!flight->waiters)
+    free_flight(flight);
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void
+store(msg_handler_t handler,uint16_t type,unsigned int ttl,
+      struct capture *capture)
+{
+  struct cache_entry *entry,**bucket;
+  struct cache_shape *shape;
+  size_t i,size=_config->cache.size;
+
+  entry=malloc(sizeof(*entry)+capture->request+capture->reply);
+  if(!entry)
+    return;
+
+  entry->handler=handler;
+  entry->type=type;
+  entry->request=capture->request;
+  entry->reply=capture->reply;
+  entry->expires=monotonic_ns()+(uint64_t)ttl*1000000;
+  entry->hash=hash_request(handler,type,capture->data,capture->request);
+  memcpy(entry->data,capture->data,capture->request+capture->reply);
+
+  pthread_mutex_lock(&cache_lock);
+
+  shape=find_shape(handler,type);
+  if(!shape)
+    {
+      shape=calloc(1,sizeof(*shape));
+      if(!shape)
+        goto fail;
+
+      shape->handler=handler;
+      shape->type=type;
+      shape->next=shapes;
+      shapes=shape;
+    }
+
+  for(i=0;i<shape->count;i++)
+    if(shape->lengths[i]==entry->request)
+      break;
+
+  if(i==shape->count)
+    {
+      if(shape->count==CACHE_LENGTHS)
+        goto fail;
+
+      shape->lengths[shape->count++]=entry->request;
+    }
+
+  /* Two workers can miss on the same request at once.  The newer
+     reply wins. */
+  bucket=&buckets[entry->hash%CACHE_BUCKETS];
+  for(;*bucket;bucket=&(*bucket)->next)
+    if((*bucket)->hash==entry->hash && (*bucket)->handler==handler
+       && (*bucket)->type==type && (*bucket)->request==entry->request
+       && memcmp((*bucket)->data,entry->data,entry->request)==0)
+      {
+        remove_entry(*bucket);
+        break;
+      }
+
+  while(lru_tail && stats.bytes+entry_size(entry)>size)
+    {
+      remove_entry(lru_tail);
+      stats.evictions++;
+    }
+
+  entry->next=buckets[entry->hash%CACHE_BUCKETS];
+  buckets[entry->hash%CACHE_BUCKETS]=entry;
+  lru_push(entry);
+  stats.entries++;
+  stats.bytes+=entry_size(entry);
+
+  pthread_mutex_unlock(&cache_lock);
+
+  return;
+
+ fail:
+  pthread_mutex_unlock(&cache_lock);
+  free(entry);
+}
+
+int
+cache_call(msg_handler_t handler,uint16_t type,unsigned int ttl,int coalesce,
+           struct msg_connection *conn)
+{
+  unsigned char peek[CACHE_PEEK];
+  struct capture capture;
+  struct flight *flight=NULL;
+  ssize_t got;
+  int ret;
+
+  /* A compressed request can't be told apart by its bytes. */
+  if((!ttl && !coalesce) || conn->compress.codec)
+    return handler(type,conn);
+
+  if(conn->bits.memory)
+    {
+      got=conn->memory.length-conn->memory.offset;
+      if(got>sizeof(peek))
+        got=sizeof(peek);
+      memcpy(peek,&conn->memory.data[conn->memory.offset],got);
+    }
+  else
+    {
+      got=recv(conn->fd,peek,sizeof(peek),MSG_PEEK|MSG_DONTWAIT);
+      conn->syscalls.reads++;
+      if(got==-1)
+        got=0;
+    }
+
+  if(ttl)
+    {
+      ret=serve_hit(handler,type,conn,peek,got);
+      if(ret)
+        return ret==1?0:-1;
+    }
+
+  /* Nothing waiting yet means nothing to tell requests apart by. */
+  if(coalesce && got>0)
+    {
+      ret=join_flight(handler,type,conn,peek,got,&flight);
+      if(ret)
+        return ret==1?0:-1;
+    }
+
+  /* No one entry may take more than a sixteenth of the cache. */
+  memset(&capture,0,sizeof(capture));
+  capture.limit=_config->cache.size/16;
+
+  conn->capture=&capture;
+  ret=handler(type,conn);
+  conn->capture=NULL;
+
+  if(ttl && ret>=0 && !capture.spoiled)
+    store(handler,type,ttl,&capture);
+
+  if(flight)
+    land(flight,ret,&capture);
+
+  free(capture.data);
+
+  return ret;
+}
+
+static void
+append(struct capture *capture,const void *buf,size_t count)
+{
+  size_t used=capture->request+capture->reply;
+
+  if(capture->spoiled)
+    return;
+
+  if(used+count>capture->limit)
+    {
+      capture->spoiled=1;
+      return;
+    }
+
+  if(used+count>capture->size)
+    {
+      size_t size=capture->size?capture->size*2:256;
+      unsigned char *data;
+
+      while(size<used+count)
+        size*=2;
+
+      data=realloc(capture->data,size);
+      if(!data)
+        {
+          capture->spoiled=1;
+          return;
+        }
+
+      capture->data=data;
+      capture->size=size;
+    }
+
+  memcpy(capture->data+used,buf,count);
+}
+
+void
+capture_read(struct msg_connection *conn,const void *buf,size_t count)
+{
+  struct capture *capture=conn->capture;
+
+  /* Reading after replying means a conversation, not a request and
+     its answer. */
+  if(capture->reply)
+    capture->spoiled=1;
+
+  append(capture,buf,count);
+  capture->request+=count;
+}
+
+void
+capture_write(struct msg_connection *conn,const void *buf,size_t count)
+{
+  struct capture *capture=conn->capture;
+
+  append(capture,buf,count);
+  capture->reply+=count;
+}
+
+void
+capture_spoil(struct msg_connection *conn)
+{
+  if(conn->capture)
+    conn->capture->spoiled=1;
+}
+
+void
+msg_cache_invalidate(uint16_t type)
+{
+  struct cache_entry *entry,*next;
+
+  pthread_mutex_lock(&cache_lock);
+
+  for(entry=lru_head;entry;entry=next)
+    {
+      next=entry->lru_next;
+      if(!type || entry->type==type)
+        remove_entry(entry);
+    }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void
+msg_cache_stats(struct msg_cache_stats *out)
+{
+  pthread_mutex_lock(&cache_lock);
+  *out=stats;
+  pthread_mutex_unlock(&cache_lock);
+}
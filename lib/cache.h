@@ -0,0 +1,40 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* Reply caching for handlers with a cache_ttl.  cache_call() runs
+   every request, and one without ttl or coalesce, or compressed,
+   just goes straight to the handler.  On a miss the
+   handler runs with its connection captured: every byte it reads is
+   the key, and every byte it writes is the reply.  On a hit the
+   request is consumed and the reply written straight from the cache,
+   without the handler.
+
+   A hit needs the request to be in the socket already when the
+   worker peeks at it, which it is when the client sent it in one
+   write (with a builder, say), and always is in a batch.  Anything
+   else just misses.  Runs
+   where the handler reads after it starts writing, or passes fds,
+   are not cached.
+
+   With coalesce, a request that is waiting in full when a run of the
+   same handler on the same bytes is already going waits for it, and
+   gets its reply.  The same runs that can't be cached can't be
+   shared, and neither can one that read past what it saw waiting;
+   those waiting then run the handler themselves. */
+
+struct msg_connection;
+struct capture;
+
+int cache_call(int (*handler)(uint16_t type,struct msg_connection *conn),
+               uint16_t type,unsigned int ttl,int coalesce,
+               struct msg_connection *conn);
+
+/* Hooks for the read and write paths of a captured connection. */
+void capture_read(struct msg_connection *conn,const void *buf,size_t count);
+void capture_write(struct msg_connection *conn,const void *buf,size_t count);
+void capture_spoil(struct msg_connection *conn);
+
+#endif /* !_CACHE_H_ */
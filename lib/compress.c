@@ -0,0 +1,267 @@
+#include <config.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <dispatch.h>
+#include "conn.h"
+#include "compress.h"
+
+/* Compression for large strings and buffers.  The sender compresses a
+   whole block at once, since it has it all in hand anyway.  The
+   receiver inflates as it reads, straight into the caller's buffer,
+   pulling compressed bytes off the socket a chunk at a time and never
+   past the end of the block. */
+
+#define INPUT_CHUNK 4096
+
+struct compress_state
+{
+#ifdef HAVE_ZLIB
+  z_stream zs;
+#endif
+
+  /* What's left of the current block, uncompressed and compressed. */
+  uint32_t length;
+  uint32_t compressed;
+
+  /* Set once zlib has seen the end of the stream. */
+  unsigned int ended:1;
+
+  unsigned char input[INPUT_CHUNK];
+};
+
+int
+compress_supported(int codec)
+{
+  switch(codec)
+    {
+#ifdef HAVE_ZLIB
+    case MSG_COMPRESS_ZLIB:
+      return 1;
+#endif
+
+    default:
+      return 0;
+    }
+}
+
+/* Returns a malloced buffer with headroom free bytes followed by the
+   compressed data, or NULL if the data didn't get any smaller (or
+   something went wrong), in which case it should be sent as is. */
+
+void *
+compress_block(int codec,int level,const void *src,size_t length,
+               size_t headroom,size_t *compressed)
+{
+#ifdef HAVE_ZLIB
+  if(codec==MSG_COMPRESS_ZLIB)
+    {
+      uLongf size=compressBound(length);
+      unsigned char *dst;
+
+      if(level<1 || level>9)
+        level=Z_DEFAULT_COMPRESSION;
+
+      dst=malloc(headroom+size);
+      if(!dst)
+        return NULL;
+
+      if(compress2(&dst[headroom],&size,src,length,level)!=Z_OK
+         || size>=length)
+        {
+          free(dst);
+          return NULL;
+        }
+
+      *compressed=size;
+
+      return dst;
+    }
+#endif
+
+  return NULL;
+}
+
+int
+decompress_start(struct msg_connection *conn,uint32_t length,
+                 uint32_t compressed)
+{
+#ifdef HAVE_ZLIB
+  struct compress_state *state=conn->compress.state;
+
+  if(!length || !compressed)
+    {
+      errno=EPROTO;
+      return -1;
+    }
+
+  if(state)
+    inflateReset(&state->zs);
+  else
+    {
+      state=calloc(1,sizeof(*state));
+      if(!state)
+        return -1;
+
+      if(inflateInit(&state->zs)!=Z_OK)
+        {
+          free(state);
+          errno=ENOMEM;
+          return -1;
+        }
+
+      conn->compress.state=state;
+    }
+
+  state->length=length;
+  state->compressed=compressed;
+  state->ended=0;
+  conn->compress.inflating=1;
+
+  return 1;
+#else
+  errno=ENOTSUP;
+  return -1;
+#endif
+}
+
+#ifdef HAVE_ZLIB
+
+/* Run the inflater until out is full, feeding it from the socket as
+   needed. */
+
+static ssize_t
+inflate_into(struct msg_connection *conn,void *out,size_t count,int finish)
+{
+  struct compress_state *state=conn->compress.state;
+
+  state->zs.next_out=out;
+  state->zs.avail_out=count;
+
+  for(;;)
+    {
+      int ret;
+
+      if(!state->zs.avail_in && state->compressed)
+        {
+          size_t want=state->compressed;
+          ssize_t err;
+
+          if(want>INPUT_CHUNK)
+            want=INPUT_CHUNK;
+
+          err=read_raw(conn,state->input,want);
+          if(err!=want)
+            return err;
+
+          state->compressed-=want;
+          state->zs.next_in=state->input;
+          state->zs.avail_in=want;
+        }
+
+      ret=inflate(&state->zs,Z_NO_FLUSH);
+      if(ret==Z_STREAM_END)
+        {
+          /* The end can come along with the last of the data. */
+          state->ended=1;
+          if(finish || !state->zs.avail_out)
+            return finish?1:count;
+          break;
+        }
+      else if(ret!=Z_OK)
+        break;
+
+      if(!state->zs.avail_out && !finish)
+        return count;
+
+      if(!state->zs.avail_in && !state->compressed)
+        break;
+    }
+
+  errno=EPROTO;
+  return -1;
+}
+
+#endif
+
+ssize_t
+decompress_read(struct msg_connection *conn,void *buf,size_t count)
+{
+#ifdef HAVE_ZLIB
+  struct compress_state *state=conn->compress.state;
+  size_t todo=count;
+  ssize_t err;
+
+  if(todo>state->length)
+    todo=state->length;
+
+  err=inflate_into(conn,buf,todo,0);
+  if(err!=todo)
+    goto fail;
+
+  state->length-=todo;
+
+  if(!state->length)
+    {
+      unsigned char extra;
+
+      /* All the data is out, but the stream trailer may still be
+         waiting.  Anything other than a clean end means the two
+         sides disagree about this block. */
+
+      if(!state->ended)
+        {
+          err=inflate_into(conn,&extra,1,1);
+          if(err!=1 || state->zs.avail_out!=1)
+            goto fail;
+        }
+
+      if(state->zs.avail_in || state->compressed)
+        {
+          err=1;
+          goto fail;
+        }
+
+      conn->compress.inflating=0;
+    }
+
+  /* A read that runs past the end of the block gets the rest from
+     the socket. */
+  if(todo<count)
+    {
+      err=read_raw(conn,(char *)buf+todo,count-todo);
+      if(err!=count-todo)
+        return err;
+    }
+
+  return count;
+
+ fail:
+  conn->compress.inflating=0;
+  if(err>0)
+    {
+      errno=EPROTO;
+      err=-1;
+    }
+  return err;
+#else
+  errno=ENOTSUP;
+  return -1;
+#endif
+}
+
+void
+compress_free(struct msg_connection *conn)
+{
+#ifdef HAVE_ZLIB
+  if(conn->compress.state)
+    inflateEnd(&conn->compress.state->zs);
+#endif
+
+  free(conn->compress.state);
+  conn->compress.state=NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <inttypes.h>
+
+int compress_supported(int codec);
+void *compress_block(int codec,int level,const void *src,size_t length,
+                     size_t headroom,size_t *compressed);
+int decompress_start(struct msg_connection *conn,uint32_t length,
+                     uint32_t compressed);
+ssize_t decompress_read(struct msg_connection *conn,void *buf,size_t count);
+void compress_free(struct msg_connection *conn);
+
+#endif /* !_COMPRESS_H_ */
@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <dispatch.h>
 #include "conn.h"
+#include "compress.h"
 
 /* No caching yet.  This is all opens and closes. */
 
@@ -166,10 +167,100 @@ get_connection(const char *host,const char *service,int flags)
   return NULL;
 }
 
+struct msg_connection *
+memory_connection(size_t size)
+{
+  struct msg_connection *conn;
+
+  conn=calloc(1,sizeof(*conn));
+  if(!conn)
+    return NULL;
+
+  conn->fd=-1;
+  conn->bits.memory=1;
+
+  if(size)
+    {
+      conn->memory.data=malloc(size);
+      if(!conn->memory.data)
+        {
+          free(conn);
+          return NULL;
+        }
+
+      conn->memory.size=size;
+    }
+
+  return conn;
+}
+
+/* Like msg_read, there are no short reads.  Running out of data is
+   EOF. */
+
+ssize_t
+memory_read(struct msg_connection *conn,void *buf,size_t count)
+{
+  if(conn->memory.length-conn->memory.offset<count)
+    return 0;
+
+  memcpy(buf,&conn->memory.data[conn->memory.offset],count);
+  conn->memory.offset+=count;
+
+  /* Once everything written has been read, start over at the front
+     so a connection used as a loopback doesn't grow forever. */
+  if(conn->memory.offset==conn->memory.length)
+    conn->memory.offset=conn->memory.length=0;
+
+  return count;
+}
+
+ssize_t
+memory_write(struct msg_connection *conn,const void *buf,size_t count)
+{
+  if(conn->bits.borrowed)
+    {
+      errno=EBADF;
+      return -1;
+    }
+
+  if(conn->memory.size-conn->memory.length<count)
+    {
+      size_t size=conn->memory.size?conn->memory.size:64;
+      unsigned char *data;
+
+      while(size-conn->memory.length<count)
+        size*=2;
+
+      data=realloc(conn->memory.data,size);
+      if(!data)
+        return -1;
+
+      conn->memory.data=data;
+      conn->memory.size=size;
+    }
+
+  memcpy(&conn->memory.data[conn->memory.length],buf,count);
+  conn->memory.length+=count;
+
+  return count;
+}
+
 int
 close_connection(struct msg_connection *conn)
 {
-  close(conn->fd);
+  if(conn->bits.memory)
+    {
+      if(!conn->bits.borrowed)
+        free(conn->memory.data);
+    }
+  else
+    close(conn->fd);
+
+  compress_free(conn);
+
+  if(conn->member)
+    group_release(conn->member);
+
   if(!conn->bits.internal)
     free(conn);
 
@@ -183,6 +274,9 @@ conn_peerinfo(struct msg_connection *conn,struct msg_peerinfo *info)
   struct ucred ucred;
   socklen_t len=sizeof(ucred);
 
+  if(conn->outer)
+    conn=conn->outer;
+
   if(getsockopt(conn->fd,SOL_SOCKET,SO_PEERCRED,&ucred,&len)==-1)
     return -1;
 
@@ -3,20 +3,120 @@
 
 #include <sys/un.h>
 
+/* The two bytes msg_open() sends before anything else.  The low bits
+   of the flags byte carry the compression codec the client can
+   decode. */
+#define HEADER_VERSION    1
+#define HEADER_CODEC_MASK 0x0F
+
+/* Set in the flags byte when the header is followed by a deadline:
+   8 bytes of nanoseconds the client will still wait for an answer.
+   Clocks on the two sides need not agree, so it goes as what is left
+   rather than as a time, and the server counts from when it reads
+   it. */
+#define HEADER_DEADLINE   0x10
+
+/* A server answers MSG_TYPE_PING with a 0, and then a byte of these,
+   which older servers leave out.  Clients only send a server what it
+   has said it reads.  PING_COMPRESS is for zlib compressed strings
+   and buffers, which a server built without zlib can't read.
+   ping_features() is what this build reads. */
+#define PING_DEADLINE     0x01
+#define PING_COMPRESS     0x02
+
+struct compress_state;
+struct group_member;
+struct capture;
+
 struct msg_connection
 {
   int fd;
   int flags;
+
+  /* CLOCK_MONOTONIC nanoseconds, or 0 for none. */
+  uint64_t deadline;
   struct
   {
     unsigned int internal:1;
+    unsigned int memory:1;
+    unsigned int borrowed:1;
+
+    /* The socket has timeouts, so EAGAIN means ETIMEDOUT. */
+    unsigned int timeout:1;
   } bits;
+  struct
+  {
+    unsigned long reads;
+    unsigned long writes;
+  } syscalls;
+
+  /* Moved over the socket, after any compression. */
+  struct
+  {
+    uint64_t in;
+    uint64_t out;
+  } bytes;
+
+  /* A memory connection has no socket.  Writes append to data, and
+     reads consume from offset, like a pipe with no size limit.  A
+     borrowed buffer belongs to someone else, and can only be read. */
+  struct
+  {
+    unsigned char *data;
+    size_t size;
+    size_t length;
+    size_t offset;
+  } memory;
+  struct
+  {
+    int codec;
+    int level;
+    size_t threshold;
+
+    /* A buffer length held back by msg_write_buffer_length() so the
+       buffer can be compressed when it arrives. */
+    size_t pending;
+
+    /* Reads come out of the decompressor until the current block is
+       used up. */
+    unsigned int inflating:1;
+    struct compress_state *state;
+  } compress;
+
+  /* The group member this came from, which counts it as outstanding
+     until it closes. */
+  struct group_member *member;
+
+  /* Set while a cacheable handler runs, to record its request and
+     reply. */
+  struct capture *capture;
+
+  /* For a request in a batch, the connection the batch came in on,
+     which knows the peer. */
+  struct msg_connection *outer;
 };
 
 socklen_t populate_sockaddr_un(const char *service,struct sockaddr_un *addr_un);
 int cloexec_fd(int fd);
 int nonblock_fd(int fd);
 struct msg_connection *get_connection(const char *host,const char *service,int flags);
+struct msg_connection *memory_connection(size_t size);
+ssize_t memory_read(struct msg_connection *conn,void *buf,size_t count);
+ssize_t memory_write(struct msg_connection *conn,const void *buf,size_t count);
+ssize_t read_raw(struct msg_connection *conn,void *buf,size_t count);
+ssize_t write_raw(struct msg_connection *conn,const void *buf,size_t count);
+int set_compression(struct msg_connection *conn,int codec,
+                    const struct msg_config *config);
+int flush_buffer_length(struct msg_connection *conn);
+uint64_t monotonic_ns(void);
+int read_header(struct msg_connection *conn,unsigned char *header,
+                uint16_t *type);
+int ping_features(void);
+int apply_timeouts(struct msg_connection *conn);
+int deadline_passed(struct msg_connection *conn);
+int set_deadline(struct msg_connection *conn,uint64_t deadline);
+int read_string_length(struct msg_connection *conn,size_t *length,int *null);
+void group_release(struct group_member *member);
 int close_connection(struct msg_connection *conn);
 int conn_peerinfo(struct msg_connection *conn,struct msg_peerinfo *info);
 
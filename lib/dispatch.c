@@ -10,11 +10,19 @@
 #include <syslog.h>
 #include <dispatch.h>
 #include "conn.h"
+#include "trace.h"
+#include "affinity.h"
+#include "limit.h"
+#include "cache.h"
+#include "batch.h"
+#include "pubsub.h"
+#include "account.h"
 
 extern struct msg_config *_config;
 static pthread_mutex_t concurrency_lock=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t concurrency_cond=PTHREAD_COND_INITIALIZER;
 static size_t concurrency;
+static struct limiter limiter;
 
 typedef int (*msg_handler_t)(unsigned short,struct msg_connection *conn);
 
@@ -22,6 +30,7 @@ struct accept_data
 {
   int sock;
   struct msg_handler *handlers;
+  struct affinity_plan *affinity;
 };
 
 struct dispatch_data
@@ -29,6 +38,16 @@ struct dispatch_data
   int (*handler)(unsigned short type,struct msg_connection *conn);
   struct msg_connection conn;
   unsigned short type;
+  unsigned int cache_ttl;
+  unsigned int coalesce:1;
+
+  /* Served by dispatch itself, as one of the reserved types. */
+  unsigned int builtin:1;
+  int listener;
+
+  /* For a batch, which can be of any type. */
+  struct msg_handler *handlers;
+  struct affinity_entry *affinity;
 };
 
 /* Again, I'm skipping all the connection caching stuff for now.  This
@@ -37,7 +56,9 @@ struct dispatch_data
 static int
 internal_ping(uint16_t type,struct msg_connection *conn)
 {
-  return msg_write_uint8(conn,0);
+  unsigned char answer[2]={0,ping_features()};
+
+  return msg_write(conn,answer,sizeof(answer));
 }
 
 static msg_handler_t
@@ -55,10 +76,84 @@ lookup_handler(struct msg_handler *handlers,unsigned short type)
   return NULL;
 }
 
+/* Whether dispatch serves type itself.  A handler in the table
+   comes first, except for an enabled handoff, which calls it once
+   the socket has gone.  A handoff nobody handles is refused rather
+   than treated as an unknown type, which would take the server
+   down. */
+
+static int
+builtin_type(msg_handler_t handler,unsigned short type)
+{
+  switch(type)
+    {
+    case MSG_TYPE_HANDOFF:
+      return _config->handoff.enabled || !handler;
+    case MSG_TYPE_BATCH:
+    case MSG_TYPE_SUBSCRIBE:
+      return !handler;
+    }
+
+  return 0;
+}
+
+/* Hand our listening socket to a process that asked for it, so it
+   can take over without a moment where nobody is listening.  It gets
+   a status first, 0 or an errno value, and then the socket if the
+   status was 0.  With handoff off the status is EOPNOTSUPP. */
+
+static int
+send_listener(int sock,struct msg_connection *conn)
+{
+  struct msg_peerinfo info;
+  int32_t status=0;
+  int err;
+
+  /* Whoever has the socket can impersonate us, so only let our own
+     user have it. */
+  if(!_config->handoff.enabled)
+    status=EOPNOTSUPP;
+  else if(conn_peerinfo(conn,&info)==-1)
+    status=errno;
+  else if(info.local.uid!=geteuid())
+    status=EPERM;
+
+  err=msg_write_int32(conn,status);
+  if(err<1)
+    return -1;
+
+  if(status)
+    {
+      errno=status;
+      return -1;
+    }
+
+  if(msg_write_fd(conn,sock)<1)
+    return -1;
+
+  return 0;
+}
+
+static struct msg_handler *
+lookup_entry(struct msg_handler *handlers,unsigned short type)
+{
+  int i;
+
+  for(i=0;handlers[i].type;i++)
+    if(handlers[i].type==type)
+      return &handlers[i];
+
+  return NULL;
+}
+
+/* latency is how long the handler ran, if the limiter wants it. */
+
 static void
-concurrency_dec(void)
+concurrency_dec(uint64_t latency)
 {
   pthread_mutex_lock(&concurrency_lock);
+  if(latency)
+    limiter_sample(&limiter,latency,concurrency);
   concurrency--;
   pthread_cond_signal(&concurrency_cond);
   pthread_mutex_unlock(&concurrency_lock);
@@ -68,14 +163,55 @@ static void *
 worker_thread(void *d)
 {
   struct dispatch_data *ddata=d;
+  uint64_t start=0,latency=0,cpu=0,batched=0;
+  int ret;
+
+  affinity_apply(ddata->affinity);
+
+  trace_event(TRACE_HANDLER_START,ddata->type,0,0);
 
-  (ddata->handler)(ddata->type,&ddata->conn);
+  /* Batches, subscriptions and handoffs take as long as they take,
+     which says nothing about how loaded the server is. */
+  if(limiter.adaptive && !ddata->builtin)
+    start=monotonic_ns();
+
+  if(_config->account.enabled)
+    cpu=thread_cpu_ns();
+
+  /* A handler for MSG_TYPE_HANDOFF runs once the socket has gone, so
+     the program can wind down. */
+  if(ddata->builtin && ddata->type==MSG_TYPE_HANDOFF)
+    {
+      ret=send_listener(ddata->listener,&ddata->conn);
+      if(ret==0 && ddata->handler)
+        ret=(ddata->handler)(ddata->type,&ddata->conn);
+    }
+  else if(ddata->builtin && ddata->type==MSG_TYPE_BATCH)
+    ret=batch_serve(ddata->handlers,&ddata->conn,&batched);
+  else if(ddata->builtin)
+    ret=pubsub_subscribe(&ddata->conn);
+  else
+    ret=cache_call(ddata->handler,ddata->type,ddata->cache_ttl,
+                   ddata->coalesce,&ddata->conn);
+
+  /* Never 0, which would mean no sample. */
+  if(start)
+    latency=monotonic_ns()-start+1;
+
+  trace_event(TRACE_HANDLER_END,ddata->type,ret,0);
+
+  /* The requests in a batch were counted as they ran, and the batch
+     only gets what was left. */
+  if(_config->account.enabled)
+    account_request(ddata->type,&ddata->conn,thread_cpu_ns()-cpu-batched);
+
+  trace_event(TRACE_CLOSE,ddata->type,ddata->conn.fd,0);
 
   close_connection(&ddata->conn);
 
   free(ddata);
 
-  concurrency_dec();
+  concurrency_dec(latency);
 
   return NULL;
 }
@@ -109,19 +245,29 @@ dump_status(FILE *output)
 }
 #endif
 
+/* err is the errno value of what went wrong, which callers pass in
+   because not everything that fails leaves it in errno. */
+
 static void
-call_panic(struct msg_handler *handlers,const char *where,const char *error)
+call_panic(struct msg_handler *handlers,const char *where,int err)
 {
   msg_handler_t hand=lookup_handler(handlers,MSG_TYPE_PANIC);
+  const char *trace_file;
+
+  trace_event(TRACE_PANIC,0,0,err);
 
   syslog(LOG_DAEMON|LOG_CRIT,"Dispatch PANIC!  Location: %s  Concurrency:"
          " %u of %u  Error: %s",where?where:"<NULL>",
-         (unsigned int)concurrency,(unsigned int)_config->max_concurrency,
-         error?error:"<NULL>");
+         (unsigned int)concurrency,(unsigned int)limiter_limit(&limiter),
+         strerror(err));
 
   fprintf(stderr,"Dispatch PANIC!  Location: %s  Concurrency: %u of %u"
           "  Error: %s\n",where?where:"<NULL>",(unsigned int)concurrency,
-          (unsigned int)_config->max_concurrency,error?error:"<NULL>");
+          (unsigned int)limiter_limit(&limiter),strerror(err));
+
+  trace_file=trace_dump_file();
+  if(trace_file)
+    fprintf(stderr,"Dispatch trace written to %s\n",trace_file);
 
   if(hand)
     (hand)(MSG_TYPE_PANIC,NULL);
@@ -139,28 +285,22 @@ static void *
 accept_thread(void *d)
 {
   struct accept_data *adata=d;
-  pthread_attr_t attr;
   unsigned int failed_accept_count=0;
 
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
-  if(_config->stacksize)
-    {
-      int err=pthread_attr_setstacksize(&attr,_config->stacksize);
-      if(err)
-        call_panic(adata->handlers,"pthread_attr_setstacksize",strerror(err));
-    }
+  if(affinity_pin_accept(adata->affinity)==-1)
+    call_panic(adata->handlers,"affinity_pin_accept",errno);
 
   for(;;)
     {
-      unsigned char header[4];
+      unsigned char header[2];
       ssize_t err;
       pthread_t worker;
       struct dispatch_data *ddata;
+      struct msg_handler *entry;
 
       pthread_mutex_lock(&concurrency_lock);
 
-      while(concurrency>=_config->max_concurrency)
+      while(concurrency>=limiter_limit(&limiter))
         pthread_cond_wait(&concurrency_cond,&concurrency_lock);
 
       concurrency++;
@@ -169,7 +309,7 @@ accept_thread(void *d)
 
       ddata=calloc(1,sizeof(*ddata));
       if(!ddata)
-        call_panic(adata->handlers,"calloc",strerror(errno));
+        call_panic(adata->handlers,"calloc",errno);
 
       ddata->conn.bits.internal=1;
 
@@ -178,8 +318,10 @@ accept_thread(void *d)
           ddata->conn.fd=accept(adata->sock,NULL,NULL);
           if(ddata->conn.fd==-1 && errno!=EINTR)
             {
+              trace_event(TRACE_ACCEPT_ERROR,0,0,errno);
+
               if(_config->panic_on.failed_accept)
-                call_panic(adata->handlers,"accept",strerror(errno));
+                call_panic(adata->handlers,"accept",errno);
               else if(_config->log_on.failed_accept
                       && (failed_accept_count++)%_config->log_on.failed_accept==0)
                 syslog(LOG_DAEMON|LOG_ERR,"Dispatch could not accept: %s",
@@ -188,29 +330,70 @@ accept_thread(void *d)
         }
       while(ddata->conn.fd==-1);
 
+      trace_event(TRACE_ACCEPT,0,ddata->conn.fd,0);
+
       if(cloexec_fd(ddata->conn.fd)==-1)
-        call_panic(adata->handlers,"cloexec",strerror(errno));
+        call_panic(adata->handlers,"cloexec",errno);
 
-      err=msg_read(&ddata->conn,header,4);
-      if(err==0)
+      if(apply_timeouts(&ddata->conn)==-1)
+        call_panic(adata->handlers,"apply_timeouts",errno);
+
+      err=read_header(&ddata->conn,header,&ddata->type);
+      if(err==0 || (err==-1 && errno==ETIMEDOUT))
         {
-          /* EOF, so close and reloop. */
+          /* EOF, or a client too slow to send a header, so close and
+             reloop. */
+
+          if(err==0)
+            trace_event(TRACE_HEADER_EOF,0,ddata->conn.fd,0);
+          else
+            trace_event(TRACE_HEADER_ERROR,0,ddata->conn.fd,errno);
 
           close(ddata->conn.fd);
           free(ddata);
-          concurrency_dec();
+          concurrency_dec(0);
 
           continue;
         }
       else if(err==-1)
-        call_panic(adata->handlers,"msg_read",strerror(errno));
+        {
+          trace_event(TRACE_HEADER_ERROR,0,ddata->conn.fd,errno);
+          call_panic(adata->handlers,"msg_read",errno);
+        }
+
+      trace_event(TRACE_HEADER,0,header[0]<<8|header[1],0);
+
+      /* Nobody is waiting for the answer any more. */
+      if(deadline_passed(&ddata->conn))
+        {
+          trace_event(TRACE_EXPIRED,ddata->type,ddata->conn.fd,0);
+
+          close(ddata->conn.fd);
+          free(ddata);
+          concurrency_dec(0);
+
+          continue;
+        }
 
-      ddata->type =header[2]<<8;
-      ddata->type|=header[3];
+      /* The client can decode this codec.  If we can encode it, and
+         are configured to, the replies get compressed too.  Anything
+         we don't know stays uncompressed, which every client reads. */
+      if((header[1]&HEADER_CODEC_MASK)
+         && (header[1]&HEADER_CODEC_MASK)==_config->compress.codec)
+        set_compression(&ddata->conn,_config->compress.codec,_config);
 
       ddata->handler=lookup_handler(adata->handlers,ddata->type);
-      if(!ddata->handler)
+      entry=lookup_entry(adata->handlers,ddata->type);
+      ddata->cache_ttl=entry?entry->cache_ttl:0;
+      ddata->coalesce=entry && entry->coalesce;
+      ddata->listener=adata->sock;
+      ddata->handlers=adata->handlers;
+      ddata->builtin=builtin_type(ddata->handler,ddata->type);
+      if(!ddata->handler && !ddata->builtin)
         {
+          trace_event(TRACE_UNKNOWN_TYPE,ddata->type,0,0);
+          trace_dump_file();
+
           syslog(LOG_DAEMON|LOG_CRIT,"Unable to handle type %"PRIu16,
                  ddata->type);
 
@@ -219,31 +402,31 @@ accept_thread(void *d)
           abort();
         }
 
+      trace_event(TRACE_DISPATCH,ddata->type,0,0);
+
       /* Pop off a thread to handle the connection */
 
-      err=pthread_create(&worker,&attr,worker_thread,ddata);
+      ddata->affinity=affinity_lookup(adata->affinity,ddata->type);
+
+      err=pthread_create(&worker,&ddata->affinity->attr,worker_thread,ddata);
       if(err)
-        call_panic(adata->handlers,"pthread_create",strerror(err));
+        {
+          trace_event(TRACE_THREAD_ERROR,ddata->type,0,err);
+          call_panic(adata->handlers,"pthread_create",err);
+        }
     }
 
   return NULL;
 }
 
-int
-msg_listen(const char *host,const char *service,int flags,
-           struct msg_handler *handlers)
+/* Everything msg_listen() and msg_listen_fd() share: the config,
+   the tracer, and a private copy of the handler table. */
+
+static struct accept_data *
+new_accept_data(struct msg_handler *handlers)
 {
-  int i,err,save_errno;
   struct accept_data *data;
-  pthread_t thread;
-
-  /* We don't need these yet, so lock them to their correct values. */
-  if(host || !service || strlen(service)<2
-     || !(service[0]=='/' || service[0]=='@'))
-    {
-      errno=EINVAL;
-      return -1;
-    }
+  int i;
 
   if(!_config)
     {
@@ -253,9 +436,19 @@ msg_listen(const char *host,const char *service,int flags,
       _config=&my_config;
     }
 
+  if(trace_init(_config->trace.events,_config->trace.signal,
+                _config->trace.file)==-1)
+    return NULL;
+
+  /* Every listener shares the one limit, so the first sets it up. */
+  pthread_mutex_lock(&concurrency_lock);
+  if(!limiter.ready)
+    limiter_init(&limiter,_config);
+  pthread_mutex_unlock(&concurrency_lock);
+
   data=calloc(1,sizeof(*data));
   if(!data)
-    return -1;
+    return NULL;
 
   data->sock=-1;
 
@@ -265,13 +458,97 @@ msg_listen(const char *host,const char *service,int flags,
 
   data->handlers=calloc(1,(i+1)*sizeof(struct msg_handler));
   if(!data->handlers)
-    goto fail;
+    {
+      free(data);
+      return NULL;
+    }
 
   for(i=0;handlers[i].type;i++)
     data->handlers[i]=handlers[i];
 
   data->handlers[i].type=0;
 
+  data->affinity=affinity_plan_new(_config);
+  if(!data->affinity)
+    {
+      int save_errno=errno;
+
+      free(data->handlers);
+      free(data);
+      errno=save_errno;
+
+      return NULL;
+    }
+
+  return data;
+}
+
+static void
+free_accept_data(struct accept_data *data)
+{
+  affinity_plan_free(data->affinity);
+  free(data->handlers);
+  free(data);
+}
+
+/* At this point, we have a handler table and a socket, so let's make
+   a thread. */
+
+static int
+start_accepting(struct accept_data *data,int flags)
+{
+  pthread_t thread;
+  int err;
+
+  if(flags&MSG_NORETURN)
+    accept_thread(data);
+  else
+    {
+      err=pthread_create(&thread,NULL,accept_thread,data);
+      if(err)
+        {
+          errno=err;
+          return -1;
+        }
+    }
+
+  return 0;
+}
+
+size_t
+msg_concurrency_limit(void)
+{
+  size_t limit;
+
+  pthread_mutex_lock(&concurrency_lock);
+  if(limiter.ready)
+    limit=limiter_limit(&limiter);
+  else
+    limit=_config?_config->max_concurrency:(size_t)-1;
+  pthread_mutex_unlock(&concurrency_lock);
+
+  return limit;
+}
+
+int
+msg_listen(const char *host,const char *service,int flags,
+           struct msg_handler *handlers)
+{
+  int err,save_errno;
+  struct accept_data *data;
+
+  /* We don't need these yet, so lock them to their correct values. */
+  if(host || !service || strlen(service)<2
+     || !(service[0]=='/' || service[0]=='@'))
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  data=new_accept_data(handlers);
+  if(!data)
+    return -1;
+
   if(service[0]=='/' || service[0]=='@')
     {
       struct sockaddr_un addr_un;
@@ -300,33 +577,90 @@ msg_listen(const char *host,const char *service,int flags,
   if(err==-1)
     goto fail;
 
-  /* At this point, we have a handler table and a socket, so let's
-     make a thread. */
-
-  if(flags&MSG_NORETURN)
-    accept_thread(data);
-  else
-    {
-      err=pthread_create(&thread,NULL,accept_thread,data);
-      if(err)
-        {
-          errno=err;
-          goto fail;
-        }
-    }
+  if(start_accepting(data,flags)==-1)
+    goto fail;
 
   return 0;
   
  fail:
   save_errno=errno;
-  if(data)
+  close(data->sock);
+  free_accept_data(data);
+  errno=save_errno;
+
+  return -1;
+}
+
+int
+msg_listen_fd(int fd,int flags,struct msg_handler *handlers)
+{
+  int listening=0;
+  socklen_t len=sizeof(listening);
+  struct accept_data *data;
+
+  if(getsockopt(fd,SOL_SOCKET,SO_ACCEPTCONN,&listening,&len)==-1)
+    return -1;
+
+  if(!listening)
     {
-      close(data->sock);
-      free(data->handlers);
+      errno=EINVAL;
+      return -1;
     }
 
-  free(data);
+  if(cloexec_fd(fd)==-1)
+    return -1;
+
+  data=new_accept_data(handlers);
+  if(!data)
+    return -1;
+
+  data->sock=fd;
+
+  if(start_accepting(data,flags)==-1)
+    {
+      int save_errno=errno;
+
+      free_accept_data(data);
+      errno=save_errno;
+
+      return -1;
+    }
+
+  return 0;
+}
+
+int
+msg_handoff_receive(const char *service)
+{
+  struct msg_connection *conn;
+  int32_t status;
+  int fd=-1,err,save_errno;
+
+  conn=msg_open(NULL,service,0);
+  if(!conn)
+    return -1;
+
+  err=msg_write_type(conn,MSG_TYPE_HANDOFF);
+  if(err>0)
+    err=msg_read_int32(conn,&status);
+  if(err>0 && status)
+    {
+      errno=status;
+      err=-1;
+    }
+  if(err>0)
+    err=msg_read_fd(conn,&fd);
+  if(err==0)
+    {
+      /* An older server that doesn't know the type just hangs up. */
+      errno=EPROTO;
+      err=-1;
+    }
+
+  save_errno=errno;
+  msg_poison(conn);
+  msg_close(conn);
   errno=save_errno;
 
-  return -1;
+  return err>0?fd:-1;
 }
@@ -0,0 +1,754 @@
+#include <config.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <dispatch.h>
+#include "conn.h"
+
+extern struct msg_config *_config;
+
+/* A member that fails to open, or to answer a ping, sits out this
+   long before it is tried again. */
+#define GROUP_RETRY_NS 1000000000ULL
+
+/* Reply times kept for working out the hedging delay, which is
+   refreshed every GROUP_HEDGE_REFRESH calls. */
+#define GROUP_HEDGE_SAMPLES 256
+#define GROUP_HEDGE_REFRESH 32
+
+/* Unused hedges saved up, so a burst of slow calls can be hedged. */
+#define GROUP_HEDGE_BURST 10.0
+
+struct group_member
+{
+  struct msg_group *group;
+  char *service;
+  uint64_t hash;
+
+  /* All under the group lock. */
+  unsigned int up:1;
+  uint64_t retry;
+  size_t outstanding;
+
+  /* Smoothed ping round trip, in nanoseconds.  0 until the first. */
+  uint64_t latency;
+};
+
+struct msg_group
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t health;
+  unsigned int running:1;
+  unsigned int stopping:1;
+  int policy;
+  unsigned int interval;
+  size_t next;
+  uint64_t random;
+
+  /* Selection passes over this one, to hedge somewhere else. */
+  const struct group_member *skip;
+
+  struct
+  {
+    /* A bit per message type, set for those safe to send twice. */
+    unsigned char *types;
+    double percentile;
+    double budget;
+    double tokens;
+    uint64_t min_delay;
+    uint64_t delay;
+    uint64_t samples[GROUP_HEDGE_SAMPLES];
+    size_t count;
+  } hedge;
+
+  size_t count;
+  struct group_member members[];
+};
+
+/* splitmix64's finisher, to spread FNV-1a's bits. */
+
+static uint64_t
+mix(uint64_t x)
+{
+  x^=x>>30;
+  x*=0xBF58476D1CE4E5B9ULL;
+  x^=x>>27;
+  x*=0x94D049BB133111EBULL;
+  x^=x>>31;
+
+  return x;
+}
+
+static uint64_t
+hash_string(const char *string)
+{
+  uint64_t hash=0xCBF29CE484222325ULL;
+
+  while(*string)
+    {
+      hash^=(unsigned char)*string++;
+      hash*=0x100000001B3ULL;
+    }
+
+  return mix(hash);
+}
+
+static int
+available(const struct msg_group *group,const struct group_member *member,
+          uint64_t now)
+{
+  return member!=group->skip && (member->up || now>=member->retry);
+}
+
+static void
+mark_down(struct group_member *member,uint64_t now)
+{
+  member->up=0;
+  member->retry=now+GROUP_RETRY_NS;
+}
+
+/* Outstanding requests weighted by how slowly the member has been
+   answering pings, so a hot replica gets fewer. */
+
+static uint64_t
+cost(const struct group_member *member)
+{
+  return (member->outstanding+1)*(member->latency?member->latency:1);
+}
+
+static struct group_member *
+select_round_robin(struct msg_group *group,uint64_t now)
+{
+  size_t i;
+
+  for(i=0;i<group->count;i++)
+    {
+      struct group_member *member=&group->members[group->next++%group->count];
+
+      if(available(group,member,now))
+        return member;
+    }
+
+  return NULL;
+}
+
+static struct group_member *
+select_least_outstanding(struct msg_group *group,uint64_t now)
+{
+  struct group_member *best=NULL;
+  size_t i,start=group->next++;
+
+  /* Start somewhere new each time, so ties are spread around. */
+  for(i=0;i<group->count;i++)
+    {
+      struct group_member *member=&group->members[(start+i)%group->count];
+
+      if(available(group,member,now) && (!best || cost(member)<cost(best)))
+        best=member;
+    }
+
+  return best;
+}
+
+static struct group_member *
+select_two_choices(struct msg_group *group,uint64_t now)
+{
+  struct group_member *first=NULL,*second=NULL;
+  size_t i,up=0;
+
+  for(i=0;i<group->count;i++)
+    if(available(group,&group->members[i],now))
+      up++;
+
+  if(up<3)
+    return select_least_outstanding(group,now);
+
+  while(!second)
+    {
+      struct group_member *member;
+
+      group->random^=group->random<<13;
+      group->random^=group->random>>7;
+      group->random^=group->random<<17;
+
+      member=&group->members[group->random%group->count];
+      if(!available(group,member,now) || member==first)
+        continue;
+
+      if(!first)
+        first=member;
+      else
+        second=member;
+    }
+
+  return cost(first)<=cost(second)?first:second;
+}
+
+/* Rendezvous hashing: every key has its own ranking of the members,
+   so when one goes down only its keys move, and they spread evenly
+   over the rest. */
+
+static struct group_member *
+select_hash(struct msg_group *group,const char *key,uint64_t now)
+{
+  struct group_member *best=NULL;
+  uint64_t key_hash,best_score=0;
+  size_t i;
+
+  if(!key)
+    return select_round_robin(group,now);
+
+  key_hash=hash_string(key);
+
+  for(i=0;i<group->count;i++)
+    {
+      struct group_member *member=&group->members[i];
+      uint64_t score=mix(key_hash^member->hash);
+
+      if(available(group,member,now) && (!best || score>best_score))
+        {
+          best=member;
+          best_score=score;
+        }
+    }
+
+  return best;
+}
+
+static struct group_member *
+select_member(struct msg_group *group,const char *key,uint64_t now)
+{
+  struct group_member *member;
+  size_t i;
+
+  switch(group->policy)
+    {
+    case MSG_GROUP_LEAST_OUTSTANDING:
+      member=select_least_outstanding(group,now);
+      break;
+
+    case MSG_GROUP_TWO_CHOICES:
+      member=select_two_choices(group,now);
+      break;
+
+    case MSG_GROUP_HASH:
+      member=select_hash(group,key,now);
+      break;
+
+    default:
+      member=select_round_robin(group,now);
+      break;
+    }
+
+  if(member || group->skip)
+    return member;
+
+  /* Everyone looks down, but that may be stale, so let them all have
+     another go. */
+  for(i=0;i<group->count;i++)
+    group->members[i].retry=now;
+
+  if(group->policy==MSG_GROUP_HASH && key)
+    return select_hash(group,key,now);
+
+  return select_round_robin(group,now);
+}
+
+static void
+ping_member(struct group_member *member)
+{
+  struct msg_group *group=member->group;
+  struct msg_connection *conn;
+  uint64_t start=monotonic_ns(),now;
+  unsigned int timeout=group->interval>1000?group->interval:1000;
+  uint8_t answer;
+  int err=-1;
+
+  /* The timeout is only kept here, so the ping is one any server
+     understands. */
+  conn=msg_open(NULL,member->service,0);
+  if(conn)
+    {
+      if(set_deadline(conn,start+(uint64_t)timeout*1000000)==0)
+        err=msg_write_type(conn,MSG_TYPE_PING);
+      if(err>0)
+        err=msg_read_uint8(conn,&answer);
+
+      msg_close(conn);
+    }
+
+  now=monotonic_ns();
+
+  pthread_mutex_lock(&group->lock);
+
+  if(err>0)
+    {
+      uint64_t sample=now-start;
+
+      member->up=1;
+      member->latency=member->latency?(member->latency*7+sample)/8:sample;
+    }
+  else
+    mark_down(member,now);
+
+  pthread_mutex_unlock(&group->lock);
+}
+
+static void *
+health_thread(void *arg)
+{
+  struct msg_group *group=arg;
+
+  for(;;)
+    {
+      struct timespec ts;
+      size_t i;
+      int stopping;
+
+      for(i=0;i<group->count;i++)
+        ping_member(&group->members[i]);
+
+      clock_gettime(CLOCK_MONOTONIC,&ts);
+      ts.tv_sec+=group->interval/1000;
+      ts.tv_nsec+=(group->interval%1000)*1000000L;
+      if(ts.tv_nsec>=1000000000L)
+        {
+          ts.tv_sec++;
+          ts.tv_nsec-=1000000000L;
+        }
+
+      pthread_mutex_lock(&group->lock);
+      while(!group->stopping
+            && pthread_cond_timedwait(&group->cond,&group->lock,&ts)!=ETIMEDOUT)
+        ;
+      stopping=group->stopping;
+      pthread_mutex_unlock(&group->lock);
+
+      if(stopping)
+        break;
+    }
+
+  return NULL;
+}
+
+struct msg_group *
+msg_group_new(const char *const *services,size_t count,int policy,
+              unsigned int interval)
+{
+  struct msg_group *group;
+  pthread_condattr_t attr;
+  size_t i;
+  int err;
+
+  if(!count || policy<MSG_GROUP_ROUND_ROBIN || policy>MSG_GROUP_HASH)
+    {
+      errno=EINVAL;
+      return NULL;
+    }
+
+  group=calloc(1,sizeof(*group)+count*sizeof(group->members[0]));
+  if(!group)
+    return NULL;
+
+  group->policy=policy;
+  group->interval=interval;
+  group->count=count;
+  group->random=mix(monotonic_ns()^(uintptr_t)group)|1;
+  group->hedge.percentile=95;
+  group->hedge.budget=0.05;
+  group->hedge.min_delay=1000000;
+
+  for(i=0;i<count;i++)
+    {
+      struct group_member *member=&group->members[i];
+
+      member->group=group;
+      member->up=1;
+      member->service=strdup(services[i]);
+      if(!member->service)
+        goto fail;
+
+      member->hash=hash_string(member->service);
+    }
+
+  pthread_mutex_init(&group->lock,NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+  pthread_cond_init(&group->cond,&attr);
+  pthread_condattr_destroy(&attr);
+
+  if(interval)
+    {
+      err=pthread_create(&group->health,NULL,health_thread,group);
+      if(err)
+        {
+          msg_group_free(group);
+          errno=err;
+          return NULL;
+        }
+
+      group->running=1;
+    }
+
+  return group;
+
+ fail:
+  for(i=0;i<count;i++)
+    free(group->members[i].service);
+  free(group);
+  errno=ENOMEM;
+
+  return NULL;
+}
+
+/* Open a connection to a member other than skip. */
+
+static struct msg_connection *
+open_member(struct msg_group *group,const char *key,int flags,
+            const struct group_member *skip)
+{
+  size_t attempt;
+  int save_errno=ECONNREFUSED;
+
+  /* Each failure takes the member out, so the next attempt goes
+     somewhere else. */
+  for(attempt=0;attempt<group->count;attempt++)
+    {
+      struct group_member *member;
+      struct msg_connection *conn;
+
+      pthread_mutex_lock(&group->lock);
+      group->skip=skip;
+      member=select_member(group,key,monotonic_ns());
+      group->skip=NULL;
+      if(member)
+        member->outstanding++;
+      pthread_mutex_unlock(&group->lock);
+
+      if(!member)
+        break;
+
+      conn=msg_open(NULL,member->service,flags);
+      if(conn)
+        {
+          conn->member=member;
+          return conn;
+        }
+
+      save_errno=errno;
+
+      pthread_mutex_lock(&group->lock);
+      member->outstanding--;
+      mark_down(member,monotonic_ns());
+      pthread_mutex_unlock(&group->lock);
+    }
+
+  errno=save_errno;
+
+  return NULL;
+}
+
+struct msg_connection *
+msg_group_open(struct msg_group *group,const char *key,int flags)
+{
+  return open_member(group,key,flags,NULL);
+}
+
+int
+msg_group_hedge(struct msg_group *group,uint16_t type)
+{
+  pthread_mutex_lock(&group->lock);
+
+  if(!group->hedge.types)
+    {
+      group->hedge.types=calloc(65536/8,1);
+      if(!group->hedge.types)
+        {
+          pthread_mutex_unlock(&group->lock);
+          return -1;
+        }
+    }
+
+  group->hedge.types[type/8]|=1<<(type%8);
+
+  pthread_mutex_unlock(&group->lock);
+
+  return 0;
+}
+
+int
+msg_group_hedging(struct msg_group *group,double percentile,double budget,
+                  unsigned int min_delay)
+{
+  if(percentile<=0 || percentile>100 || budget<0 || budget>100)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  pthread_mutex_lock(&group->lock);
+  group->hedge.percentile=percentile;
+  group->hedge.budget=budget/100;
+  group->hedge.min_delay=(uint64_t)min_delay*1000000;
+  pthread_mutex_unlock(&group->lock);
+
+  return 0;
+}
+
+static int
+compare_samples(const void *a,const void *b)
+{
+  uint64_t x=*(const uint64_t *)a,y=*(const uint64_t *)b;
+
+  return x<y?-1:x>y;
+}
+
+/* Work out the delay from the reply times so far.  Until there are
+   enough of them, there is no hedging at all. */
+
+static void
+refresh_delay(struct msg_group *group)
+{
+  uint64_t sorted[GROUP_HEDGE_SAMPLES];
+  size_t count=group->hedge.count,index;
+
+  if(count>GROUP_HEDGE_SAMPLES)
+    count=GROUP_HEDGE_SAMPLES;
+
+  memcpy(sorted,group->hedge.samples,count*sizeof(sorted[0]));
+  qsort(sorted,count,sizeof(sorted[0]),compare_samples);
+
+  index=count*group->hedge.percentile/100;
+  if(index>=count)
+    index=count-1;
+
+  group->hedge.delay=sorted[index];
+  if(group->hedge.delay<group->hedge.min_delay)
+    group->hedge.delay=group->hedge.min_delay;
+}
+
+static void
+record_reply(struct msg_group *group,uint64_t latency)
+{
+  pthread_mutex_lock(&group->lock);
+
+  group->hedge.samples[group->hedge.count++%GROUP_HEDGE_SAMPLES]=latency;
+  if(group->hedge.count%GROUP_HEDGE_REFRESH==0)
+    refresh_delay(group);
+
+  pthread_mutex_unlock(&group->lock);
+}
+
+static int
+send_request(struct msg_connection *conn,uint16_t type,
+             struct msg_connection *request)
+{
+  int err=msg_write_type(conn,type);
+
+  if(err>0)
+    err=msg_builder_send(request,conn);
+
+  return err;
+}
+
+/* Wait for the first of count connections to have a reply to read.
+   One that hangs up or fails without a reply is dropped, and the wait
+   goes on for the rest.  Returns its index, -1 on error or once all
+   are dropped, or -2 if timeout milliseconds go by. */
+
+static int
+wait_reply(struct msg_connection **conns,int count,int timeout)
+{
+  struct pollfd fds[2];
+  uint64_t end=0;
+  int i,live=count,err;
+
+  for(i=0;i<count;i++)
+    {
+      fds[i].fd=conns[i]->fd;
+      fds[i].events=POLLIN;
+      fds[i].revents=0;
+    }
+
+  if(timeout>=0)
+    end=monotonic_ns()+(uint64_t)timeout*1000000;
+
+  while(live)
+    {
+      int wait=timeout;
+
+      if(timeout>=0)
+        {
+          uint64_t now=monotonic_ns();
+
+          wait=now>=end?0:(end-now+999999)/1000000;
+        }
+
+      err=poll(fds,count,wait);
+      if(err==-1 && errno==EINTR)
+        continue;
+
+      if(err==-1)
+        return -1;
+
+      if(err==0)
+        return -2;
+
+      for(i=0;i<count;i++)
+        {
+          short revents=fds[i].revents;
+          char c;
+
+          if(!revents || fds[i].fd==-1)
+            continue;
+
+          /* Readable can just mean at EOF, so look for a byte. */
+          if(revents&POLLIN)
+            {
+              ssize_t got=recv(fds[i].fd,&c,1,MSG_PEEK|MSG_DONTWAIT);
+
+              if(got>0)
+                return i;
+
+              if(got==-1 && (errno==EAGAIN || errno==EWOULDBLOCK
+                             || errno==EINTR)
+                 && !(revents&(POLLHUP|POLLERR|POLLNVAL)))
+                continue;
+            }
+
+          /* poll() passes over negative fds. */
+          fds[i].fd=-1;
+          live--;
+        }
+    }
+
+  errno=ECONNRESET;
+  return -1;
+}
+
+struct msg_connection *
+msg_group_call(struct msg_group *group,const char *key,uint16_t type,
+               struct msg_connection *request,int flags)
+{
+  struct msg_connection *conns[2];
+  uint64_t sent[2];
+  int count=1,winner,hedge=0,timeout=-1;
+
+  conns[0]=open_member(group,key,flags,NULL);
+  if(!conns[0])
+    return NULL;
+
+  if(send_request(conns[0],type,request)<1)
+    goto fail;
+
+  sent[0]=monotonic_ns();
+
+  if(_config && _config->io_timeout)
+    timeout=_config->io_timeout;
+
+  /* Only hedge types that can safely run twice, once the delay is
+     known, and while there is budget for it. */
+  pthread_mutex_lock(&group->lock);
+  group->hedge.tokens+=group->hedge.budget;
+  if(group->hedge.tokens>GROUP_HEDGE_BURST)
+    group->hedge.tokens=GROUP_HEDGE_BURST;
+  if(group->hedge.types && group->hedge.types[type/8]&1<<(type%8)
+     && group->hedge.delay && group->hedge.tokens>=1.0 && group->count>1)
+    hedge=(group->hedge.delay+999999)/1000000;
+  pthread_mutex_unlock(&group->lock);
+
+  winner=wait_reply(conns,1,hedge?hedge:timeout);
+  if(winner==-2 && hedge)
+    {
+      pthread_mutex_lock(&group->lock);
+      group->hedge.tokens-=1.0;
+      pthread_mutex_unlock(&group->lock);
+
+      conns[1]=open_member(group,key,flags,conns[0]->member);
+      if(conns[1] && send_request(conns[1],type,request)>0)
+        {
+          sent[1]=monotonic_ns();
+          count=2;
+        }
+      else if(conns[1])
+        {
+          msg_poison(conns[1]);
+          msg_close(conns[1]);
+        }
+
+      winner=wait_reply(conns,count,timeout);
+    }
+
+  if(winner==-2)
+    errno=ETIMEDOUT;
+  if(winner<0)
+    goto fail;
+
+  record_reply(group,monotonic_ns()-sent[winner]);
+
+  if(count==2)
+    {
+      msg_poison(conns[!winner]);
+      msg_close(conns[!winner]);
+    }
+
+  return conns[winner];
+
+ fail:
+  {
+    int i,save_errno=errno;
+
+    for(i=0;i<count;i++)
+      {
+        msg_poison(conns[i]);
+        msg_close(conns[i]);
+      }
+
+    errno=save_errno;
+  }
+
+  return NULL;
+}
+
+void
+group_release(struct group_member *member)
+{
+  struct msg_group *group=member->group;
+
+  pthread_mutex_lock(&group->lock);
+  member->outstanding--;
+  pthread_mutex_unlock(&group->lock);
+}
+
+void
+msg_group_free(struct msg_group *group)
+{
+  size_t i;
+
+  if(!group)
+    return;
+
+  if(group->running)
+    {
+      pthread_mutex_lock(&group->lock);
+      group->stopping=1;
+      pthread_cond_signal(&group->cond);
+      pthread_mutex_unlock(&group->lock);
+
+      pthread_join(group->health,NULL);
+    }
+
+  pthread_cond_destroy(&group->cond);
+  pthread_mutex_destroy(&group->lock);
+
+  for(i=0;i<group->count;i++)
+    free(group->members[i].service);
+
+  free(group->hedge.types);
+  free(group);
+}
@@ -0,0 +1,82 @@
+#include <config.h>
+#include <dispatch.h>
+#include "limit.h"
+
+void
+limiter_init(struct limiter *limiter,const struct msg_config *config)
+{
+  limiter->ready=1;
+  limiter->adaptive=config->limit.adaptive?1:0;
+  limiter->saturated=0;
+  limiter->max=config->max_concurrency;
+  limiter->min=config->limit.min?config->limit.min:1;
+  if(limiter->min>limiter->max)
+    limiter->min=limiter->max;
+
+  limiter->limit=config->limit.initial;
+  if(limiter->limit<limiter->min)
+    limiter->limit=limiter->min;
+  if(limiter->limit>limiter->max)
+    limiter->limit=limiter->max;
+
+  limiter->tolerance=config->limit.tolerance>1.0?config->limit.tolerance:1.0;
+  limiter->baseline=0;
+  limiter->window_min=0;
+  limiter->window_total=0;
+  limiter->window_samples=0;
+}
+
+static void
+end_window(struct limiter *limiter)
+{
+  double average=(double)limiter->window_total/limiter->window_samples;
+
+  if(!limiter->baseline || limiter->window_min<limiter->baseline)
+    limiter->baseline=limiter->window_min;
+  else
+    limiter->baseline+=(limiter->window_min-limiter->baseline)/64;
+
+  if(average>limiter->tolerance*limiter->baseline)
+    limiter->limit-=limiter->limit/10?limiter->limit/10:1;
+  else if(limiter->saturated && limiter->limit<limiter->max)
+    limiter->limit++;
+
+  if(limiter->limit<limiter->min)
+    limiter->limit=limiter->min;
+  if(limiter->limit>limiter->max)
+    limiter->limit=limiter->max;
+
+  limiter->saturated=0;
+  limiter->window_min=0;
+  limiter->window_total=0;
+  limiter->window_samples=0;
+}
+
+void
+limiter_sample(struct limiter *limiter,uint64_t latency,size_t in_flight)
+{
+  if(!limiter->adaptive)
+    return;
+
+  if(!limiter->window_samples || latency<limiter->window_min)
+    limiter->window_min=latency;
+
+  limiter->window_total+=latency;
+  limiter->window_samples++;
+
+  if(in_flight>=limiter->limit)
+    limiter->saturated=1;
+
+  if(limiter->window_samples>=limiter->limit
+     && limiter->window_samples>=LIMIT_MIN_WINDOW)
+    end_window(limiter);
+}
+
+size_t
+limiter_limit(const struct limiter *limiter)
+{
+  if(!limiter->adaptive)
+    return limiter->max;
+
+  return limiter->limit;
+}
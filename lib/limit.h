@@ -0,0 +1,46 @@
+#ifndef _LIMIT_H_
+#define _LIMIT_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+struct msg_config;
+
+#define LIMIT_MIN_WINDOW 16
+
+/* The adaptive concurrency limit.  Handler latencies are gathered in
+   windows of one limit's worth of calls, and at least
+   LIMIT_MIN_WINDOW.  At the end of each
+   window, if the average latency has risen more than tolerance times
+   above the baseline, the limit is cut by a tenth.  Otherwise, if
+   the limit was actually holding connections back, it grows by one.
+   The baseline is the lowest window minimum seen, drifting up slowly
+   so a workload that gets slower for good is relearned.
+
+   Nothing here locks.  The caller holds the concurrency lock. */
+
+struct limiter
+{
+  unsigned int ready:1;
+  unsigned int adaptive:1;
+  unsigned int saturated:1;
+  size_t min;
+  size_t max;
+  size_t limit;
+  double tolerance;
+  uint64_t baseline;
+  uint64_t window_min;
+  uint64_t window_total;
+  size_t window_samples;
+};
+
+void limiter_init(struct limiter *limiter,const struct msg_config *config);
+
+/* A handler took latency nanoseconds, with in_flight handlers
+   (including itself) running as it finished. */
+void limiter_sample(struct limiter *limiter,uint64_t latency,
+                    size_t in_flight);
+
+size_t limiter_limit(const struct limiter *limiter);
+
+#endif /* !_LIMIT_H_ */
@@ -1,10 +1,16 @@
 #include <config.h>
+#include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <dispatch.h>
 #include "conn.h"
+#include "compress.h"
+#include "cache.h"
 
 struct msg_config *_config;
 
@@ -17,6 +23,20 @@ msg_config_init(struct msg_config *config)
   config->listen_backlog=256;
   config->panic_on.failed_accept=1;
   config->log_on.failed_accept=1;
+  config->trace.events=1024;
+#ifdef HAVE_ZLIB
+  config->compress.codec=MSG_COMPRESS_ZLIB;
+#endif
+  config->compress.level=1;
+  config->compress.threshold=1024;
+  config->limit.min=1;
+  config->limit.initial=16;
+  config->limit.tolerance=2.0;
+  config->cache.size=16*1024*1024;
+  config->batch.size=16*1024*1024;
+  config->publish.subscribers=256;
+  config->publish.queue=1024;
+  config->account.log_top=5;
 }
 
 int
@@ -39,11 +59,43 @@ msg_init(const struct msg_config *config)
   return 0;
 }
 
+uint64_t
+monotonic_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+
+  return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
 /* Sending side. */
 
-/* Make a connection to the specified service. */
-struct msg_connection *
-msg_open(const char *host,const char *service,int flags)
+/* What a service said about itself after its ping answer is kept
+   this long, in case it is replaced by another version. */
+#define FEATURES_TTL_NS 60000000000ULL
+
+struct service_features
+{
+  struct service_features *next;
+  uint64_t expires;
+  int features;
+
+  /* The host, or nothing, then a NUL and the service. */
+  size_t length;
+  char name[];
+};
+
+static pthread_mutex_t features_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct service_features *features;
+
+/* Make a connection to the specified service.  A deadline is kept
+   for the client's own reads and writes, and if features has
+   PING_DEADLINE, also goes out right after the header.  features
+   are what the service said it takes, as PING_* bits. */
+static struct msg_connection *
+open_connection(const char *host,const char *service,int flags,
+                uint64_t deadline,int features)
 {
   struct msg_connection *conn;
 
@@ -51,44 +103,400 @@ msg_open(const char *host,const char *service,int flags)
 
   if(conn)
     {
-      unsigned char header[2]={1,0};
+      unsigned char header[10]={HEADER_VERSION,0};
+      size_t length=2;
       int ret;
 
-      ret=msg_write(conn,header,2);
+      if(flags&MSG_COMPRESS)
+        {
+          struct msg_config defaults;
+          const struct msg_config *config=_config;
+
+          if(!config)
+            {
+              msg_config_init(&defaults);
+              config=&defaults;
+            }
+
+          /* Without a codec there is nothing to advertise, and the
+             connection just goes out uncompressed.  The header only
+             asks for compressed replies.  What we send is compressed
+             only for a server that said it reads it. */
+          if(set_compression(conn,config->compress.codec,config)==0)
+            {
+              header[1]=conn->compress.codec;
+              if(!(features&PING_COMPRESS))
+                conn->compress.codec=MSG_COMPRESS_NONE;
+            }
+        }
+
+      if(deadline && (features&PING_DEADLINE))
+        {
+          uint64_t now=monotonic_ns(),left=0;
+          int i;
+
+          if(deadline>now)
+            left=deadline-now;
+
+          header[1]|=HEADER_DEADLINE;
+          for(i=0;i<8;i++)
+            header[length++]=left>>(56-i*8);
+        }
+
+      conn->deadline=deadline;
+
+      if(apply_timeouts(conn)==-1)
+        ret=-1;
+      else
+        ret=msg_write(conn,header,length);
+
       if(ret<1)
         {
+          int save_errno=errno;
+
           msg_poison(conn);
           msg_close(conn);
           conn=NULL;
+          errno=save_errno;
         }
     }
 
   return conn;
 }
 
+/* Ping the service to find out what it can take, by the deadline.
+   Returns its PING_* features, or -1 if it didn't answer. */
+
+static int
+ask_features(const char *host,const char *service,uint64_t deadline)
+{
+  struct msg_connection *conn;
+  uint8_t answer;
+  int err,ret=-1;
+
+  conn=open_connection(host,service,0,deadline,0);
+  if(!conn)
+    return -1;
+
+  err=msg_write_type(conn,MSG_TYPE_PING);
+  if(err>0)
+    err=msg_read_uint8(conn,&answer);
+  if(err>0)
+    {
+      /* An older server stops after the first byte. */
+      err=msg_read_uint8(conn,&answer);
+      if(err==0)
+        ret=0;
+      else if(err>0)
+        ret=answer;
+    }
+
+  if(ret==-1)
+    msg_poison(conn);
+  msg_close(conn);
+
+  return ret;
+}
+
+/* What the service takes, as PING_* bits, asking it if it hasn't
+   said lately.  A service that doesn't answer takes nothing. */
+
+static int
+service_features(const char *host,const char *service,uint64_t deadline)
+{
+  struct service_features *entry,**link;
+  size_t host_length=host?strlen(host):0;
+  size_t length=host_length+1+strlen(service);
+  uint64_t now=monotonic_ns();
+  int found;
+
+  pthread_mutex_lock(&features_lock);
+
+  for(link=&features;*link;)
+    {
+      entry=*link;
+      if(now>=entry->expires)
+        {
+          *link=entry->next;
+          free(entry);
+          continue;
+        }
+
+      if(entry->length==length && memcmp(entry->name,host?host:"",
+                                         host_length)==0
+         && entry->name[host_length]==0
+         && strcmp(entry->name+host_length+1,service)==0)
+        break;
+
+      link=&entry->next;
+    }
+
+  found=*link?(*link)->features:-1;
+
+  pthread_mutex_unlock(&features_lock);
+
+  if(found!=-1)
+    return found;
+
+  found=ask_features(host,service,deadline);
+  if(found==-1)
+    return 0;
+
+  entry=malloc(sizeof(*entry)+length+1);
+  if(entry)
+    {
+      entry->expires=monotonic_ns()+FEATURES_TTL_NS;
+      entry->features=found;
+      entry->length=length;
+      memcpy(entry->name,host?host:"",host_length);
+      entry->name[host_length]=0;
+      strcpy(entry->name+host_length+1,service);
+
+      pthread_mutex_lock(&features_lock);
+      entry->next=features;
+      features=entry;
+      pthread_mutex_unlock(&features_lock);
+    }
+
+  return found;
+}
+
+struct msg_connection *
+msg_open(const char *host,const char *service,int flags)
+{
+  int features=0;
+
+  /* Only compression needs to know what the service takes. */
+  if(flags&MSG_COMPRESS)
+    features=service_features(host,service,0);
+
+  return open_connection(host,service,flags,0,features);
+}
+
+struct msg_connection *
+msg_open_timeout(const char *host,const char *service,int flags,
+                 unsigned int timeout)
+{
+  uint64_t deadline=monotonic_ns()+(uint64_t)timeout*1000000;
+
+  return open_connection(host,service,flags,deadline,
+                         service_features(host,service,deadline));
+}
+
+long
+msg_deadline_remaining(struct msg_connection *conn)
+{
+  uint64_t now;
+
+  if(!conn->deadline)
+    return -1;
+
+  now=monotonic_ns();
+  if(now>=conn->deadline)
+    return 0;
+
+  return (conn->deadline-now+999999)/1000000;
+}
+
+/* Receiving side. */
+
+/* Read what a client sends first: the header, its deadline if it has
+   one, and the message type.  header gets the two header bytes. */
+
+int
+read_header(struct msg_connection *conn,unsigned char *header,uint16_t *type)
+{
+  unsigned char buf[12];
+  size_t length=4;
+  uint64_t left=0;
+  ssize_t err;
+
+  err=msg_read(conn,buf,4);
+  if(err<1)
+    return err;
+
+  if(buf[1]&HEADER_DEADLINE)
+    {
+      size_t i;
+
+      err=msg_read(conn,buf+4,8);
+      if(err<1)
+        return err;
+
+      length+=8;
+
+      for(i=2;i<10;i++)
+        left=left<<8|buf[i];
+
+      /* Time spent waiting to be accepted goes uncounted. */
+      conn->deadline=monotonic_ns()+left;
+
+      if(apply_timeouts(conn)==-1)
+        return -1;
+    }
+
+  header[0]=buf[0];
+  header[1]=buf[1];
+  *type=buf[length-2]<<8|buf[length-1];
+
+  return 1;
+}
+
+int
+ping_features(void)
+{
+  int features=PING_DEADLINE;
+
+  if(compress_supported(MSG_COMPRESS_ZLIB))
+    features|=PING_COMPRESS;
+
+  return features;
+}
+
+/* Give conn a deadline of its own, which only bounds its reads and
+   writes on this side. */
+
+int
+set_deadline(struct msg_connection *conn,uint64_t deadline)
+{
+  conn->deadline=deadline;
+
+  return apply_timeouts(conn);
+}
+
+/* A socket's timeouts are the smaller of the configured io_timeout
+   and what is left before the deadline, so no one read or write can
+   block past either.  Connections with neither are left alone. */
+
+int
+apply_timeouts(struct msg_connection *conn)
+{
+  uint64_t ns=0,us;
+  struct timeval tv;
+
+  if(conn->bits.memory)
+    return 0;
+
+  if(_config && _config->io_timeout)
+    ns=(uint64_t)_config->io_timeout*1000000;
+
+  if(conn->deadline)
+    {
+      uint64_t now=monotonic_ns(),left=1;
+
+      if(conn->deadline>now)
+        left=conn->deadline-now;
+
+      if(!ns || left<ns)
+        ns=left;
+    }
+
+  if(!ns)
+    return 0;
+
+  /* Round up, as a zero timeval would mean no timeout at all. */
+  us=(ns+999)/1000;
+  tv.tv_sec=us/1000000;
+  tv.tv_usec=us%1000000;
+
+  if(setsockopt(conn->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv))==-1
+     || setsockopt(conn->fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv))==-1)
+    return -1;
+
+  conn->bits.timeout=1;
+
+  return 0;
+}
+
+int
+deadline_passed(struct msg_connection *conn)
+{
+  return conn->deadline && monotonic_ns()>=conn->deadline;
+}
+
+/* Use codec for the strings and buffers on this connection, if we
+   have it. */
+
+int
+set_compression(struct msg_connection *conn,int codec,
+                const struct msg_config *config)
+{
+  if(!compress_supported(codec))
+    {
+      errno=ENOTSUP;
+      return -1;
+    }
+
+  conn->compress.codec=codec;
+  conn->compress.level=config->compress.level;
+  conn->compress.threshold=config->compress.threshold;
+
+  return 0;
+}
+
 /* Read that never returns a short count.  It either succeeds
    completely, or fails completely. */
 
 ssize_t
 msg_read(struct msg_connection *conn,void *buf,size_t count)
+{
+  if(conn->compress.inflating)
+    return decompress_read(conn,buf,count);
+
+  return read_raw(conn,buf,count);
+}
+
+/* The same, straight from the socket, bypassing any decompression. */
+
+ssize_t
+read_raw(struct msg_connection *conn,void *buf,size_t count)
 {
   size_t do_read=count;
   char *read_to=buf;
 
+  if(conn->bits.memory)
+    {
+      ssize_t did_read=memory_read(conn,buf,count);
+
+      if(did_read>0 && conn->capture)
+        capture_read(conn,buf,did_read);
+
+      return did_read;
+    }
+
   while(do_read)
     {
       ssize_t did_read;
 
+      if(deadline_passed(conn))
+        {
+          errno=ETIMEDOUT;
+          return -1;
+        }
+
       do
-        did_read=read(conn->fd,read_to,do_read);
+        {
+          did_read=read(conn->fd,read_to,do_read);
+          conn->syscalls.reads++;
+        }
       while(did_read==-1 && errno==EINTR && conn->flags&MSG_RETRY);
 
       if(did_read==-1)
-        return -1;
+        {
+          if(conn->bits.timeout && (errno==EAGAIN || errno==EWOULDBLOCK))
+            errno=ETIMEDOUT;
+
+          return -1;
+        }
 
       if(did_read==0)
         return 0;
 
+      conn->bytes.in+=did_read;
+
+      if(conn->capture)
+        capture_read(conn,read_to,did_read);
+
       do_read-=did_read;
       read_to+=did_read;
     }
@@ -100,24 +508,66 @@ msg_read(struct msg_connection *conn,void *buf,size_t count)
 
 ssize_t
 msg_write(struct msg_connection *conn,const void *buf,size_t count)
+{
+  if(conn->compress.pending)
+    {
+      int err=flush_buffer_length(conn);
+      if(err!=1)
+        return err;
+    }
+
+  return write_raw(conn,buf,count);
+}
+
+ssize_t
+write_raw(struct msg_connection *conn,const void *buf,size_t count)
 {
   size_t do_write=count;
   const char *write_to=buf;
 
+  if(conn->bits.memory)
+    {
+      ssize_t did_write=memory_write(conn,buf,count);
+
+      if(did_write>0 && conn->capture)
+        capture_write(conn,buf,did_write);
+
+      return did_write;
+    }
+
   while(do_write)
     {
       ssize_t did_write;
 
+      if(deadline_passed(conn))
+        {
+          errno=ETIMEDOUT;
+          return -1;
+        }
+
       do
-        did_write=write(conn->fd,write_to,do_write);
+        {
+          did_write=write(conn->fd,write_to,do_write);
+          conn->syscalls.writes++;
+        }
       while(did_write==-1 && errno==EINTR && conn->flags&MSG_RETRY);
 
       if(did_write==-1)
-        return -1;
+        {
+          if(conn->bits.timeout && (errno==EAGAIN || errno==EWOULDBLOCK))
+            errno=ETIMEDOUT;
+
+          return -1;
+        }
 
       if(did_write==0)
         return 0;
 
+      conn->bytes.out+=did_write;
+
+      if(conn->capture)
+        capture_write(conn,write_to,did_write);
+
       do_write-=did_write;
       write_to+=did_write;
     }
@@ -149,3 +599,62 @@ msg_peerinfo(struct msg_connection *conn,struct msg_peerinfo *info)
   else
     return -1;
 }
+
+struct msg_connection *
+msg_builder_new(size_t size_hint)
+{
+  return memory_connection(size_hint);
+}
+
+/* Everything written to the builder and not yet read back. */
+
+const void *
+msg_builder_data(struct msg_connection *builder,size_t *length)
+{
+  *length=builder->memory.length-builder->memory.offset;
+
+  return &builder->memory.data[builder->memory.offset];
+}
+
+int
+msg_builder_send(struct msg_connection *builder,struct msg_connection *conn)
+{
+  const void *data;
+  size_t length;
+  ssize_t err;
+
+  data=msg_builder_data(builder,&length);
+  if(!length)
+    return 1;
+
+  err=msg_write(conn,data,length);
+  if(err!=length)
+    return err;
+  else
+    return 1;
+}
+
+/* Empty the builder, but keep its buffer for the next message. */
+
+void
+msg_builder_reset(struct msg_connection *builder)
+{
+  builder->memory.length=builder->memory.offset=0;
+}
+
+struct msg_connection *
+msg_reader_new(const void *buffer,size_t length)
+{
+  struct msg_connection *conn;
+
+  conn=memory_connection(0);
+  if(!conn)
+    return NULL;
+
+  /* memory_read() never writes, so the caller's buffer is safe. */
+  conn->bits.borrowed=1;
+  conn->memory.data=(unsigned char *)buffer;
+  conn->memory.size=conn->memory.length=length;
+
+  return conn;
+}
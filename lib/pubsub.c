@@ -0,0 +1,537 @@
+#include <config.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <dispatch.h>
+#include "conn.h"
+#include "pubsub.h"
+
+extern struct msg_config *_config;
+
+/* A published message, framed as a buffer, shared by every queue it
+   is on. */
+struct message
+{
+  size_t refs;
+  size_t length;
+  unsigned char data[];
+};
+
+struct queued
+{
+  struct queued *next;
+  struct message *message;
+};
+
+struct subscriber
+{
+  struct subscriber *next;
+  int fd;
+  char *topic;
+  unsigned int dead:1;
+
+  /* Messages waiting to go out, and how much of the first has. */
+  struct queued *head;
+  struct queued *tail;
+  size_t count;
+  size_t offset;
+};
+
+/* Everything here is under pubsub_lock.  Only the writer thread
+   removes subscribers. */
+static pthread_mutex_t pubsub_lock=PTHREAD_MUTEX_INITIALIZER;
+static struct subscriber *subscribers;
+static size_t subscriber_count;
+static int wake[2]={-1,-1};
+
+static void
+unref(struct message *message)
+{
+  if(--message->refs==0)
+    free(message);
+}
+
+static void
+remove_subscriber(struct subscriber *subscriber)
+{
+  struct subscriber **link;
+
+  for(link=&subscribers;*link!=subscriber;link=&(*link)->next)
+    ;
+  *link=subscriber->next;
+  subscriber_count--;
+
+  while(subscriber->head)
+    {
+      struct queued *queued=subscriber->head;
+
+      subscriber->head=queued->next;
+      unref(queued->message);
+      free(queued);
+    }
+
+  close(subscriber->fd);
+  free(subscriber->topic);
+  free(subscriber);
+}
+
+static void
+wake_writer(void)
+{
+  char c=0;
+
+  /* If the pipe is full, the writer has a wakeup coming anyway. */
+  if(write(wake[1],&c,1)==-1 && errno!=EAGAIN)
+    syslog(LOG_DAEMON|LOG_ERR,"Unable to wake publisher: %s",
+           strerror(errno));
+}
+
+/* Send as much of subscriber's queue as the socket will take.
+   Returns -1 if the subscriber has to go. */
+
+static int
+drain(struct subscriber *subscriber)
+{
+  while(subscriber->head)
+    {
+      struct message *message=subscriber->head->message;
+      ssize_t did_write;
+
+      did_write=write(subscriber->fd,message->data+subscriber->offset,
+                      message->length-subscriber->offset);
+      if(did_write==-1)
+        {
+          if(errno==EINTR)
+            continue;
+
+          return (errno==EAGAIN || errno==EWOULDBLOCK)?0:-1;
+        }
+
+      subscriber->offset+=did_write;
+      if(subscriber->offset==message->length)
+        {
+          struct queued *queued=subscriber->head;
+
+          subscriber->head=queued->next;
+          if(!subscriber->head)
+            subscriber->tail=NULL;
+          subscriber->count--;
+          subscriber->offset=0;
+          unref(message);
+          free(queued);
+        }
+    }
+
+  return 0;
+}
+
+static void *
+writer_thread(void *d)
+{
+  struct pollfd *fds=NULL;
+  struct subscriber **polled=NULL;
+  size_t size=0;
+
+  for(;;)
+    {
+      struct subscriber *subscriber;
+      size_t count=1,i;
+      char buf[64];
+
+      pthread_mutex_lock(&pubsub_lock);
+
+      if(subscriber_count+1>size)
+        {
+          size_t grown=(subscriber_count+1)*2;
+          struct pollfd *new_fds=realloc(fds,grown*sizeof(*fds));
+          struct subscriber **new_polled;
+
+          if(new_fds)
+            fds=new_fds;
+
+          new_polled=realloc(polled,grown*sizeof(*polled));
+          if(new_polled)
+            polled=new_polled;
+
+          if(new_fds && new_polled)
+            size=grown;
+        }
+
+      /* With nowhere to put even the wakeup pipe, try again soon. */
+      if(!size)
+        {
+          pthread_mutex_unlock(&pubsub_lock);
+          usleep(100000);
+          continue;
+        }
+
+      fds[0].fd=wake[0];
+      fds[0].events=POLLIN;
+
+      /* Subscribers never send anything, so a readable socket is one
+         that has been closed. */
+      for(subscriber=subscribers;subscriber && count<size;
+          subscriber=subscriber->next)
+        {
+          fds[count].fd=subscriber->fd;
+          fds[count].events=POLLIN;
+          if(subscriber->head)
+            fds[count].events|=POLLOUT;
+          polled[count++]=subscriber;
+        }
+
+      pthread_mutex_unlock(&pubsub_lock);
+
+      if(poll(fds,count,-1)==-1)
+        {
+          if(errno!=EINTR)
+            syslog(LOG_DAEMON|LOG_ERR,"Unable to poll subscribers: %s",
+                   strerror(errno));
+          continue;
+        }
+
+      if(fds[0].revents)
+        while(read(wake[0],buf,sizeof(buf))>0)
+          ;
+
+      pthread_mutex_lock(&pubsub_lock);
+
+      for(i=1;i<count;i++)
+        {
+          subscriber=polled[i];
+
+          if(fds[i].revents&POLLOUT && drain(subscriber)==-1)
+            subscriber->dead=1;
+
+          if(fds[i].revents&(POLLIN|POLLHUP|POLLERR|POLLNVAL))
+            subscriber->dead=1;
+        }
+
+      /* Including any publish() cut off. */
+      for(subscriber=subscribers;subscriber;)
+        {
+          struct subscriber *next=subscriber->next;
+
+          if(subscriber->dead)
+            remove_subscriber(subscriber);
+
+          subscriber=next;
+        }
+
+      pthread_mutex_unlock(&pubsub_lock);
+    }
+
+  return d;
+}
+
+static int
+start_writer(void)
+{
+  pthread_attr_t attr;
+  pthread_t writer;
+  int err;
+
+  if(pipe(wake)==-1)
+    return -1;
+
+  if(cloexec_fd(wake[0])==-1 || cloexec_fd(wake[1])==-1
+     || nonblock_fd(wake[0])==-1 || nonblock_fd(wake[1])==-1)
+    goto fail;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+  err=pthread_create(&writer,&attr,writer_thread,NULL);
+  pthread_attr_destroy(&attr);
+
+  if(err)
+    {
+      errno=err;
+      goto fail;
+    }
+
+  return 0;
+
+ fail:
+  close(wake[0]);
+  close(wake[1]);
+  wake[0]=wake[1]=-1;
+
+  return -1;
+}
+
+/* Hold a place for one more subscriber, or say why not. */
+
+static int32_t
+reserve_subscriber(void)
+{
+  int32_t status=0;
+
+  if(!_config->publish.enabled)
+    return EOPNOTSUPP;
+
+  pthread_mutex_lock(&pubsub_lock);
+
+  if(_config->publish.subscribers
+     && subscriber_count>=_config->publish.subscribers)
+    status=EAGAIN;
+  else
+    subscriber_count++;
+
+  pthread_mutex_unlock(&pubsub_lock);
+
+  return status;
+}
+
+static void
+release_subscriber(void)
+{
+  pthread_mutex_lock(&pubsub_lock);
+  subscriber_count--;
+  pthread_mutex_unlock(&pubsub_lock);
+}
+
+int
+pubsub_subscribe(struct msg_connection *conn)
+{
+  struct subscriber *subscriber;
+  int32_t status;
+  char *topic;
+
+  if(msg_read_string(conn,&topic)<1)
+    return -1;
+
+  if(!topic)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  /* The status goes out before the socket is handed to the writer,
+     which is the only one to write to it after that. */
+  status=reserve_subscriber();
+  if(msg_write_int32(conn,status)<1 || status)
+    {
+      if(!status)
+        release_subscriber();
+      else
+        errno=status;
+
+      free(topic);
+      return -1;
+    }
+
+  subscriber=calloc(1,sizeof(*subscriber));
+  if(!subscriber || nonblock_fd(conn->fd)==-1)
+    {
+      release_subscriber();
+      free(subscriber);
+      free(topic);
+      return -1;
+    }
+
+  pthread_mutex_lock(&pubsub_lock);
+
+  if(wake[0]==-1 && start_writer()==-1)
+    {
+      subscriber_count--;
+      pthread_mutex_unlock(&pubsub_lock);
+      free(subscriber);
+      free(topic);
+      return -1;
+    }
+
+  /* The connection lives on here, and closing it does nothing.  Its
+     place was counted when it was reserved. */
+  subscriber->fd=conn->fd;
+  subscriber->topic=topic;
+  subscriber->next=subscribers;
+  subscribers=subscriber;
+  conn->fd=-1;
+
+  pthread_mutex_unlock(&pubsub_lock);
+
+  wake_writer();
+
+  return 0;
+}
+
+int
+msg_publish(const char *topic,struct msg_connection *message)
+{
+  struct msg_connection *frame;
+  struct message *shared;
+  struct subscriber *subscriber;
+  const void *data;
+  size_t length;
+  int queued=0,writing;
+
+  /* Framed once, in the form msg_subscription_read() expects, and
+     then only referenced. */
+  frame=msg_builder_new(0);
+  if(!frame)
+    return -1;
+
+  data=msg_builder_data(message,&length);
+  if(msg_write_buffer_length(frame,length)<1
+     || msg_write_buffer(frame,data,length)<1)
+    {
+      msg_close(frame);
+      return -1;
+    }
+
+  data=msg_builder_data(frame,&length);
+  shared=malloc(sizeof(*shared)+length);
+  if(!shared)
+    {
+      msg_close(frame);
+      return -1;
+    }
+
+  shared->refs=1;
+  shared->length=length;
+  memcpy(shared->data,data,length);
+  msg_close(frame);
+
+  pthread_mutex_lock(&pubsub_lock);
+
+  for(subscriber=subscribers;subscriber;subscriber=subscriber->next)
+    {
+      struct queued *entry;
+
+      if(subscriber->dead || strcmp(subscriber->topic,topic))
+        continue;
+
+      if(_config->publish.queue && subscriber->count>=_config->publish.queue)
+        {
+          if(_config->publish.disconnect)
+            subscriber->dead=1;
+          continue;
+        }
+
+      entry=malloc(sizeof(*entry));
+      if(!entry)
+        continue;
+
+      entry->next=NULL;
+      entry->message=shared;
+      shared->refs++;
+
+      if(subscriber->tail)
+        subscriber->tail->next=entry;
+      else
+        subscriber->head=entry;
+      subscriber->tail=entry;
+      subscriber->count++;
+      queued++;
+    }
+
+  unref(shared);
+  writing=wake[1]!=-1;
+
+  pthread_mutex_unlock(&pubsub_lock);
+
+  if(writing)
+    wake_writer();
+
+  return queued;
+}
+
+struct msg_connection *
+msg_subscribe(const char *host,const char *service,const char *topic,
+              int flags)
+{
+  struct msg_connection *conn,*request;
+  struct timeval none={0,0};
+  int32_t status;
+  int err;
+
+  conn=msg_open(host,service,flags);
+  if(!conn)
+    return NULL;
+
+  request=msg_builder_new(0);
+  if(!request)
+    err=-1;
+  else
+    {
+      err=msg_write_type(request,MSG_TYPE_SUBSCRIBE);
+      if(err>0)
+        err=msg_write_string(request,topic);
+      if(err>0)
+        err=msg_builder_send(request,conn);
+
+      msg_close(request);
+    }
+
+  if(err>0)
+    err=msg_read_int32(conn,&status);
+  if(err>0 && status)
+    {
+      errno=status;
+      err=-1;
+    }
+  else if(err==0)
+    {
+      /* Hung up on, by a server that doesn't know the type. */
+      errno=EPROTO;
+      err=-1;
+    }
+
+  /* Messages can be a long time coming, which is no reason to give
+     up on the publisher. */
+  if(err>0 && conn->bits.timeout)
+    {
+      if(setsockopt(conn->fd,SOL_SOCKET,SO_RCVTIMEO,&none,sizeof(none))==-1)
+        err=-1;
+      else
+        conn->bits.timeout=0;
+    }
+
+  if(err<1)
+    {
+      int save_errno=errno;
+
+      msg_poison(conn);
+      msg_close(conn);
+      errno=save_errno;
+
+      return NULL;
+    }
+
+  return conn;
+}
+
+int
+msg_subscription_read(struct msg_connection *conn,
+                      struct msg_connection **message)
+{
+  struct msg_connection *builder;
+  size_t length;
+  int err;
+
+  err=msg_read_buffer_length(conn,&length);
+  if(err<1)
+    return err;
+
+  builder=msg_builder_new(length);
+  if(!builder)
+    return -1;
+
+  err=msg_read_buffer(conn,builder->memory.data,length);
+  if(err<1)
+    {
+      msg_close(builder);
+      return err;
+    }
+
+  builder->memory.length=length;
+  *message=builder;
+
+  return 1;
+}
@@ -0,0 +1,16 @@
+#ifndef _PUBSUB_H_
+#define _PUBSUB_H_
+
+#include <inttypes.h>
+
+/* Serves a MSG_TYPE_SUBSCRIBE connection, whose type has been read,
+   by reading its topic and keeping its socket to publish to.  The
+   subscriber gets a status first, 0 or an errno value, and nothing
+   more if it was refused.  The socket is taken out of conn, so
+   closing conn leaves it open.  Returns 0, or -1 with errno set. */
+
+struct msg_connection;
+
+int pubsub_subscribe(struct msg_connection *conn);
+
+#endif /* !_PUBSUB_H_ */
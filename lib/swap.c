@@ -0,0 +1,215 @@
+#include <config.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <string.h>
+#include "swap.h"
+
+/* Bulk byte swapping for the array codecs.  On x86 the work is done
+   with byte shuffles, 32 bytes at a time with AVX2 or 16 at a time
+   with SSSE3, picked at runtime so the library still runs on older
+   CPUs.  Everything else, and the tail of each array, goes through
+   the scalar loop. */
+
+#if __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+
+void
+swap16_array(void *dst,const void *src,size_t count)
+{
+  if(dst!=src)
+    memcpy(dst,src,count*2);
+}
+
+void
+swap32_array(void *dst,const void *src,size_t count)
+{
+  if(dst!=src)
+    memcpy(dst,src,count*4);
+}
+
+void
+swap64_array(void *dst,const void *src,size_t count)
+{
+  if(dst!=src)
+    memcpy(dst,src,count*8);
+}
+
+#else
+
+/* memcpy rather than pointer casts, since the caller's buffers have
+   no alignment guarantee.  The compiler turns these into plain loads
+   and stores. */
+
+static void
+scalar16(unsigned char *dst,const unsigned char *src,size_t count)
+{
+  size_t i;
+
+  for(i=0;i<count;i++)
+    {
+      uint16_t val;
+
+      memcpy(&val,&src[i*2],2);
+      val=__builtin_bswap16(val);
+      memcpy(&dst[i*2],&val,2);
+    }
+}
+
+static void
+scalar32(unsigned char *dst,const unsigned char *src,size_t count)
+{
+  size_t i;
+
+  for(i=0;i<count;i++)
+    {
+      uint32_t val;
+
+      memcpy(&val,&src[i*4],4);
+      val=__builtin_bswap32(val);
+      memcpy(&dst[i*4],&val,4);
+    }
+}
+
+static void
+scalar64(unsigned char *dst,const unsigned char *src,size_t count)
+{
+  size_t i;
+
+  for(i=0;i<count;i++)
+    {
+      uint64_t val;
+
+      memcpy(&val,&src[i*8],8);
+      val=__builtin_bswap64(val);
+      memcpy(&dst[i*8],&val,8);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#define SHUFFLE16 1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14
+#define SHUFFLE32 3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12
+#define SHUFFLE64 7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8
+
+/* Swap bytes of whole vectors, returning how many bytes were done.
+   The rest is left for the scalar loop. */
+
+__attribute__((target("avx2")))
+static size_t
+shuffle_avx2(unsigned char *dst,const unsigned char *src,size_t bytes,
+             int width)
+{
+  __m256i mask;
+  size_t i;
+
+  if(width==2)
+    mask=_mm256_setr_epi8(SHUFFLE16,SHUFFLE16);
+  else if(width==4)
+    mask=_mm256_setr_epi8(SHUFFLE32,SHUFFLE32);
+  else
+    mask=_mm256_setr_epi8(SHUFFLE64,SHUFFLE64);
+
+  for(i=0;i+32<=bytes;i+=32)
+    {
+      __m256i val=_mm256_loadu_si256((const __m256i *)&src[i]);
+
+      _mm256_storeu_si256((__m256i *)&dst[i],_mm256_shuffle_epi8(val,mask));
+    }
+
+  return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t
+shuffle_ssse3(unsigned char *dst,const unsigned char *src,size_t bytes,
+              int width)
+{
+  __m128i mask;
+  size_t i;
+
+  if(width==2)
+    mask=_mm_setr_epi8(SHUFFLE16);
+  else if(width==4)
+    mask=_mm_setr_epi8(SHUFFLE32);
+  else
+    mask=_mm_setr_epi8(SHUFFLE64);
+
+  for(i=0;i+16<=bytes;i+=16)
+    {
+      __m128i val=_mm_loadu_si128((const __m128i *)&src[i]);
+
+      _mm_storeu_si128((__m128i *)&dst[i],_mm_shuffle_epi8(val,mask));
+    }
+
+  return i;
+}
+
+static size_t
+shuffle_none(unsigned char *dst,const unsigned char *src,size_t bytes,
+             int width)
+{
+  return 0;
+}
+
+static size_t (*picked)(unsigned char *,const unsigned char *,size_t,int);
+static pthread_once_t picked_once=PTHREAD_ONCE_INIT;
+
+static void
+pick_shuffle(void)
+{
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2"))
+    picked=shuffle_avx2;
+  else if(__builtin_cpu_supports("ssse3"))
+    picked=shuffle_ssse3;
+  else
+    picked=shuffle_none;
+}
+
+/* The first call picks the best implementation, once, for every
+   thread. */
+
+static size_t
+shuffle(unsigned char *dst,const unsigned char *src,size_t bytes,int width)
+{
+  pthread_once(&picked_once,pick_shuffle);
+
+  return (picked)(dst,src,bytes,width);
+}
+
+#else
+
+#define shuffle(_d,_s,_b,_w) 0
+
+#endif
+
+void
+swap16_array(void *dst,const void *src,size_t count)
+{
+  size_t done=shuffle(dst,src,count*2,2);
+
+  scalar16((unsigned char *)dst+done,(const unsigned char *)src+done,
+           count-done/2);
+}
+
+void
+swap32_array(void *dst,const void *src,size_t count)
+{
+  size_t done=shuffle(dst,src,count*4,4);
+
+  scalar32((unsigned char *)dst+done,(const unsigned char *)src+done,
+           count-done/4);
+}
+
+void
+swap64_array(void *dst,const void *src,size_t count)
+{
+  size_t done=shuffle(dst,src,count*8,8);
+
+  scalar64((unsigned char *)dst+done,(const unsigned char *)src+done,
+           count-done/8);
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <stddef.h>
+
+/* Convert count elements between host and network byte order.  dst
+   and src may be the same array, but must not otherwise overlap. */
+
+void swap16_array(void *dst,const void *src,size_t count);
+void swap32_array(void *dst,const void *src,size_t count);
+void swap64_array(void *dst,const void *src,size_t count);
+
+#endif /* !_SWAP_H_ */
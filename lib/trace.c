@@ -0,0 +1,311 @@
+#include <config.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <dispatch.h>
+#include "trace.h"
+
+struct trace_ring
+{
+  /* Every ring ever made, newest first.  Rings are never freed, so a
+     dumper can walk this without locking. */
+  struct trace_ring *next;
+
+  /* Rings from exited threads, waiting to be reused. */
+  struct trace_ring *next_free;
+
+  uint64_t head;
+  struct trace_event events[];
+};
+
+static size_t ring_size;
+static struct trace_ring *all_rings;
+static struct trace_ring *free_rings;
+static pthread_mutex_t free_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct trace_ring *my_ring;
+static __thread uint32_t my_thread;
+
+/* Dumps go to trace.file with a number on the end, or nowhere.  Room
+   is kept for the number, which dump_path_set() fills in. */
+#define DUMP_SUFFIX 12
+static char dump_path[PATH_MAX+DUMP_SUFFIX];
+static size_t dump_prefix;
+static unsigned int dump_count;
+
+static void
+release_ring(void *r)
+{
+  struct trace_ring *ring=r;
+
+  pthread_mutex_lock(&free_lock);
+  ring->next_free=free_rings;
+  free_rings=ring;
+  pthread_mutex_unlock(&free_lock);
+}
+
+static struct trace_ring *
+get_ring(void)
+{
+  struct trace_ring *ring;
+
+  if(!ring_size)
+    return NULL;
+
+  pthread_mutex_lock(&free_lock);
+
+  ring=free_rings;
+  if(ring)
+    free_rings=ring->next_free;
+  else
+    {
+      ring=calloc(1,sizeof(*ring)+ring_size*sizeof(struct trace_event));
+      if(ring)
+        {
+          ring->next=all_rings;
+          __atomic_store_n(&all_rings,ring,__ATOMIC_RELEASE);
+        }
+    }
+
+  pthread_mutex_unlock(&free_lock);
+
+  if(!ring)
+    return NULL;
+
+  pthread_setspecific(ring_key,ring);
+
+  my_thread=syscall(SYS_gettid);
+  my_ring=ring;
+
+  return ring;
+}
+
+static void
+dump_on_signal(int sig)
+{
+  int save_errno=errno;
+
+  trace_dump_file();
+
+  errno=save_errno;
+}
+
+int
+trace_init(size_t events,int signal,const char *file)
+{
+  size_t size;
+
+  if(ring_size || !events)
+    return 0;
+
+  /* Round up to a power of two so the ring index is just a mask. */
+  for(size=1;size<events;size<<=1)
+    ;
+
+  if(file)
+    {
+      if(strlen(file)>=PATH_MAX)
+        {
+          errno=ERANGE;
+          return -1;
+        }
+
+      strcpy(dump_path,file);
+      dump_prefix=strlen(file);
+    }
+
+  if(pthread_key_create(&ring_key,release_ring))
+    return -1;
+
+  if(signal)
+    {
+      struct sigaction sa;
+
+      memset(&sa,0,sizeof(sa));
+      sa.sa_handler=dump_on_signal;
+      sa.sa_flags=SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+
+      if(sigaction(signal,&sa,NULL)==-1)
+        return -1;
+    }
+
+  ring_size=size;
+
+  return 0;
+}
+
+void
+trace_event(uint16_t event,uint16_t type,int32_t arg,int32_t err)
+{
+  struct trace_ring *ring=my_ring;
+  struct trace_event *ev;
+  struct timespec ts;
+  uint64_t head;
+
+  if(!ring && !(ring=get_ring()))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+
+  head=ring->head;
+
+  ev=&ring->events[head&(ring_size-1)];
+  ev->nsec=(uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+  ev->thread=my_thread;
+  ev->event=event;
+  ev->type=type;
+  ev->arg=arg;
+  ev->err=err;
+
+  __atomic_store_n(&ring->head,head+1,__ATOMIC_RELEASE);
+}
+
+static int
+write_all(int fd,const void *buf,size_t count)
+{
+  const char *ptr=buf;
+
+  while(count)
+    {
+      ssize_t did_write=write(fd,ptr,count);
+
+      if(did_write==-1)
+        {
+          if(errno==EINTR)
+            continue;
+
+          return -1;
+        }
+
+      count-=did_write;
+      ptr+=did_write;
+    }
+
+  return 0;
+}
+
+/* This is called from call_panic() and from a signal handler, so it
+   sticks to async-signal-safe calls.  Other threads may still be
+   logging while we copy, so the oldest entry of a busy ring can come
+   out torn.  That's a fair price for never locking the writers. */
+
+int
+trace_dump(int fd)
+{
+  struct trace_header header;
+  struct trace_ring *ring;
+  struct timespec ts;
+
+  memset(&header,0,sizeof(header));
+
+  header.magic=TRACE_MAGIC;
+  header.version=TRACE_VERSION;
+  header.event_size=sizeof(struct trace_event);
+  header.pid=getpid();
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  header.monotonic=(uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  header.realtime=(uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+
+  if(write_all(fd,&header,sizeof(header))==-1)
+    return -1;
+
+  for(ring=__atomic_load_n(&all_rings,__ATOMIC_ACQUIRE);ring;ring=ring->next)
+    {
+      uint64_t head=__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+      size_t count,start;
+
+      count=head<ring_size?head:ring_size;
+      start=(head-count)&(ring_size-1);
+
+      if(start+count>ring_size)
+        {
+          if(write_all(fd,&ring->events[start],
+                       (ring_size-start)*sizeof(struct trace_event))==-1)
+            return -1;
+
+          count-=ring_size-start;
+          start=0;
+        }
+
+      if(write_all(fd,&ring->events[start],
+                   count*sizeof(struct trace_event))==-1)
+        return -1;
+    }
+
+  return 0;
+}
+
+/* Put ".n" on the end of the dump path, without snprintf(), which
+   isn't safe in a signal handler. */
+
+static void
+dump_path_set(unsigned int n)
+{
+  char digits[DUMP_SUFFIX];
+  size_t i=0,at=dump_prefix;
+
+  do
+    {
+      digits[i++]='0'+n%10;
+      n/=10;
+    }
+  while(n);
+
+  dump_path[at++]='.';
+  while(i)
+    dump_path[at++]=digits[--i];
+  dump_path[at]=0;
+}
+
+/* Each dump is a new file, so whatever is already at the path, a
+   symlink planted by someone else included, is never written to.
+   Numbers already taken are skipped. */
+
+const char *
+trace_dump_file(void)
+{
+  int fd=-1,err,tries;
+
+  if(!ring_size || !dump_prefix)
+    return NULL;
+
+  for(tries=0;fd==-1 && tries<100;tries++)
+    {
+      dump_path_set(__atomic_add_fetch(&dump_count,1,__ATOMIC_RELAXED));
+
+      fd=open(dump_path,O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,0600);
+      if(fd==-1 && errno!=EEXIST)
+        return NULL;
+    }
+
+  if(fd==-1)
+    return NULL;
+
+  err=trace_dump(fd);
+
+  close(fd);
+
+  return err==-1?NULL:dump_path;
+}
+
+int
+msg_trace_dump(int fd)
+{
+  if(!ring_size)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  return trace_dump(fd);
+}
@@ -0,0 +1,67 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <inttypes.h>
+
+/* The flight recorder.  Every thread that handles connections logs
+   small fixed size events into its own ring.  Nothing is locked on
+   the logging path: each ring has exactly one writer, and the dumper
+   just copies whatever is there.  Rings belonging to threads that
+   have exited are recycled for new threads, so the most recent
+   history survives the thread-per-connection model. */
+
+#define TRACE_MAGIC   0x43525444 /* "DTRC" */
+#define TRACE_VERSION 1
+
+enum trace_events
+  {
+    TRACE_NONE,
+    TRACE_ACCEPT,         /* arg=fd */
+    TRACE_ACCEPT_ERROR,   /* err=errno */
+    TRACE_HEADER,         /* arg=version<<8|flags */
+    TRACE_HEADER_EOF,
+    TRACE_HEADER_ERROR,   /* err=errno */
+    TRACE_DISPATCH,       /* type */
+    TRACE_UNKNOWN_TYPE,   /* type */
+    TRACE_THREAD_ERROR,   /* type, err=pthread_create error */
+    TRACE_HANDLER_START,  /* type */
+    TRACE_HANDLER_END,    /* type, arg=handler return */
+    TRACE_CLOSE,          /* type, arg=fd */
+    TRACE_PANIC,          /* err=errno */
+    TRACE_EXPIRED,        /* type, arg=fd */
+    TRACE_CACHE_HIT,      /* type, arg=fd */
+    TRACE_COALESCED,      /* type, arg=fd */
+    TRACE_MAX_EVENT
+  };
+
+/* What goes into the ring, and out into a dump, in host byte
+   order. */
+struct trace_event
+{
+  uint64_t nsec;   /* CLOCK_MONOTONIC */
+  uint32_t thread; /* kernel thread id */
+  uint16_t event;
+  uint16_t type;
+  int32_t arg;
+  int32_t err;
+};
+
+/* A dump is one of these followed by trace_event records until
+   EOF.  The two clock readings let the decoder turn monotonic times
+   into wall clock times. */
+struct trace_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t pid;
+  uint64_t monotonic;
+  uint64_t realtime;
+};
+
+int trace_init(size_t events,int signal,const char *file);
+void trace_event(uint16_t event,uint16_t type,int32_t arg,int32_t err);
+int trace_dump(int fd);
+const char *trace_dump_file(void);
+
+#endif /* !_TRACE_H_ */
@@ -1,85 +1,86 @@
 #include <config.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <dispatch.h>
 #include "conn.h"
+#include "swap.h"
+#include "compress.h"
+#include "cache.h"
 
 /* Efficient 1,2,5 length encoding.  Shamelessly borrowed from
-   RFC-4880. */
+   RFC-4880.  The first byte says how long the whole encoding is, so
+   reading one takes at most two reads. */
+
+static size_t
+length_size(unsigned char first)
+{
+  if(first<192 || (first>=224 && first<255))
+    return 1;
+  else if(first<224)
+    return 2;
+  else
+    return 5;
+}
+
+static void
+decode_length(const unsigned char *bytes,uint32_t *length,uint8_t *special)
+{
+  *length=*special=0;
+
+  if(bytes[0]<192)
+    *length=bytes[0];
+  else if(bytes[0]<224)
+    *length=(bytes[0]-192)*256+bytes[1]+192;
+  else if(bytes[0]<255)
+    *special=bytes[0]&0x1F;
+  else
+    *length=(uint32_t)bytes[1]<<24|(uint32_t)bytes[2]<<16
+      |(uint32_t)bytes[3]<<8|bytes[4];
+}
 
 static int
 read_length(struct msg_connection *conn,uint32_t *length,uint8_t *special)
 {
-  unsigned char a;
+  unsigned char bytes[5];
   ssize_t err;
   uint8_t my_special;
+  size_t size;
 
   if(!special)
     special=&my_special;
 
   *length=*special=0;
 
-  err=msg_read(conn,&a,1);
+  err=msg_read(conn,bytes,1);
   if(err!=1)
     return err;
 
-  if(a<192)
-    *length=a;
-  else if(a<224)
+  size=length_size(bytes[0]);
+  if(size>1)
     {
-      *length=(a-192)*256;
-
-      err=msg_read(conn,&a,1);
-      if(err!=1)
+      err=msg_read(conn,&bytes[1],size-1);
+      if(err!=size-1)
         return err;
-
-      *length+=a+192;
     }
-  else if(a<255)
-    *special=a&0x1F;
-  else
-    {
-      err=msg_read(conn,&a,1);
-      if(err!=1)
-        return err;
-
-      *length =a<<24;
 
-      err=msg_read(conn,&a,1);
-      if(err!=1)
-        return err;
-
-      *length|=a<<16;
-
-      err=msg_read(conn,&a,1);
-      if(err!=1)
-        return err;
-
-      *length|=a<<8;
-
-      err=msg_read(conn,&a,1);
-      if(err!=1)
-        return err;
-
-      *length|=a;
-    }
+  decode_length(bytes,length,special);
 
   return 1;
 }
 
-static int
-write_length(struct msg_connection *conn,uint32_t length,uint8_t special)
-{
-  unsigned char bytes[5];
-  size_t do_write;
-  ssize_t err;
+/* Encode a length into bytes, which must have room for 5, and return
+   how many were used. */
 
+static size_t
+encode_length(unsigned char *bytes,uint32_t length,uint8_t special)
+{
   if(special)
     {
       bytes[0]=0xE0+(special&0x1F);
-      do_write=1;
+      return 1;
     }
   else if(length>8383)
     {
@@ -88,19 +89,29 @@ write_length(struct msg_connection *conn,uint32_t length,uint8_t special)
       bytes[2]=length>>16;
       bytes[3]=length>>8;
       bytes[4]=length;
-      do_write=5;
+      return 5;
     }
   else if(length>191)
     {
       bytes[0]=192+((length-192)>>8);
       bytes[1]=(length-192);
-      do_write=2;
+      return 2;
     }
   else
     {
       bytes[0]=length;
-      do_write=1;
+      return 1;
     }
+}
+
+static int
+write_length(struct msg_connection *conn,uint32_t length,uint8_t special)
+{
+  unsigned char bytes[5];
+  size_t do_write;
+  ssize_t err;
+
+  do_write=encode_length(bytes,length,special);
 
   err=msg_write(conn,bytes,do_write);
   if(err!=do_write)
@@ -109,21 +120,334 @@ write_length(struct msg_connection *conn,uint32_t length,uint8_t special)
     return 1;
 }
 
+/* Compressed strings and buffers go out as the special length 2,
+   then the uncompressed length, then the compressed length, then the
+   compressed bytes.  The reader sets up the decompressor and reads
+   the rest through it, as if it were a plain block. */
+
+#define COMPRESSED_SPECIAL 2
+#define COMPRESSED_HEADER  11
+
+static int
+read_compressed_length(struct msg_connection *conn,uint32_t *length)
+{
+  uint32_t compressed;
+  int err;
+
+  err=read_length(conn,length,NULL);
+  if(err!=1)
+    return err;
+
+  err=read_length(conn,&compressed,NULL);
+  if(err!=1)
+    return err;
+
+  return decompress_start(conn,*length,compressed);
+}
+
+/* Write a block with its length in front, compressed if that is
+   turned on and worth it.  Returns what msg_write() would for the
+   block. */
+
+static int
+write_block(struct msg_connection *conn,const void *data,size_t length)
+{
+  unsigned char *block=NULL;
+  size_t compressed;
+  int err;
+
+  if(conn->compress.codec && length>0 && length>=conn->compress.threshold)
+    block=compress_block(conn->compress.codec,conn->compress.level,data,
+                         length,COMPRESSED_HEADER,&compressed);
+
+  if(block)
+    {
+      unsigned char header[COMPRESSED_HEADER];
+      size_t size;
+      ssize_t did;
+
+      size=encode_length(header,0,COMPRESSED_SPECIAL);
+      size+=encode_length(&header[size],length,0);
+      size+=encode_length(&header[size],compressed,0);
+
+      /* The header goes into the room left in front of the data, so
+         the whole block is one write. */
+      memcpy(&block[COMPRESSED_HEADER-size],header,size);
+
+      err=1;
+      if(conn->compress.pending)
+        err=flush_buffer_length(conn);
+
+      if(err==1)
+        {
+          did=write_raw(conn,&block[COMPRESSED_HEADER-size],size+compressed);
+          err=did==size+compressed?length:did;
+        }
+
+      free(block);
+
+      return err;
+    }
+
+  err=write_length(conn,length,0);
+  if(err!=1)
+    return err;
+
+  if(length>0)
+    return msg_write(conn,data,length);
+  else
+    return 1;
+}
+
+/* msg_write_buffer_length() holds the length back when the buffer
+   might be compressed.  If something else gets written first, the
+   length has to go out as is. */
+
+int
+flush_buffer_length(struct msg_connection *conn)
+{
+  unsigned char bytes[5];
+  size_t size;
+  ssize_t err;
+
+  size=encode_length(bytes,conn->compress.pending,0);
+  conn->compress.pending=0;
+
+  err=write_raw(conn,bytes,size);
+  if(err!=size)
+    return err;
+  else
+    return 1;
+}
+
+/* Variable length integers.  Unsigned values are LEB128: seven bits
+   per byte, least significant group first, with the top bit set on
+   every byte but the last.  Signed values are zigzag mapped first
+   (0,-1,1,-2,... become 0,1,2,3,...) so small negative numbers stay
+   short too.  A 64 bit value takes 1 to 10 bytes. */
+
+#define VARINT_MAX 10
+
+static size_t
+encode_varint(unsigned char *bytes,uint64_t val)
+{
+  size_t used=0;
+
+  while(val>=0x80)
+    {
+      bytes[used++]=val|0x80;
+      val>>=7;
+    }
+
+  bytes[used++]=val;
+
+  return used;
+}
+
+/* The continuation bit means we can't know the length up front, so
+   the value is read a byte at a time.  Most values fit in one or two
+   bytes, so those are handled before falling into the general
+   loop. */
+
+static int
+read_varint(struct msg_connection *conn,uint64_t *val)
+{
+  unsigned char byte;
+  ssize_t err;
+  unsigned int shift;
+  int used;
+
+  err=msg_read(conn,&byte,1);
+  if(err!=1)
+    return err;
+
+  if(byte<0x80)
+    {
+      *val=byte;
+      return 1;
+    }
+
+  *val=byte&0x7F;
+
+  err=msg_read(conn,&byte,1);
+  if(err!=1)
+    return err;
+
+  if(byte<0x80)
+    {
+      *val|=(uint64_t)byte<<7;
+      return 2;
+    }
+
+  *val|=(uint64_t)(byte&0x7F)<<7;
+
+  for(used=2,shift=14;used<VARINT_MAX;used++,shift+=7)
+    {
+      err=msg_read(conn,&byte,1);
+      if(err!=1)
+        return err;
+
+      /* The tenth byte can only carry the top bit of a 64 bit
+         value. */
+      if(used==VARINT_MAX-1 && byte>1)
+        break;
+
+      *val|=(uint64_t)(byte&0x7F)<<shift;
+
+      if(byte<0x80)
+        return used+1;
+    }
+
+  errno=EINVAL;
+  return -1;
+}
+
+static int
+write_varint(struct msg_connection *conn,uint64_t val)
+{
+  unsigned char bytes[VARINT_MAX];
+  size_t used;
+  ssize_t err;
+
+  used=encode_varint(bytes,val);
+
+  err=msg_write(conn,bytes,used);
+  if(err!=used)
+    return err;
+
+  return used;
+}
+
+int
+msg_read_varuint64(struct msg_connection *conn,uint64_t *val)
+{
+  return read_varint(conn,val);
+}
+
+int
+msg_write_varuint64(struct msg_connection *conn,uint64_t val)
+{
+  return write_varint(conn,val);
+}
+
+int
+msg_read_varint64(struct msg_connection *conn,int64_t *val)
+{
+  uint64_t zigzag;
+  int err;
+
+  err=read_varint(conn,&zigzag);
+  if(err<1)
+    return err;
+
+  *val=(int64_t)(zigzag>>1)^-(int64_t)(zigzag&1);
+
+  return err;
+}
+
+int
+msg_write_varint64(struct msg_connection *conn,int64_t val)
+{
+  return write_varint(conn,((uint64_t)val<<1)^(uint64_t)(val>>63));
+}
+
+int
+msg_read_varuint32(struct msg_connection *conn,uint32_t *val)
+{
+  uint64_t wide;
+  int err;
+
+  err=read_varint(conn,&wide);
+  if(err<1)
+    return err;
+
+  if(wide>UINT32_MAX)
+    {
+      errno=ERANGE;
+      return -1;
+    }
+
+  *val=wide;
+
+  return err;
+}
+
+int
+msg_write_varuint32(struct msg_connection *conn,uint32_t val)
+{
+  return write_varint(conn,val);
+}
+
+int
+msg_read_varint32(struct msg_connection *conn,int32_t *val)
+{
+  int64_t wide;
+  int err;
+
+  err=msg_read_varint64(conn,&wide);
+  if(err<1)
+    return err;
+
+  if(wide<INT32_MIN || wide>INT32_MAX)
+    {
+      errno=ERANGE;
+      return -1;
+    }
+
+  *val=wide;
+
+  return err;
+}
+
+int
+msg_write_varint32(struct msg_connection *conn,int32_t val)
+{
+  return msg_write_varint64(conn,val);
+}
+
+/* The length of the string that follows, or that it is NULL, in
+   which case nothing follows. */
+int
+read_string_length(struct msg_connection *conn,size_t *length,int *null)
+{
+  uint32_t remote_length;
+  uint8_t special;
+  int err;
+
+  err=read_length(conn,&remote_length,&special);
+  if(err!=1)
+    return err;
+
+  if(special==COMPRESSED_SPECIAL)
+    {
+      err=read_compressed_length(conn,&remote_length);
+      if(err!=1)
+        return err;
+
+      special=0;
+    }
+
+  *length=remote_length;
+  *null=(special==1);
+
+  return err;
+}
+
 /* read_string and write_string return -1 on error, 0 on eof, and >0
    (the length of the string) on success.  There are no short
    reads/writes. */
 int
 msg_read_string(struct msg_connection *conn,char **string)
 {
-  uint32_t length;
+  size_t length;
   int err;
-  uint8_t special;
+  int null;
 
-  err=read_length(conn,&length,&special);
+  err=read_string_length(conn,&length,&null);
   if(err!=1)
     return err;
 
-  if(special==1)
+  if(null)
     *string=NULL;
   else
     {
@@ -151,21 +475,8 @@ msg_read_string(struct msg_connection *conn,char **string)
 int
 msg_write_string(struct msg_connection *conn,const char *string)
 {
-  int err;
-
   if(string)
-    {
-      size_t length=strlen(string);
-
-      err=write_length(conn,length,0);
-      if(err!=1)
-        return err;
-
-      if(length>0)
-        return msg_write(conn,string,length);
-      else
-        return 1;
-    }
+    return write_block(conn,string,strlen(string));
   else
     return write_length(conn,0,1);
 }
@@ -175,11 +486,19 @@ msg_read_buffer_length(struct msg_connection *conn,size_t *length)
 {
   int err;
   uint32_t remote_length;
+  uint8_t special;
 
-  err=read_length(conn,&remote_length,NULL);
+  err=read_length(conn,&remote_length,&special);
   if(err!=1)
     return err;
 
+  if(special==COMPRESSED_SPECIAL)
+    {
+      err=read_compressed_length(conn,&remote_length);
+      if(err!=1)
+        return err;
+    }
+
   *length=remote_length;
 
   return err;
@@ -197,12 +516,33 @@ msg_read_buffer(struct msg_connection *conn,void *buffer,size_t length)
 int
 msg_write_buffer_length(struct msg_connection *conn,size_t length)
 {
+  if(conn->compress.pending)
+    {
+      int err=flush_buffer_length(conn);
+      if(err!=1)
+        return err;
+    }
+
+  /* Hold the length back in case the whole buffer comes next, so
+     both can go out compressed. */
+  if(conn->compress.codec && length>0 && length>=conn->compress.threshold)
+    {
+      conn->compress.pending=length;
+      return 1;
+    }
+
   return write_length(conn,length,0);
 }
 
 int
 msg_write_buffer(struct msg_connection *conn,const void *buffer,size_t length)
 {
+  if(conn->compress.pending && conn->compress.pending==length)
+    {
+      conn->compress.pending=0;
+      return write_block(conn,buffer,length);
+    }
+
   if(length>0)
     return msg_write(conn,buffer,length);
   else
@@ -420,6 +760,16 @@ msg_read_fd(struct msg_connection *conn,int *fd)
   int err;
   struct iovec iov;
 
+  /* There's no socket to carry an fd in a memory connection. */
+  if(conn->bits.memory)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  /* An fd can't be replayed from a cache. */
+  capture_spoil(conn);
+
   iov.iov_base=&i;
   iov.iov_len=1;
   msg.msg_iov=&iov;
@@ -428,6 +778,7 @@ msg_read_fd(struct msg_connection *conn,int *fd)
   msg.msg_controllen=sizeof(buf);
 
   err=recvmsg(conn->fd,&msg,MSG_CMSG_CLOEXEC);
+  conn->syscalls.reads++;
   if(err==1)
     {
       if(msg.msg_controllen<sizeof(*cmsg))
@@ -459,6 +810,21 @@ msg_write_fd(struct msg_connection *conn,int fd)
   char buf[CMSG_SPACE(sizeof(fd))]={0};
   struct iovec iov;
 
+  if(conn->bits.memory)
+    {
+      errno=EINVAL;
+      return -1;
+    }
+
+  capture_spoil(conn);
+
+  if(conn->compress.pending)
+    {
+      int err=flush_buffer_length(conn);
+      if(err!=1)
+        return err;
+    }
+
   iov.iov_base="i";
   iov.iov_len=1;
   msg.msg_iov=&iov;
@@ -471,5 +837,273 @@ msg_write_fd(struct msg_connection *conn,int fd)
   cmsg->cmsg_len=CMSG_LEN(sizeof(fd));
   memcpy(CMSG_DATA(cmsg),&fd,sizeof(fd));
 
+  conn->syscalls.writes++;
+
   return sendmsg(conn->fd,&msg,0);
 }
+
+/* Arrays go out as one block: the element count in the length
+   encoding, then the elements back to back in network byte order.
+   They are staged through a chunk buffer, so n uint32s cost one write
+   per chunk instead of n writes. */
+
+#define ARRAY_CHUNK 8192
+
+typedef void (*swap_t)(void *dst,const void *src,size_t count);
+
+static int
+write_array(struct msg_connection *conn,const void *vals,size_t count,
+            size_t width,swap_t swap)
+{
+  unsigned char chunk[ARRAY_CHUNK];
+  const unsigned char *src=vals;
+  size_t used;
+
+  if(count>UINT32_MAX)
+    {
+      errno=ERANGE;
+      return -1;
+    }
+
+  used=encode_length(chunk,count,0);
+
+  do
+    {
+      size_t todo=(ARRAY_CHUNK-used)/width;
+      ssize_t err;
+
+      if(todo>count)
+        todo=count;
+
+      if(swap)
+        (swap)(&chunk[used],src,todo);
+      else
+        memcpy(&chunk[used],src,todo*width);
+
+      used+=todo*width;
+      src+=todo*width;
+      count-=todo;
+
+      err=msg_write(conn,chunk,used);
+      if(err!=used)
+        return err;
+
+      used=0;
+    }
+  while(count);
+
+  return 1;
+}
+
+/* The elements are read straight into the caller's array, and then
+   swapped in place. */
+
+static int
+read_array(struct msg_connection *conn,void *vals,size_t count,
+           size_t width,swap_t swap)
+{
+  ssize_t err;
+
+  if(count>SIZE_MAX/width)
+    {
+      errno=ERANGE;
+      return -1;
+    }
+
+  if(count==0)
+    return 1;
+
+  err=msg_read(conn,vals,count*width);
+  if(err!=count*width)
+    return err;
+
+  if(swap)
+    (swap)(vals,vals,count);
+
+  return 1;
+}
+
+int
+msg_read_array_length(struct msg_connection *conn,size_t *count)
+{
+  return msg_read_buffer_length(conn,count);
+}
+
+int
+msg_read_uint8_array(struct msg_connection *conn,uint8_t *vals,size_t count)
+{
+  return read_array(conn,vals,count,1,NULL);
+}
+
+int
+msg_write_uint8_array(struct msg_connection *conn,const uint8_t *vals,
+                      size_t count)
+{
+  return write_array(conn,vals,count,1,NULL);
+}
+
+int
+msg_read_uint16_array(struct msg_connection *conn,uint16_t *vals,
+                      size_t count)
+{
+  return read_array(conn,vals,count,2,swap16_array);
+}
+
+int
+msg_write_uint16_array(struct msg_connection *conn,const uint16_t *vals,
+                       size_t count)
+{
+  return write_array(conn,vals,count,2,swap16_array);
+}
+
+int
+msg_read_int32_array(struct msg_connection *conn,int32_t *vals,size_t count)
+{
+  return read_array(conn,vals,count,4,swap32_array);
+}
+
+int
+msg_write_int32_array(struct msg_connection *conn,const int32_t *vals,
+                      size_t count)
+{
+  return write_array(conn,vals,count,4,swap32_array);
+}
+
+int
+msg_read_uint32_array(struct msg_connection *conn,uint32_t *vals,
+                      size_t count)
+{
+  return read_array(conn,vals,count,4,swap32_array);
+}
+
+int
+msg_write_uint32_array(struct msg_connection *conn,const uint32_t *vals,
+                       size_t count)
+{
+  return write_array(conn,vals,count,4,swap32_array);
+}
+
+int
+msg_read_int64_array(struct msg_connection *conn,int64_t *vals,size_t count)
+{
+  return read_array(conn,vals,count,8,swap64_array);
+}
+
+int
+msg_write_int64_array(struct msg_connection *conn,const int64_t *vals,
+                      size_t count)
+{
+  return write_array(conn,vals,count,8,swap64_array);
+}
+
+int
+msg_read_uint64_array(struct msg_connection *conn,uint64_t *vals,
+                      size_t count)
+{
+  return read_array(conn,vals,count,8,swap64_array);
+}
+
+int
+msg_write_uint64_array(struct msg_connection *conn,const uint64_t *vals,
+                       size_t count)
+{
+  return write_array(conn,vals,count,8,swap64_array);
+}
+
+/* A string array is the count followed by each string exactly as
+   msg_write_string() would send it, so NULL entries survive.  Short
+   strings are packed into the chunk, and long ones are written
+   directly rather than copied. */
+
+int
+msg_write_string_array(struct msg_connection *conn,char *const *strings,
+                       size_t count)
+{
+  unsigned char chunk[ARRAY_CHUNK];
+  size_t used,i;
+  ssize_t err;
+
+  if(count>UINT32_MAX)
+    {
+      errno=ERANGE;
+      return -1;
+    }
+
+  used=encode_length(chunk,count,0);
+
+  for(i=0;i<count;i++)
+    {
+      size_t length=strings[i]?strlen(strings[i]):0;
+
+      if(length>UINT32_MAX)
+        {
+          errno=ERANGE;
+          return -1;
+        }
+
+      if(used && used+5+length>ARRAY_CHUNK)
+        {
+          err=msg_write(conn,chunk,used);
+          if(err!=used)
+            return err;
+
+          used=0;
+        }
+
+      used+=encode_length(&chunk[used],length,strings[i]?0:1);
+
+      if(used+length>ARRAY_CHUNK)
+        {
+          err=msg_write(conn,chunk,used);
+          if(err!=used)
+            return err;
+
+          err=msg_write(conn,strings[i],length);
+          if(err!=length)
+            return err;
+
+          used=0;
+        }
+      else if(strings[i])
+        {
+          memcpy(&chunk[used],strings[i],length);
+          used+=length;
+        }
+    }
+
+  if(used)
+    {
+      err=msg_write(conn,chunk,used);
+      if(err!=used)
+        return err;
+    }
+
+  return 1;
+}
+
+/* Fill in strings[0..count-1] with newly allocated strings.  On
+   failure, nothing is left allocated. */
+
+int
+msg_read_string_array(struct msg_connection *conn,char **strings,size_t count)
+{
+  size_t i;
+  int err;
+
+  for(i=0;i<count;i++)
+    {
+      err=msg_read_string(conn,&strings[i]);
+      if(err<1)
+        {
+          while(i--)
+            {
+              free(strings[i]);
+              strings[i]=NULL;
+            }
+
+          return err;
+        }
+    }
+
+  return 1;
+}
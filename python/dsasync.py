@@ -0,0 +1,472 @@
+#!/usr/bin/env python
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+"""
+Non-blocking dispatch clients and servers, for handling many
+connections from one thread.
+
+Python 2 has no asyncio, so coroutines here are generators, run by
+the small event loop in this module.  A coroutine waits for another
+coroutine (or a Task) by yielding it, and gets its result back from
+the yield.  Since a generator can't return a value, a coroutine
+hands back a result by raising Return.
+
+Every connection is a non-blocking socket.  Incoming bytes are
+buffered and decoded with _dsdispatch.decode_struct, which leaves
+the buffer alone until a whole struct has arrived, and outgoing
+values are encoded with encode_struct.  The wire format is the same
+as everywhere else, so these interoperate with blocking clients and
+servers, C or Python.  File descriptors can't be passed.
+
+== Client Example ==
+
+>>> import dsasync
+>>> def client():
+...     conn = yield dsasync.open('/tmp/myapp.sock')
+...     yield conn.write_struct('Hs', 22, 'foobar')
+...     t, s = yield conn.read_struct('Hs')
+...     conn.close()
+...     raise dsasync.Return(s)
+>>> dsasync.Loop().run_until_complete(client())
+
+
+== Server Example ==
+
+>>> def do_thing1(dtype, conn):
+...     v = yield conn.read_int32()
+...     yield conn.write_int32(v + 1)
+>>> loop = dsasync.Loop()
+>>> loop.spawn(dsasync.Server({THING1: do_thing1}, loop).serve(service))
+>>> loop.run()
+
+"""
+
+import collections
+import errno
+import os
+import select
+import socket
+import sys
+import types
+
+from _dsdispatch import \
+    MSG_LOCAL, \
+    _listen_socket, \
+    encode_struct, \
+    decode_struct
+
+
+__all__ = [
+    'Return',
+    'Task',
+    'Loop',
+    'Connection',
+    'Server',
+    'open',
+]
+
+
+READ = select.POLLIN
+WRITE = select.POLLOUT
+
+# the version byte and no flags, as msg_open() sends
+_HEADER = '\x01\x00'
+
+_AGAIN = (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR)
+
+
+class Return(Exception):
+    """Raised by a coroutine to return value."""
+    def __init__(self, value=None):
+        Exception.__init__(self, value)
+        self.value = value
+
+
+class _Wait(object):
+    """Yielded to the loop to wait until fd is ready for events."""
+    __slots__ = ('fd', 'events')
+
+    def __init__(self, fd, events):
+        self.fd = fd
+        self.events = events
+
+
+class Task(object):
+    """A coroutine running on a loop.  Yield it from another coroutine
+    to wait for its result."""
+
+    def __init__(self, loop, coro):
+        self.loop = loop
+        self._stack = [coro]
+        self._waiters = []
+        self.done = False
+        self._value = None
+        self._exc_info = None
+
+    def result(self):
+        if not self.done:
+            raise RuntimeError('task is not done')
+        if self._exc_info:
+            raise self._exc_info[0], self._exc_info[1], self._exc_info[2]
+        return self._value
+
+    def _step(self, value=None, exc_info=None):
+        while self._stack:
+            gen = self._stack[-1]
+            try:
+                if exc_info:
+                    yielded = gen.throw(*exc_info)
+                    exc_info = None
+                else:
+                    yielded = gen.send(value)
+            except Return as ret:
+                self._stack.pop()
+                value = ret.value
+                continue
+            except StopIteration:
+                self._stack.pop()
+                value = None
+                continue
+            except Exception:
+                self._stack.pop()
+                exc_info = sys.exc_info()
+                continue
+
+            value = None
+            if isinstance(yielded, types.GeneratorType):
+                self._stack.append(yielded)
+            elif isinstance(yielded, _Wait):
+                try:
+                    self.loop._wait(yielded, self)
+                    return
+                except (IOError, OSError, RuntimeError):
+                    exc_info = sys.exc_info()
+            elif isinstance(yielded, Task):
+                if yielded.done:
+                    value, exc_info = yielded._value, yielded._exc_info
+                else:
+                    yielded._waiters.append(self)
+                    return
+            elif yielded is None:
+                # let everything else run first
+                self.loop._ready.append((self, None, None))
+                return
+            else:
+                try:
+                    raise TypeError('cannot wait for %r' % (yielded,))
+                except TypeError:
+                    exc_info = sys.exc_info()
+
+        self.done = True
+        self._value = value
+        self._exc_info = exc_info
+        waited = self._waiters or self is self.loop._main
+        for task in self._waiters:
+            self.loop._ready.append((task, value, exc_info))
+        self._waiters = None
+        if exc_info and self.loop.report_errors and not waited:
+            self.loop._report(self)
+
+
+class Loop(object):
+    """Runs tasks until they are done, waiting for sockets in between
+    with epoll (or poll, where there is no epoll)."""
+
+    # print the exceptions of tasks that nothing waits for
+    report_errors = True
+
+    def __init__(self):
+        if hasattr(select, 'epoll'):
+            self._poller = select.epoll()
+        else:
+            self._poller = select.poll()
+        self._waiting = {}
+        self._ready = collections.deque()
+        self._main = None
+        self._running = False
+
+    def spawn(self, coro):
+        """Start running coro, and return its Task."""
+        task = Task(self, coro)
+        self._ready.append((task, None, None))
+        return task
+
+    def run(self):
+        """Run until stop() is called or there is nothing left to do."""
+        self._running = True
+        while self._running and (self._ready or self._waiting):
+            self._run_once()
+        self._running = False
+
+    def run_until_complete(self, coro):
+        """Run until coro (or a Task) is done, and return its result."""
+        if isinstance(coro, Task):
+            task = coro
+        else:
+            task = self.spawn(coro)
+        self._main = task
+        try:
+            while not task.done:
+                if not self._ready and not self._waiting:
+                    raise RuntimeError('deadlock: nothing left to run')
+                self._run_once()
+        finally:
+            self._main = None
+        return task.result()
+
+    def stop(self):
+        self._running = False
+
+    def close(self):
+        self._poller.close()
+
+    def _wait(self, wait, task):
+        if wait.fd in self._waiting:
+            raise RuntimeError('two tasks waiting on fd %d' % wait.fd)
+        self._poller.register(wait.fd, wait.events)
+        self._waiting[wait.fd] = task
+
+    def _wake(self, fd):
+        # before fd is closed, so it can't come back as something else
+        task = self._waiting.pop(fd, None)
+        if task is not None:
+            self._poller.unregister(fd)
+            self._ready.append((task, None, None))
+
+    def _run_once(self):
+        ready = self._ready
+        if self._waiting:
+            try:
+                events = self._poller.poll(0 if ready else -1)
+            except (IOError, OSError, select.error) as err:
+                if err.args[0] != errno.EINTR:
+                    raise
+                events = []
+            for fd, event in events:
+                task = self._waiting.pop(fd)
+                self._poller.unregister(fd)
+                ready.append((task, None, None))
+        for i in range(len(ready)):
+            task, value, exc_info = ready.popleft()
+            task._step(value, exc_info)
+
+    def _report(self, task):
+        import traceback
+        sys.stderr.write('Unhandled exception in task:\n')
+        traceback.print_exception(*task._exc_info)
+
+
+class Connection(object):
+    """A non-blocking dispatch connection.  Every read_* and write_*
+    method is a coroutine, to be yielded."""
+
+    recv_size = 65536
+
+    def __init__(self, sock):
+        sock.setblocking(False)
+        self.sock = sock
+        self._in = bytearray()
+        self._out = bytearray()
+
+    def fileno(self):
+        return self.sock.fileno()
+
+    @property
+    def closed(self):
+        return self.sock is None
+
+    def close(self):
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def read_struct(self, fmt):
+        """Read the values in fmt (see msg_read_struct), as a tuple."""
+        while True:
+            found = decode_struct(fmt, self._in)
+            if found is not None:
+                values, end = found
+                del self._in[:end]
+                raise Return(values)
+            yield self._fill()
+
+    def _fill(self):
+        while True:
+            try:
+                data = self.sock.recv(self.recv_size)
+            except socket.error as err:
+                if err.args[0] not in _AGAIN:
+                    raise
+                yield _Wait(self.sock.fileno(), READ)
+                continue
+            if not data:
+                raise IOError(errno.EPIPE, os.strerror(errno.EPIPE))
+            self._in.extend(data)
+            return
+
+    def write_struct(self, fmt, *values):
+        """Send the values in fmt (see msg_write_struct)."""
+        self._out.extend(encode_struct(fmt, *values))
+        return self.drain()
+
+    def drain(self):
+        """Wait until everything written has gone out."""
+        while self._out:
+            try:
+                sent = self.sock.send(self._out)
+            except socket.error as err:
+                if err.args[0] not in _AGAIN:
+                    raise
+                yield _Wait(self.sock.fileno(), WRITE)
+                continue
+            del self._out[:sent]
+
+
+def _reader(code):
+    def read(self):
+        values = yield self.read_struct(code)
+        raise Return(values[0])
+    read.__name__ = 'read_' + _CODES[code]
+    read.__doc__ = 'Read a %s.' % _CODES[code]
+    return read
+
+
+def _writer(code):
+    def write(self, value):
+        return self.write_struct(code, value)
+    write.__name__ = 'write_' + _CODES[code]
+    write.__doc__ = 'Write a %s.' % _CODES[code]
+    return write
+
+
+_CODES = {
+    'H': 'uint16',
+    'B': 'uint8',
+    'i': 'int32',
+    'I': 'uint32',
+    'q': 'int64',
+    'Q': 'uint64',
+    'v': 'varint',
+    'V': 'varuint',
+    's': 'string',
+    's#': 'bytes',
+}
+
+for _code, _name in _CODES.items():
+    setattr(Connection, 'read_' + _name, _reader(_code))
+    setattr(Connection, 'write_' + _name, _writer(_code))
+Connection.read_type = Connection.read_uint16
+Connection.write_type = Connection.write_uint16
+del _code, _name
+
+
+def _address(service):
+    if service.startswith('@'):
+        return '\0' + service[1:]
+    return service
+
+
+def open(service):
+    """Connect to a local dispatch service, and return the Connection."""
+    address = _address(service)
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.setblocking(False)
+    try:
+        # a full backlog is EAGAIN, and means try again
+        err = sock.connect_ex(address)
+        while err in _AGAIN + (errno.EINPROGRESS, errno.EALREADY):
+            yield _Wait(sock.fileno(), WRITE)
+            err = sock.connect_ex(address)
+        if err and err != errno.EISCONN:
+            raise IOError(err, os.strerror(err))
+    except:
+        sock.close()
+        raise
+    conn = Connection(sock)
+    conn._out.extend(_HEADER)
+    raise Return(conn)
+
+
+class Server(object):
+    """Serves dispatch connections from a loop.  Handlers are called
+    as handler(type, conn), and may be coroutines.  The connection is
+    closed when the handler is done."""
+
+    def __init__(self, handlers, loop):
+        self.handlers = handlers
+        self.loop = loop
+        self.sock = None
+
+    def listen(self, service, flags=None):
+        """Start listening on service, ahead of serve()."""
+        if not flags:
+            flags = MSG_LOCAL
+        fd = _listen_socket('', service, flags)
+        try:
+            self.sock = socket.fromfd(fd, socket.AF_UNIX, socket.SOCK_STREAM)
+        finally:
+            os.close(fd)
+        self.sock.setblocking(False)
+
+    def serve(self, service=None, flags=None):
+        """A coroutine that accepts connections until close()."""
+        if self.sock is None:
+            self.listen(service, flags)
+        try:
+            while self.sock is not None:
+                try:
+                    sock, addr = self.sock.accept()
+                except socket.error as err:
+                    if err.args[0] not in _AGAIN + (errno.ECONNABORTED,):
+                        raise
+                    yield _Wait(self.sock.fileno(), READ)
+                    continue
+                self.loop.spawn(self.handle(Connection(sock)))
+        finally:
+            self.close()
+
+    def close(self):
+        """Stop accepting connections."""
+        if self.sock is not None:
+            self.loop._wake(self.sock.fileno())
+            self.sock.close()
+            self.sock = None
+
+    def handle(self, conn):
+        """Read the header and type, and run the handler."""
+        with conn:
+            try:
+                version, flags, typeval = yield conn.read_struct('BBH')
+            except IOError as err:
+                # client aborted, no reason to complain
+                if err.errno == errno.EPIPE:
+                    return
+                raise
+            handler = self.handlers.get(typeval)
+            if handler is None:
+                raise ValueError('unknown type value: %d' % typeval)
+            result = handler(typeval, conn)
+            if isinstance(result, types.GeneratorType):
+                yield result
+            yield conn.drain()
@@ -58,12 +58,27 @@ but without violating the typical conventions of Python.
 """
 
 import os
+import sys
+import time
 import errno
+import signal
 import threading
+import traceback
 
 from _dsdispatch import \
     MSG_LOCAL, \
+    MSG_COMPRESS, \
     _listen_socket, \
+    _read_request, \
+    _answer_ping, \
+    MSG_TYPE_PING, \
+    MSG_TYPE_BATCH, \
+    MSG_TYPE_HANDOFF, \
+    MSG_GROUP_ROUND_ROBIN, \
+    MSG_GROUP_LEAST_OUTSTANDING, \
+    MSG_GROUP_TWO_CHOICES, \
+    MSG_GROUP_HASH, \
+    msg_deadline_remaining, \
     msg_write_type, \
     msg_read_type, \
     msg_write_uint64, \
@@ -78,19 +93,57 @@ from _dsdispatch import \
     msg_read_uint16, \
     msg_write_uint8, \
     msg_read_uint8, \
+    msg_write_varuint64, \
+    msg_read_varuint64, \
+    msg_write_varint64, \
+    msg_read_varint64, \
+    msg_write_varuint32, \
+    msg_read_varuint32, \
+    msg_write_varint32, \
+    msg_read_varint32, \
     msg_write_fd, \
     msg_read_fd, \
     msg_write_string, \
     msg_read_string, \
     msg_write_bytes, \
     msg_read_bytes, \
-    Connection
+    msg_read_bytes_into, \
+    msg_write_struct, \
+    msg_read_struct, \
+    msg_write_array, \
+    msg_read_array, \
+    msg_init, \
+    msg_listen_native, \
+    msg_listen_native_fd, \
+    msg_handoff_receive, \
+    msg_cache_stats, \
+    msg_cache_invalidate, \
+    msg_batch, \
+    msg_peerinfo, \
+    msg_publish, \
+    msg_subscribe, \
+    msg_subscription_read, \
+    msg_usage_types, \
+    msg_usage_peers, \
+    msg_usage_reset, \
+    _Server, \
+    Connection, \
+    Group
 
 
 __all__ = [
     # c wrapper module
     'Connection',
+    'Group',
     'MSG_LOCAL',
+    'MSG_COMPRESS',
+    'MSG_TYPE_PING',
+    'MSG_TYPE_BATCH',
+    'MSG_TYPE_HANDOFF',
+    'MSG_GROUP_ROUND_ROBIN',
+    'MSG_GROUP_LEAST_OUTSTANDING',
+    'MSG_GROUP_TWO_CHOICES',
+    'MSG_GROUP_HASH',
     'msg_write_type',
     'msg_read_type',
     'msg_write_uint64',
@@ -105,12 +158,40 @@ __all__ = [
     'msg_read_uint16',
     'msg_write_uint8',
     'msg_read_uint8',
+    'msg_write_varuint64',
+    'msg_read_varuint64',
+    'msg_write_varint64',
+    'msg_read_varint64',
+    'msg_write_varuint32',
+    'msg_read_varuint32',
+    'msg_write_varint32',
+    'msg_read_varint32',
     'msg_write_fd',
     'msg_read_fd',
     'msg_write_string',
     'msg_read_string',
     'msg_write_bytes',
     'msg_read_bytes',
+    'msg_read_bytes_into',
+    'msg_write_struct',
+    'msg_read_struct',
+    'msg_write_array',
+    'msg_read_array',
+    'msg_deadline_remaining',
+    'msg_init',
+    'msg_listen_native',
+    'msg_listen_native_fd',
+    'msg_handoff_receive',
+    'msg_cache_stats',
+    'msg_cache_invalidate',
+    'msg_batch',
+    'msg_peerinfo',
+    'msg_publish',
+    'msg_subscribe',
+    'msg_subscription_read',
+    'msg_usage_types',
+    'msg_usage_peers',
+    'msg_usage_reset',
     # this module
     'open',
     'Dispatcher',
@@ -118,23 +199,50 @@ __all__ = [
 ]
 
 
-def open(host, service, flags=None):
-    """Convenience wrapper for Connection.open"""
+def open(host, service, flags=None, timeout=None):
+    """Convenience wrapper for Connection.open.  A timeout, in
+    milliseconds, becomes the request's deadline."""
     if not flags:
         flags = MSG_LOCAL
-    return Connection.open(host, service, flags)
+    if timeout is None:
+        return Connection.open(host, service, flags)
+    return Connection.open(host, service, flags, timeout)
+
+
+class _Active(threading._Event):
+    """An Event that also stops a native serve loop when cleared."""
+    server = None
+
+    def clear(self):
+        threading._Event.clear(self)
+        server = self.server
+        if server is not None:
+            server.stop()
 
 
 class Dispatcher(object):
     """Implements a stateful system for dispatching messages
     to handlers in threads.
+
+    Unless a subclass overrides how connections are accepted or
+    handled, serving runs in C: connections are accepted and their
+    type read without the GIL, and handlers run on a pool of up to
+    max_threads native threads.  Clearing active stops it at once.
+
+    Handlers share the GIL, so one process tops out at one core.  If
+    processes is set, serve() opens the socket once and forks that
+    many workers to accept from it, each serving as above.  A worker
+    that dies is replaced, though no sooner than restart_delay
+    seconds after it was last started.  Clearing active kills them.
     """
     max_threads = 128
     daemon_threads = True
+    processes = None
+    restart_delay = 1.0
     def __init__(self, handlers):
         self.handlers = handlers
         self.sem = threading.Semaphore(self.max_threads)
-        self.active = threading.Event()
+        self.active = _Active()
         self.timeout = None
 
     def serve(self, host, service, flags=None):
@@ -144,17 +252,97 @@ class Dispatcher(object):
         sockfd = _listen_socket(host, service, flags)
         self.active.set()
         try:
-            while self.active.is_set():
-                if not self.ready(sockfd):
-                    continue
-                self.sem.acquire()
-                conn = Connection.accept(sockfd)
-                typeval, handler = self.gethandler(conn)
-                if handler:
-                    self.dispatch(conn, typeval, handler)
+            if self.processes:
+                self._serve_prefork(sockfd)
+            else:
+                self._serve(sockfd)
         finally:
             os.close(sockfd)
 
+    def _serve(self, sockfd):
+        if self._native():
+            self._serve_native(sockfd)
+        else:
+            self._serve_python(sockfd)
+
+    def _native(self):
+        # the native loop can stand in for these methods, and
+        # threading's non-daemon threads, only as they are here
+        if not self.daemon_threads or not isinstance(self.active, _Active) \
+                or not isinstance(self.handlers, dict):
+            return False
+        cls = type(self)
+        for name in ('ready', 'gethandler', 'dispatch', 'handle'):
+            if getattr(cls, name).im_func is not \
+                    getattr(Dispatcher, name).im_func:
+                return False
+        return True
+
+    def _serve_native(self, sockfd):
+        server = _Server(self.handlers, self.max_threads)
+        self.active.server = server
+        try:
+            if self.active.is_set():
+                server.serve(sockfd)
+        finally:
+            self.active.server = None
+
+    def _serve_prefork(self, sockfd):
+        # slot -> pid of the worker in it, and when it may next start
+        workers = {}
+        starts = [0] * self.processes
+        try:
+            while self.active.is_set():
+                now = time.time()
+                for slot in range(self.processes):
+                    if slot not in workers and now >= starts[slot]:
+                        starts[slot] = now + self.restart_delay
+                        workers[slot] = self._fork_worker(sockfd)
+                for slot, pid in workers.items():
+                    if _reap(pid, os.WNOHANG):
+                        del workers[slot]
+                time.sleep(0.1)
+        finally:
+            for pid in workers.values():
+                try:
+                    os.kill(pid, signal.SIGTERM)
+                except OSError as err:
+                    if err.errno != errno.ESRCH:
+                        raise
+            for pid in workers.values():
+                _reap(pid, 0)
+
+    def _fork_worker(self, sockfd):
+        pid = os.fork()
+        if pid:
+            return pid
+        # the worker is stopped by SIGTERM from the parent, and leaves
+        # ^C to it as well, so it never runs the parent's cleanup
+        status = 1
+        try:
+            signal.signal(signal.SIGTERM, signal.SIG_DFL)
+            signal.signal(signal.SIGINT, signal.SIG_IGN)
+            self._serve(sockfd)
+            status = 0
+        except:
+            traceback.print_exc()
+        finally:
+            sys.stderr.flush()
+            os._exit(status)
+
+    def _serve_python(self, sockfd):
+        while self.active.is_set():
+            if not self.ready(sockfd):
+                continue
+            self.sem.acquire()
+            conn = Connection.accept(sockfd)
+            typeval, handler = self.gethandler(conn)
+            if handler:
+                self.dispatch(conn, typeval, handler)
+            else:
+                self.sem.release()
+                conn.close()
+
     def ready(self, sockfd):
         if not self.timeout:
             return True
@@ -190,26 +378,40 @@ class Dispatcher(object):
             conn.close()
 
 
-def msg_listen(host, service, handlers, flags=None):
+def msg_listen(host, service, handlers, flags=None, processes=None):
     """Listen to a socket on the given host and service and
     execute given handlers in the style of dispatch's msg_listen.
+    With processes, serve from that many forked workers.
     """
     # mimic dispatch c-library msg_listen function
-    Dispatcher(handlers).serve(host, service, flags=flags)
+    dispatcher = Dispatcher(handlers)
+    dispatcher.processes = processes
+    dispatcher.serve(host, service, flags=flags)
 
 
-def _read_header(conn):
-    # normal dispatch lib writes these values but never
-    # appears to check them
-    hdr = (msg_read_uint8(conn), msg_read_uint8(conn))
-    return hdr
+def _reap(pid, options):
+    """Wait for a child, returning True once it is gone."""
+    while True:
+        try:
+            return os.waitpid(pid, options)[0] != 0
+        except OSError as err:
+            if err.errno == errno.ECHILD:
+                return True
+            if err.errno != errno.EINTR:
+                raise
 
 
 def _handle_connection(conn, handlers):
-    _read_header(conn)
-    typeval = msg_read_type(conn)
+    typeval = _read_request(conn)
+    if typeval is None:
+        # the client had no time left when it sent the request
+        return None, None
     if typeval in handlers:
         handler = handlers[typeval]
+    elif typeval == MSG_TYPE_PING:
+        # answered here, as the C dispatcher does
+        _answer_ping(conn)
+        return None, None
     else:
         raise ValueError('unknown type value: %d' % typeval)
     return (typeval, handler)
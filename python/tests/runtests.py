@@ -51,3 +51,16 @@ else:
     rtest('python2 -c "import dsdispatch"')
     rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_threaded.py')
     rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_servers.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_idl.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_async.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_cache.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_coalesce.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_batch.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_pubsub.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_account.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_group.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_hedge.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_handoff.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_compress.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_varint.py')
+    rtest('python2 ' + os.environ.get('srcdir', '') + '/tests/test_arrays.py')
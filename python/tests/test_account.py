@@ -0,0 +1,110 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+import time
+
+import dsdispatch as dispatch
+from _dsdispatch import encode_struct
+from test_threaded import TestCase
+
+
+MSG_REPLY = 8
+MSG_ECHO = 60
+
+PAYLOAD = 'x' * 1000
+
+
+def handle_echo(dtype, conn):
+    data = dispatch.msg_read_bytes(conn)
+    dispatch.msg_write_struct(conn, 'Hs#', MSG_REPLY, data)
+
+
+class AccountTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(AccountTestCase, cls).setUpClass()
+        cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
+        dispatch.msg_init(account=1)
+        dispatch.msg_listen_native(cls.SOCKF, {MSG_ECHO: handle_echo})
+
+    def setUp(self):
+        super(AccountTestCase, self).setUp()
+        dispatch.msg_usage_reset()
+
+    def call(self):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_struct(conn, 'Hs#', MSG_ECHO, PAYLOAD)
+            self.assertEqual(dispatch.msg_read_struct(conn, 'Hs#'),
+                             (MSG_REPLY, PAYLOAD))
+
+    def usage(self, dtype, requests):
+        # a request is counted after the client has its reply
+        for _ in range(100):
+            usage = dict(dispatch.msg_usage_types())
+            if usage.get(dtype, {}).get('requests') == requests:
+                return usage[dtype]
+            time.sleep(0.01)
+        self.fail('type %d never reached %d requests' % (dtype, requests))
+
+    def test_types(self):
+        for _ in range(5):
+            self.call()
+        usage = self.usage(MSG_ECHO, 5)
+        self.assertTrue(usage['bytes_in'] >= 5 * len(PAYLOAD))
+        self.assertTrue(usage['bytes_out'] >= 5 * len(PAYLOAD))
+        self.assertTrue(usage['reads'] >= 5)
+        self.assertTrue(usage['writes'] >= 5)
+
+    def test_peers(self):
+        for _ in range(3):
+            self.call()
+        self.usage(MSG_ECHO, 3)
+        peers = dict(((pid, uid), usage)
+                     for pid, uid, usage in dispatch.msg_usage_peers())
+        self.assertEqual(peers[(os.getpid(), os.getuid())]['requests'], 3)
+
+    def test_batch(self):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            replies = dispatch.msg_batch(conn, MSG_ECHO,
+                                         [encode_struct('s#', PAYLOAD)] * 4)
+        self.assertEqual(len(replies), 4)
+        usage = self.usage(MSG_ECHO, 4)
+        self.assertTrue(usage['bytes_in'] >= 4 * len(PAYLOAD))
+        self.usage(dispatch.MSG_TYPE_BATCH, 1)
+
+    def test_reset(self):
+        self.call()
+        self.usage(MSG_ECHO, 1)
+        dispatch.msg_usage_reset()
+        self.assertEqual(dispatch.msg_usage_types(), [])
+        self.assertEqual(dispatch.msg_usage_peers(), [])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import struct
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_ECHO = 120
+MSG_RAW = 121
+
+# code: (smallest, largest)
+RANGES = {
+    'B': (0, (1 << 8) - 1),
+    'H': (0, (1 << 16) - 1),
+    'i': (-(1 << 31), (1 << 31) - 1),
+    'I': (0, (1 << 32) - 1),
+    'q': (-(1 << 63), (1 << 63) - 1),
+    'Q': (0, (1 << 64) - 1),
+}
+
+# either side of each length encoding, and of the writer's chunks
+LENGTHS = [0, 1, 191, 192, 1023, 1024, 1025, 8383, 8384, 10000]
+
+
+def handle_echo(dtype, conn):
+    code = chr(dispatch.msg_read_uint8(conn))
+    values = dispatch.msg_read_array(conn, code)
+    dispatch.msg_write_array(conn, code, values)
+
+
+def handle_raw(dtype, conn):
+    # send back the bytes, so the client can see the encoding
+    count = dispatch.msg_read_uint8(conn)
+    data = ''.join(chr(dispatch.msg_read_uint8(conn)) for _ in range(count))
+    dispatch.msg_write_bytes(conn, data)
+
+
+def values_for(code, length):
+    low, high = RANGES[code]
+    span = high - low + 1
+    # the ends of the range, then values spread across it
+    values = [low, high] + [low + (i * 2654435761) % span
+                            for i in range(length)]
+    return values[:length]
+
+
+class ArrayTestCase(TestCase):
+    @classmethod
+    def server_handlers(cls):
+        return {
+            MSG_ECHO: handle_echo,
+            MSG_RAW: handle_raw,
+        }
+
+    def echo(self, code, values):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_type(conn, MSG_ECHO)
+            dispatch.msg_write_uint8(conn, ord(code))
+            dispatch.msg_write_array(conn, code, values)
+            return dispatch.msg_read_array(conn, code)
+
+    def encoding(self, code, values, length):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_type(conn, MSG_RAW)
+            dispatch.msg_write_uint8(conn, length)
+            dispatch.msg_write_array(conn, code, values)
+            return dispatch.msg_read_bytes(conn)
+
+    def test_round_trip(self):
+        for code in sorted(RANGES):
+            for length in LENGTHS:
+                values = values_for(code, length)
+                result = self.echo(code, values)
+                # no assertEqual on the lists, whose diffs are huge
+                self.assertEqual(len(result), length, (code, length))
+                self.assertTrue(result == values, (code, length))
+
+    def test_tuple(self):
+        self.assertEqual(self.echo('H', (1, 2, 3)), [1, 2, 3])
+
+    def test_encoding(self):
+        self.assertEqual(self.encoding('B', [1, 2], 3), '\x02\x01\x02')
+        self.assertEqual(self.encoding('H', [0x102], 3), '\x01\x01\x02')
+        self.assertEqual(self.encoding('i', [-2], 5),
+                         '\x01' + struct.pack('>i', -2))
+        self.assertEqual(self.encoding('Q', [1 << 63], 9),
+                         '\x01' + struct.pack('>Q', 1 << 63))
+        self.assertEqual(self.encoding('B', [0] * 192, 2), '\xc0\x00')
+
+    def test_out_of_range(self):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            for code, (low, high) in sorted(RANGES.items()):
+                for value in (low - 1, high + 1):
+                    with self.assertRaises(OverflowError):
+                        dispatch.msg_write_array(conn, code, [0, value])
+
+    def test_bad_code(self):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            for code in ('s', 'v', 'x'):
+                with self.assertRaises(ValueError):
+                    dispatch.msg_write_array(conn, code, [])
+                with self.assertRaises(ValueError):
+                    dispatch.msg_read_array(conn, code)
+
+
+if __name__ == '__main__':
+    unittest.main()
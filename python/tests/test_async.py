@@ -0,0 +1,187 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import errno
+import os
+import shutil
+import tempfile
+import threading
+
+import dsdispatch as dispatch
+import dsasync
+from _dsdispatch import encode_struct, decode_struct
+from test_threaded import TestCase
+
+
+MSG_REPLY = 8
+MSG_ECHO = 10
+MSG_STOP = 11
+
+CLIENTS = 200
+
+
+def handle_echo(dtype, conn):
+    v1, v2, v3 = dispatch.msg_read_struct(conn, 'sqs#')
+    dispatch.msg_write_struct(conn, 'Hsqs#', MSG_REPLY, v1, v2, v3)
+
+
+def async_handle_echo(dtype, conn):
+    v1 = yield conn.read_string()
+    v2, v3 = yield conn.read_struct('qs#')
+    yield conn.write_type(MSG_REPLY)
+    yield conn.write_struct('sqs#', v1, v2, v3)
+
+
+def echo(service, n):
+    conn = yield dsasync.open(service)
+    with conn:
+        yield conn.write_struct('Hsqs#', MSG_ECHO, 'client %d' % n, -n,
+                                'x' * n * 100)
+        reply = yield conn.read_struct('Hsqs#')
+    raise dsasync.Return(reply)
+
+
+def echo_all(service, loop, count):
+    tasks = [loop.spawn(echo(service, n)) for n in range(count)]
+    replies = []
+    for task in tasks:
+        reply = yield task
+        replies.append(reply)
+    raise dsasync.Return(replies)
+
+
+class StructCodecTestCase(unittest.TestCase):
+    def test_encode(self):
+        self.assertEqual(encode_struct('HB', 10, 255), '\x00\x0a\xff')
+        self.assertEqual(encode_struct('s', None), '\xe1')
+        self.assertEqual(encode_struct('s#V', bytearray('ab'), 300),
+                         '\x02ab\xac\x02')
+
+    def test_incremental(self):
+        fmt = 'Hsqs#'
+        values = (7, 'hello', -1 << 40, '\0' * 5000)
+        data = encode_struct(fmt, *values)
+        for cut in range(0, len(data), 97):
+            self.assertEqual(decode_struct(fmt, data[:cut]), None)
+        self.assertEqual(decode_struct(fmt, data + 'more'),
+                         (values, len(data)))
+
+    def test_offset(self):
+        data = encode_struct('HH', 1, 2)
+        self.assertEqual(decode_struct('H', data, 2), ((2,), 4))
+        self.assertEqual(decode_struct('H', data, 4), None)
+        self.assertRaises(ValueError, decode_struct, 'H', data, 5)
+
+    def test_malformed(self):
+        try:
+            decode_struct('V', '\xff' * 11)
+            self.fail('decoded an overlong varint')
+        except IOError:
+            pass
+
+    def test_no_fds(self):
+        self.assertRaises(ValueError, encode_struct, 'f', 0)
+        self.assertRaises(ValueError, decode_struct, 'f', '')
+
+
+class AsyncClientTestCase(TestCase):
+    """Async clients against the threaded server."""
+    @classmethod
+    def server_handlers(self):
+        return {
+            MSG_ECHO: handle_echo,
+        }
+
+    def test_echo(self):
+        loop = dsasync.Loop()
+        reply = loop.run_until_complete(echo(self.SOCKF, 3))
+        self.assertEqual(reply, (MSG_REPLY, 'client 3', -3, 'x' * 300))
+
+    def test_many(self):
+        loop = dsasync.Loop()
+        replies = loop.run_until_complete(echo_all(self.SOCKF, loop,
+                                                   CLIENTS))
+        self.assertEqual(len(replies), CLIENTS)
+        for n, reply in enumerate(replies):
+            self.assertEqual(reply[1:3], ('client %d' % n, -n))
+
+    def test_refused(self):
+        loop = dsasync.Loop()
+        try:
+            loop.run_until_complete(dsasync.open(self.SOCKF + '.missing'))
+            self.fail('connected to nothing')
+        except IOError as err:
+            self.assertEqual(err.errno, errno.ENOENT)
+
+
+class AsyncServerTestCase(unittest.TestCase):
+    def setUp(self):
+        self.temp = tempfile.mkdtemp(suffix='AsyncServerTestCase')
+        self.sockf = os.path.join(self.temp, 'd.sock')
+        self.loop = dsasync.Loop()
+        self.server = dsasync.Server({
+            MSG_ECHO: async_handle_echo,
+            MSG_STOP: self.handle_stop,
+        }, self.loop)
+
+    def tearDown(self):
+        self.server.close()
+        self.loop.close()
+        shutil.rmtree(self.temp)
+
+    def handle_stop(self, dtype, conn):
+        self.server.close()
+
+    def test_async_clients(self):
+        self.loop.spawn(self.server.serve(self.sockf))
+        replies = self.loop.run_until_complete(echo_all(self.sockf,
+                                                        self.loop, CLIENTS))
+        self.assertEqual(len(replies), CLIENTS)
+        for n, reply in enumerate(replies):
+            self.assertEqual(reply, (MSG_REPLY, 'client %d' % n, -n,
+                                     'x' * n * 100))
+
+    def test_blocking_clients(self):
+        replies = []
+
+        def clients():
+            for n in range(10):
+                with dispatch.open('', self.sockf) as conn:
+                    dispatch.msg_write_struct(conn, 'Hsqs#', MSG_ECHO,
+                                              'blocking', n, '')
+                    replies.append(dispatch.msg_read_struct(conn, 'Hsqs#'))
+            with dispatch.open('', self.sockf) as conn:
+                dispatch.msg_write_type(conn, MSG_STOP)
+
+        t = threading.Thread(target=clients)
+        self.server.listen(self.sockf)
+        t.start()
+        self.loop.run_until_complete(self.server.serve())
+        t.join()
+        self.assertEqual(replies, [(MSG_REPLY, 'blocking', n, '')
+                                   for n in range(10)])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,128 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+
+import dsdispatch as dispatch
+from _dsdispatch import encode_struct, decode_struct
+from test_threaded import TestCase
+
+
+MSG_UPPER = 40
+MSG_CACHED = 41
+MSG_PEER = 42
+MSG_UNKNOWN = 43
+
+calls = {}
+
+
+def handle_upper(dtype, conn):
+    # the request says how the handler ends
+    word = dispatch.msg_read_string(conn)
+    dispatch.msg_write_string(conn, word.upper())
+    if word == 'one':
+        return 1
+    if word == 'fail':
+        return -1
+    if word == 'raise':
+        raise RuntimeError('raised on purpose')
+
+
+def handle_cached(dtype, conn):
+    word = dispatch.msg_read_string(conn)
+    calls[word] = calls.get(word, 0) + 1
+    dispatch.msg_write_string(conn, word.upper())
+
+
+def handle_peer(dtype, conn):
+    dispatch.msg_write_struct(conn, 'q', dispatch.msg_peerinfo(conn)[0])
+
+
+class BatchTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(BatchTestCase, cls).setUpClass()
+        cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
+        dispatch.msg_init()
+        dispatch.msg_listen_native(cls.SOCKF, {
+            MSG_UPPER: handle_upper,
+            MSG_CACHED: (handle_cached, 60000),
+            MSG_PEER: handle_peer,
+        })
+
+    def batch(self, dtype, words):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            replies = dispatch.msg_batch(conn, dtype,
+                                         [encode_struct('s', w)
+                                          for w in words])
+        return [r if r is None else decode_struct('s', r)[0][0]
+                for r in replies]
+
+    def test_order(self):
+        words = ['w%d' % n for n in range(50)]
+        self.assertEqual(self.batch(MSG_UPPER, words),
+                         [w.upper() for w in words])
+
+    def test_empty(self):
+        self.assertEqual(self.batch(MSG_UPPER, []), [])
+
+    def test_status(self):
+        self.assertEqual(self.batch(MSG_UPPER,
+                                    ['ok', 'one', 'fail', 'raise', 'ok']),
+                         ['OK', 'ONE', None, None, 'OK'])
+
+    def test_many_replies(self):
+        # more than one buffer of replies
+        words = ['%05d' % n + 'x' * 200 for n in range(2000)]
+        self.assertEqual(self.batch(MSG_UPPER, words),
+                         [w.upper() for w in words])
+
+    def test_cached(self):
+        before = dispatch.msg_cache_stats()
+        self.assertEqual(self.batch(MSG_CACHED, ['c', 'c', 'd', 'c']),
+                         ['C', 'C', 'D', 'C'])
+        self.assertEqual(calls['c'], 1)
+        self.assertEqual(calls['d'], 1)
+        after = dispatch.msg_cache_stats()
+        self.assertEqual(after['hits'] - before['hits'], 2)
+
+    def test_peerinfo(self):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            replies = dispatch.msg_batch(conn, MSG_PEER, ['', ''])
+        self.assertEqual([decode_struct('q', r)[0][0] for r in replies],
+                         [os.getpid()] * 2)
+
+    def test_unknown_type(self):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            self.assertRaises(IOError, dispatch.msg_batch, conn,
+                              MSG_UNKNOWN, [''])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,150 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+import time
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_REPLY = 8
+MSG_CACHED = 20
+MSG_CACHED_ONE = 21
+MSG_FAILING = 22
+MSG_UNCACHED = 23
+
+TTL = 300
+
+calls = {}
+
+
+def count(key):
+    calls[key] = calls.get(key, 0) + 1
+
+
+def handle_cached(dtype, conn):
+    key = dispatch.msg_read_string(conn)
+    count((dtype, key))
+    dispatch.msg_write_struct(conn, 'Hs', MSG_REPLY, key.upper())
+
+
+def handle_cached_one(dtype, conn):
+    handle_cached(dtype, conn)
+    return 1
+
+
+def handle_failing(dtype, conn):
+    handle_cached(dtype, conn)
+    return -1
+
+
+class CacheTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(CacheTestCase, cls).setUpClass()
+        cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
+        dispatch.msg_init()
+        dispatch.msg_listen_native(cls.SOCKF, {
+            MSG_CACHED: (handle_cached, TTL),
+            MSG_CACHED_ONE: (handle_cached_one, TTL),
+            MSG_FAILING: (handle_failing, TTL),
+            MSG_UNCACHED: handle_cached,
+        })
+
+    def call(self, dtype, key):
+        # the whole request in one write, so it is there to be looked
+        # up when the server peeks
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_struct(conn, 'Hs', dtype, key)
+            return dispatch.msg_read_struct(conn, 'Hs')
+
+    def call_stored(self, dtype, key):
+        # the reply is stored after the client has it, so wait for a
+        # new entry before counting on it
+        entries = dispatch.msg_cache_stats()['entries']
+        reply = self.call(dtype, key)
+        for _ in range(100):
+            if dispatch.msg_cache_stats()['entries'] > entries:
+                break
+            time.sleep(0.01)
+        else:
+            self.fail('%r was never cached' % key)
+        return reply
+
+    def test_hit(self):
+        before = dispatch.msg_cache_stats()
+        self.assertEqual(self.call_stored(MSG_CACHED, 'hit'),
+                         (MSG_REPLY, 'HIT'))
+        self.assertEqual(self.call(MSG_CACHED, 'hit'), (MSG_REPLY, 'HIT'))
+        self.assertEqual(calls[(MSG_CACHED, 'hit')], 1)
+        after = dispatch.msg_cache_stats()
+        self.assertEqual(after['misses'] - before['misses'], 1)
+        self.assertEqual(after['hits'] - before['hits'], 1)
+        self.assertTrue(after['entries'] >= 1)
+        self.assertTrue(after['bytes'] > 0)
+
+    def test_miss(self):
+        self.assertEqual(self.call(MSG_CACHED, 'one'), (MSG_REPLY, 'ONE'))
+        self.assertEqual(self.call(MSG_CACHED, 'two'), (MSG_REPLY, 'TWO'))
+        self.assertEqual(calls[(MSG_CACHED, 'one')], 1)
+        self.assertEqual(calls[(MSG_CACHED, 'two')], 1)
+
+    def test_expiry(self):
+        self.call_stored(MSG_CACHED, 'expiry')
+        self.call(MSG_CACHED, 'expiry')
+        self.assertEqual(calls[(MSG_CACHED, 'expiry')], 1)
+        time.sleep(TTL / 1000.0 + 0.1)
+        self.assertEqual(self.call(MSG_CACHED, 'expiry'),
+                         (MSG_REPLY, 'EXPIRY'))
+        self.assertEqual(calls[(MSG_CACHED, 'expiry')], 2)
+
+    def test_invalidate(self):
+        self.call_stored(MSG_CACHED, 'invalidate')
+        dispatch.msg_cache_invalidate(MSG_CACHED)
+        self.call(MSG_CACHED, 'invalidate')
+        self.assertEqual(calls[(MSG_CACHED, 'invalidate')], 2)
+
+    def test_positive_return(self):
+        self.call_stored(MSG_CACHED_ONE, 'one')
+        self.assertEqual(self.call(MSG_CACHED_ONE, 'one'),
+                         (MSG_REPLY, 'ONE'))
+        self.assertEqual(calls[(MSG_CACHED_ONE, 'one')], 1)
+
+    def test_failure_not_cached(self):
+        self.assertEqual(self.call(MSG_FAILING, 'fail'), (MSG_REPLY, 'FAIL'))
+        self.call(MSG_FAILING, 'fail')
+        self.assertEqual(calls[(MSG_FAILING, 'fail')], 2)
+
+    def test_no_ttl(self):
+        self.call(MSG_UNCACHED, 'uncached')
+        self.call(MSG_UNCACHED, 'uncached')
+        self.assertEqual(calls[(MSG_UNCACHED, 'uncached')], 2)
+
+
+if __name__ == '__main__':
+    unittest.main()
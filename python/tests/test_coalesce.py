@@ -0,0 +1,121 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+import threading
+import time
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_REPLY = 8
+MSG_SLOW = 30
+MSG_SLOW_ONE = 31
+
+CLIENTS = 8
+
+calls = {}
+started = threading.Event()
+release = threading.Event()
+
+
+def handle_slow(dtype, conn):
+    key = dispatch.msg_read_string(conn)
+    calls[(dtype, key)] = calls.get((dtype, key), 0) + 1
+    started.set()
+    release.wait(10)
+    dispatch.msg_write_struct(conn, 'Hs', MSG_REPLY, key.upper())
+
+
+def handle_slow_one(dtype, conn):
+    handle_slow(dtype, conn)
+    return 1
+
+
+class CoalesceTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(CoalesceTestCase, cls).setUpClass()
+        cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
+        dispatch.msg_init()
+        dispatch.msg_listen_native(cls.SOCKF, {
+            MSG_SLOW: (handle_slow, 0, 1),
+            MSG_SLOW_ONE: (handle_slow_one, 0, 1),
+        })
+
+    def setUp(self):
+        super(CoalesceTestCase, self).setUp()
+        started.clear()
+        release.clear()
+
+    def call(self, dtype, key, replies):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_struct(conn, 'Hs', dtype, key)
+            replies.append(dispatch.msg_read_struct(conn, 'Hs'))
+
+    def call_together(self, requests):
+        # the first request gets the handler going, and the rest
+        # arrive while it is still running
+        replies = []
+        threads = [threading.Thread(target=self.call,
+                                    args=(dtype, key, replies))
+                   for dtype, key in requests]
+        threads[0].start()
+        self.assertTrue(started.wait(10))
+        for t in threads[1:]:
+            t.start()
+        time.sleep(0.3)
+        release.set()
+        for t in threads:
+            t.join()
+        return replies
+
+    def test_identical(self):
+        before = dispatch.msg_cache_stats()
+        replies = self.call_together([(MSG_SLOW, 'same')] * CLIENTS)
+        self.assertEqual(replies, [(MSG_REPLY, 'SAME')] * CLIENTS)
+        self.assertEqual(calls[(MSG_SLOW, 'same')], 1)
+        after = dispatch.msg_cache_stats()
+        self.assertEqual(after['coalesced'] - before['coalesced'],
+                         CLIENTS - 1)
+
+    def test_positive_return(self):
+        replies = self.call_together([(MSG_SLOW_ONE, 'one')] * CLIENTS)
+        self.assertEqual(replies, [(MSG_REPLY, 'ONE')] * CLIENTS)
+        self.assertEqual(calls[(MSG_SLOW_ONE, 'one')], 1)
+
+    def test_different(self):
+        replies = self.call_together([(MSG_SLOW, 'a'), (MSG_SLOW, 'b')])
+        self.assertEqual(sorted(replies),
+                         [(MSG_REPLY, 'A'), (MSG_REPLY, 'B')])
+        self.assertEqual(calls[(MSG_SLOW, 'a')], 1)
+        self.assertEqual(calls[(MSG_SLOW, 'b')], 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
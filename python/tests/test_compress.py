@@ -0,0 +1,146 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+import socket
+import threading
+import time
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_REPLY = 8
+MSG_ECHO = 100
+MSG_TEXT = 101
+MSG_PLAIN = 102
+
+TEXT = 'the quick brown fox jumps over the lazy dog\n' * 2500
+
+
+def handle_echo(dtype, conn):
+    data = dispatch.msg_read_bytes(conn)
+    dispatch.msg_write_struct(conn, 'Hs#', MSG_REPLY, data)
+
+
+class OldServer(threading.Thread):
+    """A server from before compression, which answers MSG_TYPE_PING
+    with the 0 alone, and records everything other requests send."""
+    daemon = True
+
+    def __init__(self, path):
+        threading.Thread.__init__(self)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(path)
+        self.sock.listen(16)
+        self.received = []
+
+    def run(self):
+        while True:
+            conn, _ = self.sock.accept()
+            data = ''
+            while True:
+                got = conn.recv(65536)
+                if not got:
+                    break
+                data += got
+                if data[2:4] == '\xff\xfe':
+                    conn.sendall('\0')
+                    break
+            if data[2:4] != '\xff\xfe':
+                self.received.append(data)
+            conn.close()
+
+
+class CompressTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(CompressTestCase, cls).setUpClass()
+        cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
+        dispatch.msg_init(account=1)
+        # each test that counts bytes has a type of its own
+        dispatch.msg_listen_native(cls.SOCKF, {
+            MSG_ECHO: handle_echo,
+            MSG_TEXT: handle_echo,
+            MSG_PLAIN: handle_echo,
+        })
+
+    def echo(self, data, flags=dispatch.MSG_COMPRESS, dtype=MSG_ECHO):
+        conn = dispatch.open('', self.SOCKF, flags)
+        with conn:
+            dispatch.msg_write_struct(conn, 'Hs#', dtype, data)
+            return dispatch.msg_read_struct(conn, 'Hs#')
+
+    def bytes_in(self, dtype):
+        # a request is counted after the client has its reply
+        for _ in range(100):
+            usage = dict(dispatch.msg_usage_types())
+            if dtype in usage:
+                return usage[dtype]['bytes_in']
+            time.sleep(0.01)
+        self.fail('the request was never counted')
+
+    def test_text(self):
+        self.assertEqual(self.echo(TEXT, dtype=MSG_TEXT), (MSG_REPLY, TEXT))
+        self.assertTrue(self.bytes_in(MSG_TEXT) < len(TEXT) / 10)
+
+    def test_uncompressed(self):
+        self.assertEqual(self.echo(TEXT, 0, MSG_PLAIN), (MSG_REPLY, TEXT))
+        self.assertTrue(self.bytes_in(MSG_PLAIN) > len(TEXT))
+
+    def test_old_server(self):
+        # never sent compressed data it can't read
+        path = os.path.join(self.TEMP, 'old.sock')
+        server = OldServer(path)
+        server.start()
+        conn = dispatch.open('', path, dispatch.MSG_COMPRESS)
+        with conn:
+            dispatch.msg_write_struct(conn, 'Hs#', MSG_ECHO, TEXT)
+        for _ in range(100):
+            if server.received:
+                break
+            time.sleep(0.01)
+        self.assertEqual(len(server.received), 1)
+        self.assertTrue(TEXT in server.received[0])
+
+    def test_random(self):
+        data = os.urandom(100000)
+        self.assertEqual(self.echo(data), (MSG_REPLY, data))
+
+    def test_short(self):
+        self.assertEqual(self.echo('short'), (MSG_REPLY, 'short'))
+
+    def test_empty(self):
+        self.assertEqual(self.echo(''), (MSG_REPLY, ''))
+
+    def test_many(self):
+        for n in (1023, 1024, 1025, 65535, 65536, 65537, 1 << 20):
+            data = TEXT[:n] if n <= len(TEXT) else 'x' * n
+            self.assertEqual(self.echo(data), (MSG_REPLY, data))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+import socket
+import threading
+import time
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_WHO = 70
+
+NAMES = ['a', 'b', 'c']
+
+
+def handle_who(dtype, conn):
+    # which of the listeners this is
+    sock = socket.fromfd(conn.fileno(), socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        path = sock.getsockname()
+    finally:
+        sock.close()
+    dispatch.msg_write_string(conn, os.path.basename(path))
+
+
+class RawServer(threading.Thread):
+    """Records the header and type each client sends, and answers
+    with a 0 byte."""
+    daemon = True
+
+    def __init__(self, path):
+        threading.Thread.__init__(self)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(path)
+        self.sock.listen(16)
+        self.received = []
+
+    def run(self):
+        while True:
+            conn, _ = self.sock.accept()
+            data = ''
+            while len(data) < 4:
+                got = conn.recv(4 - len(data))
+                if not got:
+                    break
+                data += got
+            self.received.append(data)
+            conn.sendall('\0')
+            conn.close()
+
+
+class GroupTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(GroupTestCase, cls).setUpClass()
+        dispatch.msg_init()
+        cls.SERVICES = [os.path.join(cls.TEMP, name) for name in NAMES]
+        for service in cls.SERVICES:
+            dispatch.msg_listen_native(service, {MSG_WHO: handle_who})
+        cls.MISSING = os.path.join(cls.TEMP, 'missing')
+
+    def who(self, conn):
+        with conn:
+            dispatch.msg_write_type(conn, MSG_WHO)
+            return dispatch.msg_read_string(conn)
+
+    def test_round_robin(self):
+        group = dispatch.Group(self.SERVICES)
+        self.assertEqual([self.who(group.open()) for _ in range(6)],
+                         NAMES * 2)
+
+    def test_hash(self):
+        group = dispatch.Group(self.SERVICES, dispatch.MSG_GROUP_HASH)
+        for key in ('k1', 'k2', 'k3'):
+            first = self.who(group.open(key))
+            for _ in range(5):
+                self.assertEqual(self.who(group.open(key)), first)
+        seen = set(self.who(group.open('key %d' % n)) for n in range(30))
+        self.assertTrue(len(seen) > 1)
+
+    def test_hash_member_down(self):
+        # only the keys of the member that is down move
+        group = dispatch.Group(self.SERVICES + [self.MISSING],
+                               dispatch.MSG_GROUP_HASH)
+        for n in range(30):
+            self.assertTrue(self.who(group.open('key %d' % n)) in NAMES)
+
+    def test_member_down(self):
+        group = dispatch.Group([self.SERVICES[0], self.MISSING,
+                                self.SERVICES[2]])
+        seen = [self.who(group.open()) for _ in range(6)]
+        self.assertEqual(set(seen), set(['a', 'c']))
+
+    def test_all_down(self):
+        group = dispatch.Group([self.MISSING])
+        self.assertRaises(OSError, group.open)
+
+    def test_least_outstanding(self):
+        group = dispatch.Group(self.SERVICES,
+                               dispatch.MSG_GROUP_LEAST_OUTSTANDING)
+        held = [group.open() for _ in NAMES]
+        self.assertEqual(sorted(self.who(conn) for conn in held), NAMES)
+
+    def test_two_choices(self):
+        # whichever two it looks at, one of them is idle
+        group = dispatch.Group(self.SERVICES, dispatch.MSG_GROUP_TWO_CHOICES)
+        for _ in range(10):
+            held = [group.open(), group.open()]
+            self.assertNotEqual(self.who(held[0]), self.who(held[1]))
+
+    def test_outlives_group(self):
+        conn = dispatch.Group(self.SERVICES).open()
+        self.assertEqual(self.who(conn), 'a')
+
+    def test_ping(self):
+        path = os.path.join(self.TEMP, 'raw')
+        server = RawServer(path)
+        server.start()
+        group = dispatch.Group([path], interval=50)
+        time.sleep(0.3)
+        del group
+        # the ping carries no deadline, so any server can read it
+        self.assertTrue(len(server.received) >= 2)
+        for data in server.received:
+            self.assertEqual(data, '\x01\x00\xff\xfe')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,129 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import errno
+import os
+import subprocess
+import sys
+import threading
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_WHO = 90
+
+OWN_ANSWER = 4242
+
+# the tests run from a directory of their own
+SCRIPT = os.path.abspath(__file__)
+
+
+def who(name):
+    def handle_who(dtype, conn):
+        dispatch.msg_write_string(conn, name)
+    return handle_who
+
+
+def serve(service, handoff, handler):
+    """The server being taken over, run in a process of its own.  It
+    exits once its handler for MSG_TYPE_HANDOFF has run."""
+    done = threading.Event()
+
+    def handle_cue(dtype, conn):
+        done.set()
+
+    def handle_own(dtype, conn):
+        dispatch.msg_write_int32(conn, OWN_ANSWER)
+        done.set()
+
+    handlers = {MSG_WHO: who('old')}
+    if handler == 'cue':
+        handlers[dispatch.MSG_TYPE_HANDOFF] = handle_cue
+    elif handler == 'own':
+        handlers[dispatch.MSG_TYPE_HANDOFF] = handle_own
+    dispatch.msg_init(handoff=handoff)
+    dispatch.msg_listen_native(service, handlers)
+    sys.stdout.write('ready\n')
+    sys.stdout.flush()
+    sys.exit(0 if done.wait(30) else 1)
+
+
+class HandoffTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(HandoffTestCase, cls).setUpClass()
+        dispatch.msg_init()
+
+    def spawn(self, name, handoff, handler):
+        service = os.path.join(self.TEMP, name)
+        child = subprocess.Popen([sys.executable, SCRIPT, 'serve',
+                                  service, str(handoff), handler],
+                                 stdout=subprocess.PIPE)
+        self.assertEqual(child.stdout.readline(), 'ready\n')
+        return service, child
+
+    def who(self, service):
+        conn = dispatch.open('', service)
+        with conn:
+            dispatch.msg_write_type(conn, MSG_WHO)
+            return dispatch.msg_read_string(conn)
+
+    def test_handoff(self):
+        service, child = self.spawn('h.sock', 1, 'cue')
+        self.assertEqual(self.who(service), 'old')
+        fd = dispatch.msg_handoff_receive(service)
+        dispatch.msg_listen_native_fd(fd, {MSG_WHO: who('new')})
+        # the handler is the old server's cue to go
+        self.assertEqual(child.wait(), 0)
+        self.assertEqual(self.who(service), 'new')
+
+    def test_own_handler(self):
+        # without handoff enabled, the type is the application's
+        service, child = self.spawn('own.sock', 0, 'own')
+        conn = dispatch.open('', service)
+        with conn:
+            dispatch.msg_write_type(conn, dispatch.MSG_TYPE_HANDOFF)
+            self.assertEqual(dispatch.msg_read_int32(conn), OWN_ANSWER)
+        self.assertEqual(child.wait(), 0)
+
+    def test_disabled(self):
+        # a server without handoff refuses, and keeps serving
+        service, child = self.spawn('off.sock', 0, 'none')
+        try:
+            with self.assertRaises(OSError) as raised:
+                dispatch.msg_handoff_receive(service)
+            self.assertEqual(raised.exception.errno, errno.EOPNOTSUPP)
+            self.assertEqual(self.who(service), 'old')
+            self.assertEqual(child.poll(), None)
+        finally:
+            child.kill()
+            child.wait()
+
+if __name__ == '__main__':
+    if sys.argv[1:2] == ['serve']:
+        serve(sys.argv[2], int(sys.argv[3]), sys.argv[4])
+    unittest.main()
@@ -0,0 +1,123 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import os
+import socket
+import time
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_WHO = 80
+
+NAMES = ['a', 'b']
+
+# name -> (seconds before answering, hang up instead)
+behaviour = {}
+
+
+def handle_who(dtype, conn):
+    sock = socket.fromfd(conn.fileno(), socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        name = os.path.basename(sock.getsockname())
+    finally:
+        sock.close()
+    delay, hang_up = behaviour.get(name, (0, False))
+    time.sleep(delay)
+    if hang_up:
+        return -1
+    try:
+        dispatch.msg_write_string(conn, name)
+    except IOError:
+        # the other member answered first
+        pass
+
+
+class HedgeTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(HedgeTestCase, cls).setUpClass()
+        dispatch.msg_init()
+        cls.SERVICES = [os.path.join(cls.TEMP, name) for name in NAMES]
+        for service in cls.SERVICES:
+            dispatch.msg_listen_native(service, {MSG_WHO: handle_who})
+
+    def setUp(self):
+        super(HedgeTestCase, self).setUp()
+        behaviour.clear()
+
+    def group(self, budget=100, hedge=True):
+        group = dispatch.Group(self.SERVICES)
+        if hedge:
+            group.hedge(MSG_WHO)
+        group.hedging(95, budget, 20)
+        # there is no hedging until enough reply times are known
+        for _ in range(64):
+            self.call(group)
+        return group
+
+    def call(self, group):
+        start = time.time()
+        conn = group.call(MSG_WHO, '')
+        with conn:
+            return dispatch.msg_read_string(conn), time.time() - start
+
+    def test_hedged(self):
+        group = self.group()
+        behaviour['a'] = (0.5, False)
+        for _ in range(4):
+            name, took = self.call(group)
+            self.assertEqual(name, 'b')
+            self.assertTrue(took < 0.4)
+
+    def test_not_marked(self):
+        group = self.group(hedge=False)
+        behaviour['a'] = (0.5, False)
+        replies = [self.call(group) for _ in NAMES]
+        self.assertEqual(sorted(name for name, took in replies), NAMES)
+        self.assertTrue(max(took for name, took in replies) >= 0.5)
+
+    def test_no_budget(self):
+        group = self.group(budget=0)
+        behaviour['a'] = (0.5, False)
+        replies = [self.call(group) for _ in NAMES]
+        self.assertEqual(sorted(name for name, took in replies), NAMES)
+        self.assertTrue(max(took for name, took in replies) >= 0.5)
+
+    def test_hung_up(self):
+        # a hangs up without answering, after the hedge has gone out,
+        # whichever of the two went first
+        group = self.group()
+        behaviour['a'] = (0.1, True)
+        behaviour['b'] = (0.3, False)
+        for _ in range(4):
+            name, took = self.call(group)
+            self.assertEqual(name, 'b')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,176 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import errno
+import imp
+import os
+import shutil
+import subprocess
+import tempfile
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+IDL = os.environ.get('DISPATCH_IDL',
+                     os.path.abspath(os.path.join('..', 'tools',
+                                                  'dispatch-idl')))
+
+SCHEMA = """
+# Every field type, with fixed width runs split up by other types.
+message record = 20
+{
+  uint8 a;
+  uint16 b;
+  int32 c;
+  uint32 d;
+  int64 e;
+  uint64 f;
+  varuint32 g;
+  varint32 h;
+  varuint64 i;
+  varint64 j;
+  string name;
+  string missing;
+  buffer data;
+  uint16[] shorts;
+  int64[] longs;
+  string[] tags;
+  uint32 tail;
+}
+
+message counter = 21
+{
+  varint64 value;
+}
+"""
+
+
+def generate():
+    td = tempfile.mkdtemp(suffix='idl')
+    try:
+        with open(os.path.join(td, 'records.idl'), 'w') as fh:
+            fh.write(SCHEMA)
+        subprocess.check_call([IDL, '-p', '-o', td,
+                               os.path.join(td, 'records.idl')])
+        return imp.load_source('records', os.path.join(td, 'records.py'))
+    finally:
+        shutil.rmtree(td)
+
+records = generate()
+
+
+def handle_record(dtype, conn):
+    rec = records.Record.read(conn)
+    rec.tags = list(reversed(rec.tags))
+    rec.tail += 1
+    rec.write(conn)
+
+
+def handle_counter(dtype, conn):
+    counter = records.Counter.read(conn)
+    counter.value -= 1
+    counter.write(conn)
+
+
+def sample():
+    return records.Record(a=0xFF, b=0xFFFF, c=-5, d=0xFFFFFFFF,
+                          e=-(1 << 63), f=(1 << 64) - 1,
+                          g=300, h=-300, i=1 << 40, j=-(1 << 40),
+                          name='x' * 300, missing=None, data='\0\1\2',
+                          shorts=[1, 2, 65535], longs=[-1, 1 << 62],
+                          tags=['a', None, ''], tail=7)
+
+
+class IdlTestCase(TestCase):
+    @classmethod
+    def server_handlers(self):
+        return {
+            records.Record.TYPE: handle_record,
+            records.Counter.TYPE: handle_counter,
+        }
+
+    def assertSameRecord(self, r1, r2):
+        for field in records.Record.__slots__:
+            self.assertEqual(getattr(r1, field), getattr(r2, field))
+
+    def test_types(self):
+        self.assertEqual(records.Record.TYPE, 20)
+        self.assertEqual(records.Counter.TYPE, 21)
+
+    def test_roundtrip(self):
+        rec = sample()
+        self.assertSameRecord(records.Record.decode(rec.encode()), rec)
+
+    def test_defaults(self):
+        rec = records.Record.decode(records.Record().encode())
+        self.assertEqual(rec.a, 0)
+        self.assertEqual(rec.name, None)
+        self.assertEqual(rec.data, '')
+        self.assertEqual(rec.shorts, [])
+        self.assertEqual(rec.tags, [])
+
+    def test_wire_format(self):
+        # One byte of zigzag varint, and the special length for NULL.
+        self.assertEqual(records.Counter(value=-1).encode(), '\x01')
+        self.assertEqual(records.Counter(value=64).encode(), '\x80\x01')
+        rec = records.Record(name='hi')
+        body = rec.encode()
+        self.assertEqual(body[27:27 + 4 + 3], '\0\0\0\0\x02hi')
+        self.assertEqual(body[34], '\xe1')
+
+    def test_trailing_fields_ignored(self):
+        counter = records.Counter.decode('\x06extra')
+        self.assertEqual(counter.value, 3)
+
+    def test_malformed(self):
+        body = sample().encode()
+        for cut in (0, 10, 30, len(body) - 1):
+            try:
+                records.Record.decode(body[:cut])
+                self.fail('decoded a truncated message')
+            except IOError as err:
+                self.assertEqual(err.errno, errno.EPROTO)
+
+    def test_over_connection(self):
+        rec = sample()
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, records.Record.TYPE)
+            rec.write(conn)
+            reply = records.Record.read(conn)
+        self.assertEqual(reply.tags, ['', None, 'a'])
+        self.assertEqual(reply.tail, 8)
+        reply.tags.reverse()
+        reply.tail = 7
+        self.assertSameRecord(reply, rec)
+
+    def test_counter(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, records.Counter.TYPE)
+            records.Counter(value=-(1 << 62)).write(conn)
+            self.assertEqual(records.Counter.read(conn).value,
+                             -(1 << 62) - 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import errno
+import os
+import time
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+QUEUE = 4
+SUBSCRIBERS = 8
+MESSAGES = 200
+BIG = 'x' * 65536
+
+
+class PubSubTestCase(TestCase):
+    SERVE = False
+
+    @classmethod
+    def setUpClass(cls):
+        super(PubSubTestCase, cls).setUpClass()
+        cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
+        dispatch.msg_init(publish=1, publish_queue=QUEUE,
+                          publish_subscribers=SUBSCRIBERS)
+        dispatch.msg_listen_native(cls.SOCKF, {})
+
+    def subscribe(self, topic, count):
+        subs = [dispatch.msg_subscribe(self.SOCKF, topic)
+                for _ in range(count)]
+        # subscribing is done by the server in its own time, so
+        # publish until everyone is there to hear it
+        for _ in range(100):
+            if dispatch.msg_publish(topic, 'ready') == count:
+                return subs
+            time.sleep(0.01)
+        self.fail('subscribers to %s never arrived' % topic)
+
+    def read(self, sub):
+        data = dispatch.msg_subscription_read(sub)
+        while data == 'ready':
+            data = dispatch.msg_subscription_read(sub)
+        return data
+
+    def test_fan_out(self):
+        news = self.subscribe('news', 3)
+        sport = self.subscribe('sport', 1)
+        self.assertEqual(dispatch.msg_publish('news', 'n1'), 3)
+        self.assertEqual(dispatch.msg_publish('news', 'n2'), 3)
+        self.assertEqual(dispatch.msg_publish('sport', 's1'), 1)
+        self.assertEqual(dispatch.msg_publish('weather', 'w1'), 0)
+        for sub in news:
+            self.assertEqual(self.read(sub), 'n1')
+            self.assertEqual(self.read(sub), 'n2')
+        self.assertEqual(self.read(sport[0]), 's1')
+        for sub in news + sport:
+            sub.close()
+
+    def test_closed_subscriber(self):
+        sub, = self.subscribe('closed', 1)
+        sub.close()
+        for _ in range(100):
+            if dispatch.msg_publish('closed', 'gone') == 0:
+                break
+            time.sleep(0.01)
+        else:
+            self.fail('closed subscriber was kept')
+
+    def test_too_many(self):
+        # earlier tests' subscribers go in the server's own time
+        subs = []
+        with self.assertRaises(OSError) as raised:
+            while True:
+                subs.append(dispatch.msg_subscribe(self.SOCKF, 'many'))
+        self.assertEqual(raised.exception.errno, errno.EAGAIN)
+        self.assertTrue(len(subs) <= SUBSCRIBERS)
+        self.assertTrue(len(subs) > 0)
+        for sub in subs:
+            sub.close()
+        # and their places are given back once they have gone
+        for _ in range(100):
+            try:
+                sub = dispatch.msg_subscribe(self.SOCKF, 'many')
+            except OSError:
+                time.sleep(0.01)
+                continue
+            sub.close()
+            break
+        else:
+            self.fail('closed subscribers kept their places')
+
+    def test_slow_subscriber(self):
+        sub, = self.subscribe('slow', 1)
+        # once the socket is full and QUEUE are waiting, the rest are
+        # dropped rather than queued
+        queued = [dispatch.msg_publish('slow', '%d %s' % (n, BIG))
+                  for n in range(MESSAGES)]
+        self.assertTrue(0 in queued)
+        seen = []
+        ended = False
+        while True:
+            if not ended:
+                ended = dispatch.msg_publish('slow', 'end') == 1
+            data = self.read(sub)
+            if data == 'end':
+                break
+            seen.append(int(data.split()[0]))
+        self.assertTrue(ended)
+        self.assertEqual(seen, sorted(seen))
+        self.assertEqual(len(seen), sum(queued))
+        self.assertTrue(len(seen) < MESSAGES)
+        sub.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -23,11 +23,16 @@ try:
     import unittest2 as unittest
 except ImportError:
     import unittest
+import array
+import errno
+import mmap
 import os
 import tempfile
 import shutil
 import subprocess
 import signal
+import socket
+import struct
 import time
 
 import dsdispatch as dispatch
@@ -42,6 +47,7 @@ class TestCase(unittest.TestCase):
     TEMP = None
     SERVE = True
     SOCKF = None
+    DISPATCHER = dispatch.Dispatcher
 
     @classmethod
     def setUpClass(cls):
@@ -74,7 +80,7 @@ class TestCase(unittest.TestCase):
         if cls.SOCKF is None:
             cls.SOCKF = os.path.join(cls.TEMP, 'd.sock')
         h = cls.server_handlers()
-        cls._d = dispatch.Dispatcher(h)
+        cls._d = cls.DISPATCHER(h)
         cls._d.timeout = 1
         cls._d.serve('', cls.SOCKF)
 
@@ -208,10 +214,396 @@ class EchoTestCase(TestCase):
             self.assertEqual(r3, 0xA)
 
 
+MSG_STRUCT = 12
+MSG_STRUCT_MIXED = 13
+MSG_STRUCT_FD = 14
+
+STRUCT_FMT = 'BHiIqQvVss#2H'
+
+
+def handle_struct(dtype, conn):
+    values = dispatch.msg_read_struct(conn, STRUCT_FMT)
+    dispatch.msg_write_type(conn, MSG_REPLY)
+    dispatch.msg_write_struct(conn, STRUCT_FMT, *values)
+
+
+def handle_struct_mixed(dtype, conn):
+    # the same wire format as the single value functions
+    v1 = dispatch.msg_read_string(conn)
+    v2 = dispatch.msg_read_int64(conn)
+    v3 = dispatch.msg_read_bytes(conn)
+    dispatch.msg_write_struct(conn, 'H s q s#', MSG_REPLY, v1, v2, v3)
+
+
+def handle_struct_fd(dtype, conn):
+    before, fd, after = dispatch.msg_read_struct(conn, 'IfI')
+    with os.fdopen(fd, 'w') as fh:
+        fh.write('%d' % (before + after))
+    dispatch.msg_write_struct(conn, 'H', MSG_REPLY)
+
+
+class StructTestCase(TestCase):
+    @classmethod
+    def server_handlers(self):
+        return {
+            MSG_STRUCT: handle_struct,
+            MSG_STRUCT_MIXED: handle_struct_mixed,
+            MSG_STRUCT_FD: handle_struct_fd,
+        }
+
+    def test_roundtrip(self):
+        values = (0xFF, 0xFFFF, -(1 << 31), 0xFFFFFFFF, -(1 << 63),
+                  (1 << 64) - 1, -300, 1 << 40, 'Hello World', '\0\1\2',
+                  1, 2)
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, MSG_STRUCT)
+            dispatch.msg_write_struct(conn, STRUCT_FMT, *values)
+            self.assertEqual(dispatch.msg_read_type(conn), MSG_REPLY)
+            self.assertEqual(dispatch.msg_read_struct(conn, STRUCT_FMT),
+                             values)
+
+    def test_none_and_empty(self):
+        values = (0, 0, 0, 0, 0, 0, 0, 0, None, '', 0, 0)
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, MSG_STRUCT)
+            dispatch.msg_write_struct(conn, STRUCT_FMT, *values)
+            self.assertEqual(dispatch.msg_read_type(conn), MSG_REPLY)
+            self.assertEqual(dispatch.msg_read_struct(conn, STRUCT_FMT),
+                             values)
+
+    def test_mixed(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_struct(conn, 'Hsqs#', MSG_STRUCT_MIXED,
+                                      'x' * 5000, -7, bytearray('abc'))
+            self.assertEqual(dispatch.msg_read_struct(conn, 'H'),
+                             (MSG_REPLY,))
+            self.assertEqual(dispatch.msg_read_string(conn), 'x' * 5000)
+            self.assertEqual(dispatch.msg_read_int64(conn), -7)
+            self.assertEqual(dispatch.msg_read_bytes(conn), 'abc')
+
+    def test_fd(self):
+        rfd, wfd = os.pipe()
+        try:
+            with dispatch.open('', self.SOCKF) as conn:
+                dispatch.msg_write_struct(conn, 'HIfI', MSG_STRUCT_FD,
+                                          40, wfd, 2)
+                os.close(wfd)
+                wfd = -1
+                self.assertEqual(dispatch.msg_read_struct(conn, 'H'),
+                                 (MSG_REPLY,))
+            self.assertEqual(os.read(rfd, 16), '42')
+        finally:
+            os.close(rfd)
+            if wfd >= 0:
+                os.close(wfd)
+
+    def test_eof(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_struct(conn, 'Hsqs#', MSG_STRUCT_MIXED,
+                                      'abc', 1, 'def')
+            try:
+                dispatch.msg_read_struct(conn, 'Hsqs#s')
+                self.fail('read past the end of the connection')
+            except IOError as err:
+                self.assertEqual(err.errno, errno.EPIPE)
+
+    def test_bad_arguments(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            self.assertRaises(ValueError, dispatch.msg_write_struct,
+                              conn, 'Hx', 1, 2)
+            self.assertRaises(ValueError, dispatch.msg_read_struct,
+                              conn, 'H3')
+            self.assertRaises(TypeError, dispatch.msg_write_struct,
+                              conn, 'HH', 1)
+            self.assertRaises(OverflowError, dispatch.msg_write_struct,
+                              conn, 'B', 256)
+            self.assertRaises(OverflowError, dispatch.msg_write_struct,
+                              conn, 'I', -1)
+            self.assertRaises(TypeError, dispatch.msg_write_struct,
+                              conn, 'I', 1.5)
+            self.assertRaises(TypeError, dispatch.msg_write_struct,
+                              conn, 's', 'a\0b')
+
+
 class EchoAbstractTestCase(EchoTestCase):
     """Run the same tests as EchoTestCase, with abstract unix sockets."""
     SOCKF = '@/tmp/dispatch/EchoAbstractTestCase'
 
 
+
+MSG_BYTES = 16
+
+
+def handle_bytes(dtype, conn):
+    buf = bytearray(64)
+    n = dispatch.msg_read_bytes_into(conn, buf)
+    dispatch.msg_write_type(conn, MSG_REPLY)
+    dispatch.msg_write_bytes(conn, memoryview(buf)[:n])
+    dispatch.msg_write_uint8(conn, n)
+
+
+class BytesTestCase(TestCase):
+    @classmethod
+    def server_handlers(self):
+        return {
+            MSG_BYTES: handle_bytes,
+        }
+
+    def roundtrip(self, data, into):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, MSG_BYTES)
+            dispatch.msg_write_bytes(conn, data)
+            self.assertEqual(dispatch.msg_read_type(conn), MSG_REPLY)
+            n = dispatch.msg_read_bytes_into(conn, into)
+            self.assertEqual(dispatch.msg_read_uint8(conn), n)
+            return n
+
+    def test_bytearray(self):
+        buf = bytearray('x' * 8)
+        self.assertEqual(self.roundtrip('abc', buf), 3)
+        self.assertEqual(buf, bytearray('abcxxxxx'))
+
+    def test_memoryview(self):
+        buf = bytearray(8)
+        self.assertEqual(self.roundtrip(bytearray('abcd'),
+                                        memoryview(buf)[2:6]), 4)
+        self.assertEqual(buf, bytearray('\0\0abcd\0\0'))
+
+    def test_mmap(self):
+        buf = mmap.mmap(-1, 4096)
+        try:
+            self.assertEqual(self.roundtrip(memoryview('\1\2\3'), buf), 3)
+            self.assertEqual(buf[:4], '\1\2\3\0')
+        finally:
+            buf.close()
+
+    def test_array(self):
+        buf = array.array('B', [0] * 4)
+        self.assertEqual(self.roundtrip(array.array('B', [7, 8]), buf), 2)
+        self.assertEqual(buf.tolist(), [7, 8, 0, 0])
+
+    def test_empty(self):
+        buf = bytearray(0)
+        self.assertEqual(self.roundtrip('', buf), 0)
+
+    def test_too_small(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, MSG_BYTES)
+            dispatch.msg_write_bytes(conn, 'abcdef')
+            self.assertEqual(dispatch.msg_read_type(conn), MSG_REPLY)
+            self.assertRaises(ValueError, dispatch.msg_read_bytes_into,
+                              conn, bytearray(4))
+            # the bytes were skipped, not left half read
+            self.assertEqual(dispatch.msg_read_uint8(conn), 6)
+
+    def test_struct(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_struct(conn, 'Hs#', MSG_BYTES,
+                                      memoryview('abcdef'))
+            self.assertEqual(dispatch.msg_read_struct(conn, 'Hs#B'),
+                             (MSG_REPLY, 'abcdef', 6))
+
+    def test_read_only(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            self.assertRaises(BufferError, dispatch.msg_read_bytes_into,
+                              conn, 'abc')
+
+
+class PythonDispatcher(dispatch.Dispatcher):
+    """Overriding handle() keeps serving in Python."""
+    def handle(self, conn, typeval, handler):
+        dispatch.Dispatcher.handle(self, conn, typeval, handler)
+
+
+class EchoPythonTestCase(EchoTestCase):
+    """Run the same tests as EchoTestCase, serving from Python."""
+    DISPATCHER = PythonDispatcher
+
+
+MSG_SLOW = 15
+
+
+class PoolDispatcher(dispatch.Dispatcher):
+    max_threads = 2
+
+
+class PoolTestCase(TestCase):
+    DISPATCHER = PoolDispatcher
+    lock = threading.Lock()
+    running = 0
+    peak = 0
+
+    @classmethod
+    def server_handlers(cls):
+        def handle_slow(dtype, conn):
+            with cls.lock:
+                cls.running += 1
+                cls.peak = max(cls.peak, cls.running)
+            time.sleep(0.1)
+            with cls.lock:
+                cls.running -= 1
+            dispatch.msg_write_type(conn, MSG_REPLY)
+        return {
+            MSG_SLOW: handle_slow,
+        }
+
+    def test_native(self):
+        self.assertTrue(self._d._native())
+        self.assertFalse(PythonDispatcher({})._native())
+
+    def test_max_threads(self):
+        replies = []
+
+        def call():
+            with dispatch.open('', self.SOCKF) as conn:
+                dispatch.msg_write_type(conn, MSG_SLOW)
+                replies.append(dispatch.msg_read_type(conn))
+
+        clients = [threading.Thread(target=call) for i in range(6)]
+        for t in clients:
+            t.start()
+        for t in clients:
+            t.join()
+        self.assertEqual(replies, [MSG_REPLY] * 6)
+        self.assertEqual(self.peak, 2)
+
+    def test_unknown_type(self):
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, 999)
+            self.assertRaises(IOError, dispatch.msg_read_type, conn)
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, MSG_SLOW)
+            self.assertEqual(dispatch.msg_read_type(conn), MSG_REPLY)
+
+MSG_PID = 17
+MSG_CRASH = 18
+
+
+class PreforkDispatcher(dispatch.Dispatcher):
+    processes = 2
+    max_threads = 1
+    restart_delay = 0.2
+
+
+class PreforkTestCase(TestCase):
+    DISPATCHER = PreforkDispatcher
+
+    @classmethod
+    def server_handlers(cls):
+        def handle_pid(dtype, conn):
+            time.sleep(0.2)
+            dispatch.msg_write_uint32(conn, os.getpid())
+
+        def handle_crash(dtype, conn):
+            os._exit(3)
+        return {
+            MSG_PID: handle_pid,
+            MSG_CRASH: handle_crash,
+        }
+
+    def pids(self, count):
+        pids = []
+
+        def call():
+            with dispatch.open('', self.SOCKF) as conn:
+                dispatch.msg_write_type(conn, MSG_PID)
+                pids.append(dispatch.msg_read_uint32(conn))
+
+        clients = [threading.Thread(target=call) for i in range(count)]
+        for t in clients:
+            t.start()
+        for t in clients:
+            t.join()
+        self.assertEqual(len(pids), count)
+        return set(pids)
+
+    def test_workers(self):
+        # each worker takes one request at a time, so both are needed
+        pids = self.pids(4)
+        self.assertEqual(len(pids), 2)
+        self.assertNotIn(os.getpid(), pids)
+
+    def test_restart(self):
+        before = self.pids(4)
+        with dispatch.open('', self.SOCKF) as conn:
+            dispatch.msg_write_type(conn, MSG_CRASH)
+            self.assertRaises(IOError, dispatch.msg_read_type, conn)
+        time.sleep(0.5)
+        after = self.pids(4)
+        self.assertEqual(len(after), 2)
+        self.assertEqual(len(before & after), 1)
+
+MSG_DEADLINE = 19
+MSG_STALL = 20
+
+
+class DeadlineTestCase(TestCase):
+    calls = []
+
+    @classmethod
+    def server_handlers(cls):
+        def handle_deadline(dtype, conn):
+            cls.calls.append(dtype)
+            remaining = dispatch.msg_deadline_remaining(conn)
+            dispatch.msg_write_int32(conn, -1 if remaining is None
+                                     else remaining)
+
+        def handle_stall(dtype, conn):
+            time.sleep(0.5)
+        return {
+            MSG_DEADLINE: handle_deadline,
+            MSG_STALL: handle_stall,
+        }
+
+    def call(self, timeout=None):
+        with dispatch.open('', self.SOCKF, timeout=timeout) as conn:
+            dispatch.msg_write_type(conn, MSG_DEADLINE)
+            return dispatch.msg_read_int32(conn)
+
+    def test_no_deadline(self):
+        self.assertEqual(self.call(), -1)
+
+    def test_remaining(self):
+        remaining = self.call(timeout=5000)
+        self.assertTrue(0 < remaining <= 5000, remaining)
+
+    def raw_call(self, left):
+        # a deadline straight onto the wire, as nanoseconds left
+        sock = socket.socket(socket.AF_UNIX)
+        try:
+            sock.connect(self.SOCKF)
+            sock.sendall(struct.pack('>BBQH', 1, 0x10, left, MSG_DEADLINE))
+            return sock.recv(4)
+        finally:
+            sock.close()
+
+    def test_expired(self):
+        calls = len(self.calls)
+        self.assertEqual(self.raw_call(0), '')
+        self.assertEqual(len(self.calls), calls)
+        self.assertEqual(self.call(), -1)
+
+    def test_own_clock(self):
+        # what is left counts from the server's clock, whatever the
+        # client's reads
+        remaining, = struct.unpack('>i', self.raw_call(3000000000))
+        self.assertTrue(2000 < remaining <= 3000, remaining)
+
+    def test_stalled_peer(self):
+        start = time.time()
+        with dispatch.open('', self.SOCKF, timeout=100) as conn:
+            dispatch.msg_write_type(conn, MSG_STALL)
+            try:
+                dispatch.msg_read_type(conn)
+                self.fail('read past the deadline')
+            except IOError as err:
+                self.assertEqual(err.errno, errno.ETIMEDOUT)
+        self.assertTrue(time.time() - start < 0.4)
+
+
+class DeadlinePythonTestCase(DeadlineTestCase):
+    DISPATCHER = PythonDispatcher
+    SOCKF = None
+
 if __name__ == '__main__':
     unittest.main()
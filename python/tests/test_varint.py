@@ -0,0 +1,138 @@
+#!/usr/bin/env python2
+#
+# Python language wrapper for low-level dispatch functions
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#
+
+
+try:
+    import unittest2 as unittest
+except ImportError:
+    import unittest
+import errno
+
+import dsdispatch as dispatch
+from test_threaded import TestCase
+
+
+MSG_ECHO = 110
+MSG_RAW = 111
+MSG_WIDE = 112
+
+CODECS = [
+    (dispatch.msg_read_varuint32, dispatch.msg_write_varuint32),
+    (dispatch.msg_read_varint32, dispatch.msg_write_varint32),
+    (dispatch.msg_read_varuint64, dispatch.msg_write_varuint64),
+    (dispatch.msg_read_varint64, dispatch.msg_write_varint64),
+]
+VARUINT32, VARINT32, VARUINT64, VARINT64 = range(len(CODECS))
+
+# too wide for the 32 bit readers
+WIDE = [
+    (dispatch.msg_write_varuint64, 1 << 32, dispatch.msg_read_varuint32),
+    (dispatch.msg_write_varint64, 1 << 31, dispatch.msg_read_varint32),
+    (dispatch.msg_write_varint64, -(1 << 31) - 1, dispatch.msg_read_varint32),
+]
+
+
+def handle_echo(dtype, conn):
+    read, write = CODECS[dispatch.msg_read_uint8(conn)]
+    count = dispatch.msg_read_uint32(conn)
+    values = [read(conn) for _ in range(count)]
+    for value in values:
+        write(conn, value)
+
+
+def handle_raw(dtype, conn):
+    # send back the bytes, so the client can see the encoding
+    count = dispatch.msg_read_uint8(conn)
+    data = ''.join(chr(dispatch.msg_read_uint8(conn)) for _ in range(count))
+    dispatch.msg_write_bytes(conn, data)
+
+
+def handle_wide(dtype, conn):
+    write, value, _ = WIDE[dispatch.msg_read_uint8(conn)]
+    write(conn, value)
+
+
+class VarintTestCase(TestCase):
+    @classmethod
+    def server_handlers(cls):
+        return {
+            MSG_ECHO: handle_echo,
+            MSG_RAW: handle_raw,
+            MSG_WIDE: handle_wide,
+        }
+
+    def echo(self, kind, values):
+        read, write = CODECS[kind]
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_type(conn, MSG_ECHO)
+            dispatch.msg_write_uint8(conn, kind)
+            dispatch.msg_write_uint32(conn, len(values))
+            for value in values:
+                write(conn, value)
+            return [read(conn) for _ in values]
+
+    def encoding(self, kind, value, length):
+        conn = dispatch.open('', self.SOCKF)
+        with conn:
+            dispatch.msg_write_type(conn, MSG_RAW)
+            dispatch.msg_write_uint8(conn, length)
+            CODECS[kind][1](conn, value)
+            return dispatch.msg_read_bytes(conn)
+
+    def test_varuint32(self):
+        values = [0, 1, 127, 128, 16383, 16384, 1 << 31, (1 << 32) - 1]
+        self.assertEqual(self.echo(VARUINT32, values), values)
+
+    def test_varint32(self):
+        values = [0, -1, 1, -64, 63, -65, 64, (1 << 31) - 1, -(1 << 31)]
+        self.assertEqual(self.echo(VARINT32, values), values)
+
+    def test_varuint64(self):
+        values = [0, 127, 128, (1 << 32) - 1, 1 << 32, 1 << 63,
+                  (1 << 64) - 1]
+        self.assertEqual(self.echo(VARUINT64, values), values)
+
+    def test_varint64(self):
+        values = [0, -1, 1, 1 << 32, -(1 << 32), (1 << 63) - 1, -(1 << 63)]
+        self.assertEqual(self.echo(VARINT64, values), values)
+
+    def test_encoding(self):
+        self.assertEqual(self.encoding(VARUINT32, 0, 1), '\x00')
+        self.assertEqual(self.encoding(VARUINT32, 300, 2), '\xac\x02')
+        self.assertEqual(self.encoding(VARINT32, -1, 1), '\x01')
+        self.assertEqual(self.encoding(VARINT32, 1, 1), '\x02')
+        self.assertEqual(self.encoding(VARINT32, -(1 << 31), 5),
+                         '\xff\xff\xff\xff\x0f')
+        self.assertEqual(self.encoding(VARUINT64, (1 << 64) - 1, 10),
+                         '\xff' * 9 + '\x01')
+
+    def test_too_wide(self):
+        for case, (_, value, read) in enumerate(WIDE):
+            conn = dispatch.open('', self.SOCKF)
+            with conn:
+                dispatch.msg_write_type(conn, MSG_WIDE)
+                dispatch.msg_write_uint8(conn, case)
+                with self.assertRaises(IOError) as raised:
+                    read(conn)
+                self.assertEqual(raised.exception.errno, errno.ERANGE)
+
+
+if __name__ == '__main__':
+    unittest.main()
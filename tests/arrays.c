@@ -0,0 +1,142 @@
+#include <config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dispatch.h>
+#include "check.h"
+
+/* The array codecs, through a builder, which reads back what was
+   written to it.  The counts cross the writer's chunks. */
+
+static void
+check_strings(void)
+{
+  struct msg_connection *builder;
+  char *in[6],*out[6];
+  char *big;
+  size_t count,i;
+
+  big=malloc(20000);
+  CHECK(big);
+  memset(big,'x',19999);
+  big[19999]=0;
+
+  in[0]="one";
+  in[1]=NULL;
+  in[2]="";
+  in[3]=big;
+  in[4]=NULL;
+  in[5]="six";
+
+  builder=msg_builder_new(0);
+  CHECK(builder);
+  CHECK(msg_write_string_array(builder,in,6)==1);
+  CHECK(msg_read_array_length(builder,&count)==1);
+  CHECK(count==6);
+  CHECK(msg_read_string_array(builder,out,count)==1);
+
+  for(i=0;i<6;i++)
+    {
+      if(in[i])
+        CHECK(out[i] && strcmp(in[i],out[i])==0);
+      else
+        CHECK(out[i]==NULL);
+
+      free(out[i]);
+    }
+
+  msg_close(builder);
+  free(big);
+}
+
+static void
+check_uint16(size_t count)
+{
+  struct msg_connection *builder;
+  uint16_t *in,*out;
+  size_t got,i;
+
+  in=calloc(count+1,sizeof(*in));
+  out=calloc(count+1,sizeof(*out));
+  CHECK(in && out);
+
+  for(i=0;i<count;i++)
+    in[i]=i*40503;
+
+  builder=msg_builder_new(0);
+  CHECK(builder);
+  CHECK(msg_write_uint16_array(builder,in,count)==1);
+  CHECK(msg_read_array_length(builder,&got)==1);
+  CHECK(got==count);
+  CHECK(msg_read_uint16_array(builder,out,got)==1);
+  CHECK(memcmp(in,out,count*sizeof(*in))==0);
+
+  msg_close(builder);
+  free(in);
+  free(out);
+}
+
+static void
+check_int64(size_t count)
+{
+  struct msg_connection *builder;
+  int64_t *in,*out;
+  size_t got,i;
+
+  in=calloc(count+1,sizeof(*in));
+  out=calloc(count+1,sizeof(*out));
+  CHECK(in && out);
+
+  for(i=0;i<count;i++)
+    in[i]=(int64_t)(i*0x9E3779B97F4A7C15ULL);
+
+  builder=msg_builder_new(0);
+  CHECK(builder);
+  CHECK(msg_write_int64_array(builder,in,count)==1);
+  CHECK(msg_read_array_length(builder,&got)==1);
+  CHECK(got==count);
+  CHECK(msg_read_int64_array(builder,out,got)==1);
+  CHECK(memcmp(in,out,count*sizeof(*in))==0);
+
+  msg_close(builder);
+  free(in);
+  free(out);
+}
+
+/* Elements go out in network byte order after the count. */
+
+static void
+check_encoding(void)
+{
+  static const unsigned char want[]={2,0x01,0x02,0xFF,0xFE};
+  struct msg_connection *builder;
+  uint16_t in[2]={0x0102,0xFFFE};
+  const void *data;
+  size_t length;
+
+  builder=msg_builder_new(0);
+  CHECK(builder);
+  CHECK(msg_write_uint16_array(builder,in,2)==1);
+  data=msg_builder_data(builder,&length);
+  CHECK(length==sizeof(want) && memcmp(data,want,length)==0);
+
+  msg_close(builder);
+}
+
+int
+main(void)
+{
+  static const size_t counts[]={0,1,191,192,4095,4096,4097,10000};
+  size_t i;
+
+  check_strings();
+  check_encoding();
+
+  for(i=0;i<sizeof(counts)/sizeof(counts[0]);i++)
+    {
+      check_uint16(counts[i]);
+      check_int64(counts[i]);
+    }
+
+  return 0;
+}
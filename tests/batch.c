@@ -0,0 +1,233 @@
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dispatch.h>
+#include "check.h"
+
+/* Batches, on the paths only a C server takes: replies in order with
+   failures marked, replies spread over many chunks, requests answered
+   from the cache, and batches the server refuses. */
+
+enum
+  {
+    MSG_DOUBLE=1,
+    MSG_FILL=2,
+    MSG_CACHED=3,
+    MSG_MISSING=4
+  };
+
+/* A batch's requests are limited to this many bytes. */
+#define BATCH_SIZE 4096
+
+static volatile int calls;
+
+/* Fails on 13, to show a failure costs only its own reply. */
+
+static int
+do_double(uint16_t type,struct msg_connection *conn)
+{
+  uint32_t val;
+
+  __atomic_add_fetch(&calls,1,__ATOMIC_SEQ_CST);
+
+  if(msg_read_uint32(conn,&val)<1 || val==13)
+    return -1;
+
+  return msg_write_uint32(conn,val*2)>0?0:-1;
+}
+
+/* Answers with a buffer of val bytes of val. */
+
+static int
+do_fill(uint16_t type,struct msg_connection *conn)
+{
+  unsigned char buf[8192];
+  uint32_t val;
+
+  if(msg_read_uint32(conn,&val)<1 || val>sizeof(buf))
+    return -1;
+
+  memset(buf,val&0xFF,val);
+
+  return msg_write_buffer_length(conn,val)>0
+    && msg_write_buffer(conn,buf,val)>0?0:-1;
+}
+
+static struct msg_handler handlers[]=
+  {
+    {MSG_DOUBLE,do_double,0,0},
+    {MSG_FILL,do_fill,0,0},
+    {MSG_CACHED,do_double,60000,0},
+    {0,NULL}
+  };
+
+static const char *service;
+
+/* Send count requests of type, val, val+1 and so on, and return the
+   batch, ready for reading.  *conn is left open for the caller. */
+
+static struct msg_batch *
+send_batch(uint16_t type,uint32_t val,size_t count,
+           struct msg_connection **conn)
+{
+  struct msg_batch *batch;
+  size_t i;
+
+  batch=msg_batch_begin(type);
+  CHECK(batch);
+
+  for(i=0;i<count;i++)
+    {
+      struct msg_connection *request=msg_batch_add(batch);
+
+      CHECK(request);
+      CHECK(msg_write_uint32(request,val+i)>0);
+    }
+
+  *conn=msg_open(NULL,service,0);
+  CHECK(*conn);
+  CHECK(msg_batch_commit(batch,*conn)>0);
+
+  return batch;
+}
+
+static void
+check_order(void)
+{
+  struct msg_connection *conn,*reply;
+  struct msg_batch *batch;
+  uint32_t i,val;
+
+  batch=send_batch(MSG_DOUBLE,10,6,&conn);
+
+  for(i=10;i<16;i++)
+    {
+      CHECK(msg_batch_next(batch,&reply)==1);
+      if(i==13)
+        CHECK(reply==NULL);
+      else
+        {
+          CHECK(reply);
+          CHECK(msg_read_uint32(reply,&val)>0 && val==i*2);
+          msg_close(reply);
+        }
+    }
+
+  CHECK(msg_batch_next(batch,&reply)==0);
+
+  msg_batch_free(batch);
+  msg_close(conn);
+}
+
+/* 200 replies of up to 8000 bytes come back in many chunks. */
+
+static void
+check_chunks(void)
+{
+  struct msg_connection *conn,*reply;
+  struct msg_batch *batch;
+  unsigned char buf[8192];
+  uint32_t i;
+
+  batch=send_batch(MSG_FILL,7800,200,&conn);
+
+  for(i=7800;i<8000;i++)
+    {
+      size_t length,j;
+
+      CHECK(msg_batch_next(batch,&reply)==1 && reply);
+      CHECK(msg_read_buffer_length(reply,&length)>0 && length==i);
+      CHECK(msg_read_buffer(reply,buf,length)>0);
+      for(j=0;j<length;j++)
+        CHECK(buf[j]==(i&0xFF));
+      msg_close(reply);
+    }
+
+  CHECK(msg_batch_next(batch,&reply)==0);
+
+  msg_batch_free(batch);
+  msg_close(conn);
+}
+
+/* Each request in a batch goes through the cache, so the second
+   batch is all hits. */
+
+static void
+check_cached(void)
+{
+  struct msg_connection *conn,*reply;
+  struct msg_batch *batch;
+  struct msg_cache_stats before,after;
+  uint32_t i,val;
+  int round,was;
+
+  for(round=0;round<2;round++)
+    {
+      was=calls;
+      msg_cache_stats(&before);
+
+      batch=send_batch(MSG_CACHED,100,5,&conn);
+      for(i=100;i<105;i++)
+        {
+          CHECK(msg_batch_next(batch,&reply)==1 && reply);
+          CHECK(msg_read_uint32(reply,&val)>0 && val==i*2);
+          msg_close(reply);
+        }
+
+      msg_batch_free(batch);
+      msg_close(conn);
+
+      msg_cache_stats(&after);
+      if(round==0)
+        CHECK(calls==was+5);
+      else
+        {
+          CHECK(calls==was);
+          CHECK(after.hits==before.hits+5);
+        }
+    }
+}
+
+/* The server hangs up on a batch too big for it, or of a type it
+   has no handler for, before running anything. */
+
+static void
+check_refused(uint16_t type,size_t count)
+{
+  struct msg_connection *conn,*reply;
+  struct msg_batch *batch;
+  int was=calls;
+
+  batch=send_batch(type,1,count,&conn);
+  CHECK(msg_batch_next(batch,&reply)<1);
+  CHECK(calls==was);
+
+  msg_batch_free(batch);
+  msg_close(conn);
+}
+
+int
+main(void)
+{
+  struct msg_config config;
+
+  msg_config_init(&config);
+  config.batch.size=BATCH_SIZE;
+  CHECK(msg_init(&config)==0);
+
+  service=check_service("batch");
+  CHECK(msg_listen(NULL,service,0,handlers)==0);
+
+  check_order();
+  check_chunks();
+  check_cached();
+
+  /* Each request takes 5 bytes framed, so this is EMSGSIZE. */
+  check_refused(MSG_DOUBLE,BATCH_SIZE/5+1);
+  check_refused(MSG_MISSING,1);
+
+  /* And the server is still there. */
+  check_order();
+
+  return 0;
+}
@@ -0,0 +1,214 @@
+#include <config.h>
+#include <stdint.h>
+#include <dispatch.h>
+#include "check.h"
+
+/* The reply cache, on the paths only a C server takes: a cached
+   request found at the front of a longer one, expiry, replies that
+   can't be cached, and eviction from a small cache. */
+
+enum
+  {
+    MSG_SQUARE=1,
+    MSG_SHORT=2,
+    MSG_CHAT=3
+  };
+
+static volatile int calls;
+
+static int
+do_square(uint16_t type,struct msg_connection *conn)
+{
+  uint32_t val;
+
+  __atomic_add_fetch(&calls,1,__ATOMIC_SEQ_CST);
+
+  if(msg_read_uint32(conn,&val)<1)
+    return -1;
+
+  return msg_write_uint32(conn,val*val)>0?0:-1;
+}
+
+/* Reads again after it has started to answer, so it isn't a request
+   and a reply. */
+
+static int
+do_chat(uint16_t type,struct msg_connection *conn)
+{
+  uint32_t val;
+
+  __atomic_add_fetch(&calls,1,__ATOMIC_SEQ_CST);
+
+  if(msg_read_uint32(conn,&val)<1 || msg_write_uint32(conn,val)<1
+     || msg_read_uint32(conn,&val)<1)
+    return -1;
+
+  return msg_write_uint32(conn,val)>0?0:-1;
+}
+
+static struct msg_handler handlers[]=
+  {
+    {MSG_SQUARE,do_square,60000,0},
+    {MSG_SHORT,do_square,50,0},
+    {MSG_CHAT,do_chat,60000,0},
+    {0,NULL}
+  };
+
+static const char *service;
+
+/* Send type and val in one write, with extra bytes after them if
+   asked, and return the reply. */
+
+static uint32_t
+call(uint16_t type,uint32_t val,int extra)
+{
+  struct msg_connection *conn,*builder;
+  uint32_t reply=0;
+
+  builder=msg_builder_new(0);
+  CHECK(builder);
+  CHECK(msg_write_type(builder,type)>0);
+  CHECK(msg_write_uint32(builder,val)>0);
+  if(extra)
+    CHECK(msg_write_uint64(builder,0x0123456789ABCDEFULL)>0);
+
+  conn=msg_open(NULL,service,0);
+  CHECK(conn);
+  CHECK(msg_builder_send(builder,conn)>0);
+  CHECK(msg_read_uint32(conn,&reply)>0);
+
+  msg_close(conn);
+  msg_close(builder);
+
+  return reply;
+}
+
+/* The reply is stored after the client has it, so wait for the
+   count to change. */
+
+static void
+wait_entries(size_t entries)
+{
+  struct msg_cache_stats stats;
+  int i;
+
+  for(i=0;i<100;i++)
+    {
+      msg_cache_stats(&stats);
+      if(stats.entries==entries)
+        return;
+
+      usleep(10000);
+    }
+
+  CHECK(stats.entries==entries);
+}
+
+static void
+check_prefix(void)
+{
+  struct msg_cache_stats before,after;
+  int was;
+
+  CHECK(call(MSG_SQUARE,7,0)==49);
+  wait_entries(1);
+
+  /* The handler reads 4 bytes of the 12 waiting, so the cached 4 are
+     all it would have looked at. */
+  was=calls;
+  msg_cache_stats(&before);
+  CHECK(call(MSG_SQUARE,7,1)==49);
+  msg_cache_stats(&after);
+  CHECK(calls==was);
+  CHECK(after.hits==before.hits+1);
+
+  /* A different start is a different request. */
+  CHECK(call(MSG_SQUARE,8,1)==64);
+  CHECK(calls==was+1);
+  wait_entries(2);
+}
+
+static void
+check_expiry(void)
+{
+  int was;
+
+  msg_cache_invalidate(0);
+  wait_entries(0);
+
+  CHECK(call(MSG_SHORT,3,0)==9);
+  wait_entries(1);
+
+  was=calls;
+  usleep(100000);
+  CHECK(call(MSG_SHORT,3,0)==9);
+  CHECK(calls==was+1);
+}
+
+static void
+check_chat(void)
+{
+  struct msg_connection *conn;
+  uint32_t val;
+  int i;
+
+  msg_cache_invalidate(0);
+  wait_entries(0);
+
+  for(i=0;i<2;i++)
+    {
+      conn=msg_open(NULL,service,0);
+      CHECK(conn);
+      CHECK(msg_write_type(conn,MSG_CHAT)>0);
+      CHECK(msg_write_uint32(conn,1)>0);
+      CHECK(msg_read_uint32(conn,&val)>0 && val==1);
+      CHECK(msg_write_uint32(conn,2)>0);
+      CHECK(msg_read_uint32(conn,&val)>0 && val==2);
+      msg_close(conn);
+    }
+
+  /* Both ran, and neither left anything behind. */
+  usleep(50000);
+  wait_entries(0);
+}
+
+/* Entries of about 70 bytes in a cache of 4096 (each one may take a
+   sixteenth), so filling it has to evict. */
+
+static void
+check_eviction(void)
+{
+  struct msg_cache_stats stats;
+  uint32_t i;
+
+  msg_cache_invalidate(0);
+  wait_entries(0);
+
+  for(i=0;i<200;i++)
+    CHECK(call(MSG_SQUARE,i,0)==i*i);
+
+  usleep(50000);
+  msg_cache_stats(&stats);
+  CHECK(stats.evictions>0);
+  CHECK(stats.bytes<=4096);
+}
+
+int
+main(void)
+{
+  struct msg_config config;
+
+  msg_config_init(&config);
+  config.cache.size=4096;
+  CHECK(msg_init(&config)==0);
+
+  service=check_service("cache");
+  CHECK(msg_listen(NULL,service,0,handlers)==0);
+
+  check_prefix();
+  check_expiry();
+  check_chat();
+  check_eviction();
+
+  return 0;
+}
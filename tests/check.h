@@ -0,0 +1,50 @@
+#ifndef _CHECK_H_
+#define _CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Just enough for the test programs.  A failed CHECK says where and
+   exits, which fails the test under make check. */
+
+#define CHECK(_x)                                                       \
+  do                                                                    \
+    {                                                                   \
+      if(!(_x))                                                         \
+        {                                                               \
+          fprintf(stderr,"%s:%d: CHECK(%s) failed\n",__FILE__,__LINE__,#_x); \
+          exit(1);                                                      \
+        }                                                               \
+    }                                                                   \
+  while(0)
+
+/* An abstract socket of this process's own, so tests can run side by
+   side and leave nothing behind. */
+
+static inline const char *
+check_service(const char *name)
+{
+  static char service[64];
+
+  snprintf(service,sizeof(service),"@dispatch-%s.%u",name,
+           (unsigned int)getpid());
+
+  return service;
+}
+
+/* Wait up to about a second for *flag, which a server thread sets. */
+
+static inline int
+check_wait(volatile int *flag)
+{
+  int i;
+
+  for(i=0;i<100 && !*flag;i++)
+    usleep(10000);
+
+  return *flag;
+}
+
+#endif /* !_CHECK_H_ */
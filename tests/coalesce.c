@@ -0,0 +1,227 @@
+#include <config.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <dispatch.h>
+#include "check.h"
+
+/* Coalescing, on the paths only a C server takes: identical requests
+   share one run, different ones don't, and one that waits on a run
+   past its deadline is dropped without an answer. */
+
+enum
+  {
+    MSG_SLOW=1
+  };
+
+static volatile int calls;
+static volatile int hold;
+
+static int
+do_slow(uint16_t type,struct msg_connection *conn)
+{
+  uint32_t val;
+
+  if(msg_read_uint32(conn,&val)<1)
+    return -1;
+
+  __atomic_add_fetch(&calls,1,__ATOMIC_SEQ_CST);
+
+  while(hold)
+    usleep(1000);
+
+  return msg_write_uint32(conn,val+1)>0?0:-1;
+}
+
+static struct msg_handler handlers[]=
+  {
+    {MSG_SLOW,do_slow,0,1},
+    {0,NULL}
+  };
+
+static const char *service;
+
+static struct msg_connection *
+send_request(uint32_t val)
+{
+  struct msg_connection *conn,*builder;
+
+  builder=msg_builder_new(0);
+  CHECK(builder);
+  CHECK(msg_write_type(builder,MSG_SLOW)>0);
+  CHECK(msg_write_uint32(builder,val)>0);
+
+  conn=msg_open(NULL,service,0);
+  CHECK(conn);
+  CHECK(msg_builder_send(builder,conn)>0);
+
+  msg_close(builder);
+
+  return conn;
+}
+
+static uint32_t
+read_reply(struct msg_connection *conn)
+{
+  uint32_t reply=0;
+
+  CHECK(msg_read_uint32(conn,&reply)>0);
+  msg_close(conn);
+
+  return reply;
+}
+
+static void
+wait_calls(int want)
+{
+  int i;
+
+  for(i=0;i<100 && calls<want;i++)
+    usleep(10000);
+
+  CHECK(calls==want);
+}
+
+static uint64_t
+coalesced(void)
+{
+  struct msg_cache_stats stats;
+
+  msg_cache_stats(&stats);
+
+  return stats.coalesced;
+}
+
+static void
+check_shared(void)
+{
+  struct msg_connection *first,*second;
+  uint64_t before=coalesced();
+
+  hold=1;
+  first=send_request(1);
+  wait_calls(calls+1);
+
+  /* It waits on the first run rather than starting its own. */
+  second=send_request(1);
+  usleep(100000);
+  CHECK(calls==1);
+
+  hold=0;
+  CHECK(read_reply(first)==2);
+  CHECK(read_reply(second)==2);
+  CHECK(calls==1);
+  CHECK(coalesced()==before+1);
+}
+
+static void
+check_different(void)
+{
+  struct msg_connection *first,*second;
+  int was=calls;
+
+  hold=1;
+  first=send_request(5);
+  wait_calls(was+1);
+  second=send_request(6);
+  wait_calls(was+2);
+
+  hold=0;
+  CHECK(read_reply(first)==6);
+  CHECK(read_reply(second)==7);
+}
+
+/* A client that has only timeout ms left, straight onto the wire, so
+   it can wait for an answer past its own deadline and see that the
+   server gave up on it. */
+
+static int
+send_raw(uint32_t val,unsigned int timeout)
+{
+  struct sockaddr_un addr;
+  unsigned char request[16]={1,0x10};
+  uint64_t left=(uint64_t)timeout*1000000;
+  socklen_t length;
+  int fd,i;
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strcpy(addr.sun_path+1,service+1);
+  length=offsetof(struct sockaddr_un,sun_path)+strlen(service);
+
+  fd=socket(AF_UNIX,SOCK_STREAM,0);
+  CHECK(fd!=-1);
+  CHECK(connect(fd,(struct sockaddr *)&addr,length)==0);
+
+  for(i=0;i<8;i++)
+    request[2+i]=left>>(56-i*8);
+  request[10]=MSG_SLOW>>8;
+  request[11]=MSG_SLOW&0xFF;
+  request[12]=val>>24;
+  request[13]=val>>16;
+  request[14]=val>>8;
+  request[15]=val;
+
+  CHECK(write(fd,request,sizeof(request))==sizeof(request));
+
+  return fd;
+}
+
+static uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+
+  return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+static void
+check_timeout(void)
+{
+  struct msg_connection *first;
+  struct pollfd pfd;
+  uint64_t start,before=coalesced();
+  char c;
+  int was=calls;
+
+  hold=1;
+  first=send_request(9);
+  wait_calls(was+1);
+
+  start=now_ms();
+  pfd.fd=send_raw(9,100);
+  pfd.events=POLLIN;
+
+  /* Hung up on, with the run still going.  The request was never
+     read, so the hang up may come as a reset. */
+  CHECK(poll(&pfd,1,2000)==1);
+  CHECK(read(pfd.fd,&c,1)<1);
+  CHECK(now_ms()-start>=90);
+  CHECK(hold && calls==was+1);
+  close(pfd.fd);
+
+  hold=0;
+  CHECK(read_reply(first)==10);
+  CHECK(calls==was+1);
+  CHECK(coalesced()==before);
+}
+
+int
+main(void)
+{
+  service=check_service("coalesce");
+  CHECK(msg_listen(NULL,service,0,handlers)==0);
+
+  check_shared();
+  check_different();
+  check_timeout();
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+#include <config.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <dispatch.h>
+#include "check.h"
+
+/* Hedged group calls, against two servers in this process: a call
+   the slow one sits on goes to the other as well and is answered from
+   there, but only while there is budget for it. */
+
+enum
+  {
+    MSG_ECHO=1
+  };
+
+/* Enough replies to work out the hedging delay from. */
+#define WARMUP 32
+
+/* How long the slow server takes once it is slow, and how long the
+   group waits before hedging, in milliseconds. */
+#define SLOW_MS 300
+#define MIN_DELAY 20
+
+static volatile int slow_ms;
+static volatile int slow_calls,fast_calls;
+
+static int
+do_echo(struct msg_connection *conn,volatile int *calls,int delay)
+{
+  uint32_t val;
+
+  if(msg_read_uint32(conn,&val)<1)
+    return -1;
+
+  __atomic_add_fetch(calls,1,__ATOMIC_SEQ_CST);
+
+  if(delay)
+    usleep(delay*1000);
+
+  return msg_write_uint32(conn,val+1)>0?0:-1;
+}
+
+static int
+do_slow(uint16_t type,struct msg_connection *conn)
+{
+  return do_echo(conn,&slow_calls,slow_ms);
+}
+
+static int
+do_fast(uint16_t type,struct msg_connection *conn)
+{
+  return do_echo(conn,&fast_calls,0);
+}
+
+static struct msg_handler slow_handlers[]=
+  {
+    {MSG_ECHO,do_slow,0,0},
+    {0,NULL}
+  };
+
+static struct msg_handler fast_handlers[]=
+  {
+    {MSG_ECHO,do_fast,0,0},
+    {0,NULL}
+  };
+
+static const char *services[2];
+
+static uint64_t
+now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+
+  return (uint64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+/* Returns how long the call took, in milliseconds. */
+
+static uint64_t
+call(struct msg_group *group,const char *key)
+{
+  struct msg_connection *request,*conn;
+  uint64_t start=now_ms();
+  uint32_t val;
+
+  request=msg_builder_new(0);
+  CHECK(request);
+  CHECK(msg_write_uint32(request,41)>0);
+
+  conn=msg_group_call(group,key,MSG_ECHO,request,0);
+  CHECK(conn);
+  CHECK(msg_read_uint32(conn,&val)>0 && val==42);
+
+  msg_close(conn);
+  msg_close(request);
+
+  return now_ms()-start;
+}
+
+static struct msg_group *
+new_group(double budget)
+{
+  struct msg_group *group;
+
+  group=msg_group_new(services,2,MSG_GROUP_HASH,0);
+  CHECK(group);
+  CHECK(msg_group_hedge(group,MSG_ECHO)==0);
+  CHECK(msg_group_hedging(group,95,budget,MIN_DELAY)==0);
+
+  return group;
+}
+
+/* Fill in the group's reply times, while neither server is slow, and
+   find a key that goes to the one that will be. */
+
+static const char *
+warm_up(struct msg_group *group)
+{
+  static char keys[WARMUP][8];
+  const char *slow_key=NULL;
+  int i;
+
+  slow_ms=0;
+
+  for(i=0;i<WARMUP;i++)
+    {
+      int was=slow_calls;
+
+      snprintf(keys[i],sizeof(keys[i]),"k%d",i);
+      call(group,keys[i]);
+      if(slow_calls!=was && !slow_key)
+        slow_key=keys[i];
+    }
+
+  CHECK(slow_key);
+  slow_ms=SLOW_MS;
+
+  return slow_key;
+}
+
+int
+main(void)
+{
+  struct msg_config config;
+  struct msg_group *group;
+  const char *key;
+  int was;
+
+  /* The slow server answers the loser of a hedged call after it has
+     been closed, as a server does any client that gives up. */
+  signal(SIGPIPE,SIG_IGN);
+
+  msg_config_init(&config);
+  CHECK(msg_init(&config)==0);
+
+  services[0]=strdup(check_service("hedge-slow"));
+  services[1]=strdup(check_service("hedge-fast"));
+  CHECK(services[0] && services[1]);
+  CHECK(msg_listen(NULL,services[0],0,slow_handlers)==0);
+  CHECK(msg_listen(NULL,services[1],0,fast_handlers)==0);
+
+  /* 5% of the warm-up calls saves up a hedge and a half, so there is
+     one to spend, and not two. */
+  group=new_group(5);
+  key=warm_up(group);
+
+  was=fast_calls;
+  CHECK(call(group,key)<SLOW_MS-50);
+  CHECK(fast_calls==was+1);
+
+  was=fast_calls;
+  CHECK(call(group,key)>=SLOW_MS);
+  CHECK(fast_calls==was);
+
+  msg_group_free(group);
+
+  /* With no budget, nothing is ever hedged. */
+  group=new_group(0);
+  key=warm_up(group);
+
+  was=fast_calls;
+  CHECK(call(group,key)>=SLOW_MS);
+  CHECK(fast_calls==was);
+
+  msg_group_free(group);
+
+  return 0;
+}
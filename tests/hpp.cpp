@@ -0,0 +1,79 @@
+#include <config.h>
+#include <string>
+#include <dispatch.hpp>
+#include "check.h"
+
+/* Builds the C++ binding with every warning on, which is how it gets
+   included by programs that use it, and serves a table of handlers
+   through msg_listen(). */
+
+enum
+  {
+    MSG_ADD=1,
+    MSG_GREET=2
+  };
+
+static int
+do_add(uint16_t,msg_connection *conn)
+{
+  uint32_t a,b;
+
+  if(dispatch::read_all(conn,a,b)<1)
+    return -1;
+
+  return dispatch::write(conn,a+b)>0?0:-1;
+}
+
+static int
+do_greet(uint16_t,msg_connection *conn)
+{
+  std::string name;
+
+  if(dispatch::read(conn,name)<1)
+    return -1;
+
+  return dispatch::write(conn,"hello "+name)>0?0:-1;
+}
+
+using table=dispatch::handler_table<
+  dispatch::handler<MSG_ADD,do_add>,
+  dispatch::handler<MSG_GREET,do_greet,1000,true>>;
+
+static_assert(table::size==2);
+static_assert(table::contains(MSG_GREET) && !table::contains(3));
+
+int
+main()
+{
+  const char *service=check_service("hpp");
+  uint32_t sum=0;
+  std::string greeting;
+
+  CHECK(table::table[0].cache_ttl==0 && !table::table[0].coalesce);
+  CHECK(table::table[1].cache_ttl==1000 && table::table[1].coalesce);
+  CHECK(table::table[2].type==0 && !table::table[2].handler);
+
+  CHECK(dispatch::listen<table>(service)==0);
+
+  {
+    dispatch::connection conn(service);
+
+    CHECK(conn);
+    CHECK(dispatch::write_type(conn,MSG_ADD)>0);
+    CHECK(dispatch::write_all(conn,uint32_t(40),uint32_t(2))>0);
+    CHECK(dispatch::read(conn,sum)>0);
+    CHECK(sum==42);
+  }
+
+  {
+    dispatch::connection conn(service);
+
+    CHECK(conn);
+    CHECK(dispatch::write_type(conn,MSG_GREET)>0);
+    CHECK(dispatch::write(conn,std::string("world"))>0);
+    CHECK(dispatch::read(conn,greeting)>0);
+    CHECK(greeting=="hello world");
+  }
+
+  return 0;
+}
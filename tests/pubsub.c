@@ -0,0 +1,183 @@
+#include <config.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <dispatch.h>
+#include "check.h"
+
+/* Publish/subscribe, on the paths only a C server takes: subscribing
+   is refused unless turned on and past the cap, and a subscriber that
+   stops reading is cut off once its queue is full, giving its place
+   back, while one that keeps up goes on getting everything. */
+
+#define SUBSCRIBERS 2
+#define QUEUE 4
+
+/* Big enough that a few fill a socket's buffer. */
+#define BIG 65536
+
+static struct msg_handler handlers[]=
+  {
+    {0,NULL}
+  };
+
+static const char *service;
+
+static int
+publish(const char *topic,uint32_t val,size_t size)
+{
+  static unsigned char buf[BIG];
+  struct msg_connection *message;
+  int queued;
+
+  message=msg_builder_new(0);
+  CHECK(message);
+  CHECK(msg_write_uint32(message,val)>0);
+  if(size)
+    CHECK(msg_write_buffer(message,buf,size)>0);
+
+  queued=msg_publish(topic,message);
+  msg_close(message);
+
+  return queued;
+}
+
+static void
+expect(struct msg_connection *conn,uint32_t want)
+{
+  struct msg_connection *message;
+  uint32_t val;
+
+  CHECK(msg_subscription_read(conn,&message)==1);
+  CHECK(msg_read_uint32(message,&val)>0 && val==want);
+  msg_close(message);
+}
+
+/* Subscribers are taken on by the server's threads, so a new one is
+   ready once it starts being counted. */
+
+static struct msg_connection *
+subscribe(const char *topic)
+{
+  struct msg_connection *conn;
+  int tries;
+
+  conn=msg_subscribe(NULL,service,topic,0);
+  CHECK(conn);
+
+  for(tries=0;publish(topic,0,0)<1;tries++)
+    {
+      CHECK(tries<5000);
+      usleep(1000);
+    }
+  expect(conn,0);
+
+  return conn;
+}
+
+/* In a process of its own, as the config is the process's. */
+
+static void
+check_disabled(void)
+{
+  pid_t pid;
+  int status;
+
+  pid=fork();
+  CHECK(pid!=-1);
+
+  if(pid==0)
+    {
+      struct msg_config config;
+
+      msg_config_init(&config);
+      CHECK(msg_init(&config)==0);
+
+      service=check_service("pubsub-off");
+      CHECK(msg_listen(NULL,service,0,handlers)==0);
+
+      CHECK(msg_subscribe(NULL,service,"off",0)==NULL);
+      CHECK(errno==EOPNOTSUPP);
+
+      exit(0);
+    }
+
+  CHECK(waitpid(pid,&status,0)==pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status)==0);
+}
+
+int
+main(void)
+{
+  struct msg_config config;
+  struct msg_connection *fast,*slow,*third;
+  struct msg_connection *message;
+  uint32_t val;
+  int tries,sent,got,err;
+
+  check_disabled();
+
+  msg_config_init(&config);
+  config.publish.enabled=1;
+  config.publish.subscribers=SUBSCRIBERS;
+  config.publish.queue=QUEUE;
+  config.publish.disconnect=1;
+  CHECK(msg_init(&config)==0);
+
+  service=check_service("pubsub");
+  CHECK(msg_listen(NULL,service,0,handlers)==0);
+
+  fast=subscribe("fast");
+  slow=subscribe("slow");
+
+  CHECK(msg_subscribe(NULL,service,"fast",0)==NULL);
+  CHECK(errno==EAGAIN);
+
+  /* slow never reads, so its socket fills, then its queue. */
+  for(sent=1;publish("slow",sent,BIG)==1;sent++)
+    {
+      CHECK(sent<1000);
+
+      CHECK(publish("fast",sent,0)==1);
+      expect(fast,sent);
+    }
+
+  /* Cut off, it stays cut off. */
+  CHECK(publish("slow",0,0)==0);
+
+  /* What reached its socket is still there to read, then nothing. */
+  for(got=1;(err=msg_subscription_read(slow,&message))==1;got++)
+    {
+      CHECK(msg_read_uint32(message,&val)>0 && val==got);
+      msg_close(message);
+    }
+  CHECK(err<1 && got<sent);
+  msg_close(slow);
+
+  /* Its place is given back once the publisher has closed it. */
+  for(tries=0;!(third=msg_subscribe(NULL,service,"fast",0));tries++)
+    {
+      CHECK(errno==EAGAIN && tries<5000);
+      usleep(1000);
+    }
+
+  for(tries=0;publish("fast",1000,0)<2;tries++)
+    {
+      CHECK(tries<5000);
+      usleep(1000);
+    }
+  while(msg_subscription_read(fast,&message)==1)
+    {
+      CHECK(msg_read_uint32(message,&val)>0);
+      msg_close(message);
+      if(val==1000)
+        break;
+    }
+  CHECK(val==1000);
+  expect(third,1000);
+
+  msg_close(fast);
+  msg_close(third);
+
+  return 0;
+}
@@ -0,0 +1,1136 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Generate C and Python code for message structs from a schema.  A
+   schema is a list of messages:
+
+     # Comments run to the end of the line.
+     message greeting = 12
+     {
+       uint32 count;
+       string text;
+       buffer data;
+       varint64 delta;
+       uint32[] ids;
+       string[] tags;
+     }
+
+   The "= 12" is optional, and becomes GREETING_TYPE for use with
+   msg_write_type() and the handler table.  Fields are encoded in
+   order with the same wire format as the msg_write_* functions, and
+   the whole message goes out as one buffer, so the receiver always
+   knows how much to read.  Fields can be added to the end of a
+   message, as decoders ignore anything left over. */
+
+enum kinds {KIND_FIXED,KIND_VARINT,KIND_ZIGZAG,KIND_STRING,KIND_BUFFER};
+
+struct type
+{
+  const char *name;
+  enum kinds kind;
+  const char *ctype;
+  const char *func;
+  size_t width;
+  const char *pyfmt;
+  unsigned int arrayable:1;
+};
+
+static const struct type types[]=
+  {
+    {"uint8",KIND_FIXED,"uint8_t","uint8",1,"B",1},
+    {"uint16",KIND_FIXED,"uint16_t","uint16",2,"H",1},
+    {"int32",KIND_FIXED,"int32_t","int32",4,"i",1},
+    {"uint32",KIND_FIXED,"uint32_t","uint32",4,"I",1},
+    {"int64",KIND_FIXED,"int64_t","int64",8,"q",1},
+    {"uint64",KIND_FIXED,"uint64_t","uint64",8,"Q",1},
+    {"varuint32",KIND_VARINT,"uint32_t","varuint32"},
+    {"varint32",KIND_ZIGZAG,"int32_t","varint32"},
+    {"varuint64",KIND_VARINT,"uint64_t","varuint64"},
+    {"varint64",KIND_ZIGZAG,"int64_t","varint64"},
+    {"string",KIND_STRING,"char *","string",0,NULL,1},
+    {"buffer",KIND_BUFFER,"void *","buffer"},
+    {NULL}
+  };
+
+/* Names that can't be fields, because they mean something to C,
+   Python, or the generated Python class. */
+
+static const char *reserved[]=
+  {
+    "auto","break","case","char","const","continue","default","do",
+    "double","else","enum","extern","float","for","goto","if","inline",
+    "int","long","register","restrict","return","short","signed",
+    "sizeof","static","struct","switch","typedef","union","unsigned",
+    "void","volatile","while","and","as","assert","class","def","del",
+    "elif","except","exec","finally","from","global","import","in",
+    "is","lambda","not","or","pass","print","raise","try","with","yield",
+    "None","True","False","TYPE","encode","decode","read","write",
+    NULL
+  };
+
+struct field
+{
+  const struct type *type;
+  unsigned int array:1;
+  char *name;
+};
+
+struct message
+{
+  char *name;
+  long type;
+  unsigned int has_type:1;
+  struct field *fields;
+  size_t field_count;
+};
+
+static const char *schema_file;
+static const char *schema_name;
+static struct message *messages;
+static size_t message_count;
+
+/* The lexer */
+
+static char *text;
+static size_t pos;
+static int line=1;
+static char token[256];
+static int pushed_back;
+
+static void
+die(const char *fmt,...)
+{
+  va_list ap;
+
+  fprintf(stderr,"%s:%d: ",schema_file,line);
+  va_start(ap,fmt);
+  vfprintf(stderr,fmt,ap);
+  va_end(ap);
+  fprintf(stderr,"\n");
+
+  exit(1);
+}
+
+/* Returns the next token, or NULL at the end of the schema. */
+
+static const char *
+next_token(void)
+{
+  size_t len=0;
+
+  if(pushed_back)
+    {
+      pushed_back=0;
+      return token[0]?token:NULL;
+    }
+
+  for(;;)
+    {
+      if(text[pos]=='#')
+        while(text[pos] && text[pos]!='\n')
+          pos++;
+      else if(isspace((unsigned char)text[pos]))
+        {
+          if(text[pos]=='\n')
+            line++;
+          pos++;
+        }
+      else
+        break;
+    }
+
+  if(!text[pos])
+    {
+      token[0]='\0';
+      return NULL;
+    }
+
+  if(isalnum((unsigned char)text[pos]) || text[pos]=='_')
+    {
+      while(isalnum((unsigned char)text[pos]) || text[pos]=='_')
+        {
+          if(len==sizeof(token)-1)
+            die("Name too long");
+          token[len++]=text[pos++];
+        }
+    }
+  else if(strchr("{};=[]",text[pos]))
+    token[len++]=text[pos++];
+  else
+    die("Unexpected character '%c'",text[pos]);
+
+  token[len]='\0';
+
+  return token;
+}
+
+static void
+expect(const char *what)
+{
+  const char *tok=next_token();
+
+  if(!tok || strcmp(tok,what)!=0)
+    die("Expected '%s'",what);
+}
+
+static char *
+expect_name(const char *what)
+{
+  const char *tok=next_token();
+  char *name;
+  size_t i;
+
+  if(!tok || !(isalpha((unsigned char)tok[0]) || tok[0]=='_'))
+    die("Expected %s name",what);
+
+  for(i=0;reserved[i];i++)
+    if(strcmp(tok,reserved[i])==0)
+      die("'%s' is reserved and can't be used as a %s name",tok,what);
+
+  name=strdup(tok);
+  if(!name)
+    die("Out of memory");
+
+  return name;
+}
+
+static void
+parse_field(struct message *msg,const char *type_name)
+{
+  struct field *field;
+  const char *tok;
+  size_t i;
+
+  msg->fields=realloc(msg->fields,(msg->field_count+1)*sizeof(*msg->fields));
+  if(!msg->fields)
+    die("Out of memory");
+
+  field=&msg->fields[msg->field_count++];
+  memset(field,0,sizeof(*field));
+
+  for(i=0;types[i].name;i++)
+    if(strcmp(type_name,types[i].name)==0)
+      break;
+
+  if(!types[i].name)
+    die("Unknown type '%s'",type_name);
+
+  field->type=&types[i];
+
+  tok=next_token();
+  if(tok && strcmp(tok,"[")==0)
+    {
+      if(!field->type->arrayable)
+        die("Can't have an array of %s",field->type->name);
+
+      expect("]");
+      field->array=1;
+    }
+  else
+    pushed_back=1;
+
+  field->name=expect_name("field");
+
+  for(i=0;i<msg->field_count-1;i++)
+    if(strcmp(msg->fields[i].name,field->name)==0)
+      die("Field '%s' is already in message '%s'",field->name,msg->name);
+
+  expect(";");
+}
+
+static void
+parse_schema(void)
+{
+  const char *tok;
+
+  while((tok=next_token()))
+    {
+      struct message *msg;
+      size_t i;
+
+      if(strcmp(tok,"message")!=0)
+        die("Expected 'message'");
+
+      messages=realloc(messages,(message_count+1)*sizeof(*messages));
+      if(!messages)
+        die("Out of memory");
+
+      msg=&messages[message_count++];
+      memset(msg,0,sizeof(*msg));
+
+      msg->name=expect_name("message");
+
+      for(i=0;i<message_count-1;i++)
+        if(strcmp(messages[i].name,msg->name)==0)
+          die("Message '%s' is already defined",msg->name);
+
+      tok=next_token();
+      if(tok && strcmp(tok,"=")==0)
+        {
+          char *end;
+
+          tok=next_token();
+          if(!tok)
+            die("Expected message type");
+
+          msg->type=strtol(tok,&end,0);
+          if(*end || msg->type<1 || msg->type>65530)
+            die("Message type must be between 1 and 65530");
+
+          msg->has_type=1;
+          tok=next_token();
+        }
+
+      if(!tok || strcmp(tok,"{")!=0)
+        die("Expected '{'");
+
+      while((tok=next_token()) && strcmp(tok,"}")!=0)
+        parse_field(msg,tok);
+
+      if(!tok)
+        die("Message '%s' is missing its '}'",msg->name);
+
+      if(!msg->field_count)
+        die("Message '%s' has no fields",msg->name);
+    }
+}
+
+/* C output */
+
+static void
+upper(FILE *out,const char *name)
+{
+  for(;*name;name++)
+    fputc(toupper((unsigned char)*name),out);
+}
+
+static int
+uses(int kind,int array)
+{
+  size_t i,j;
+
+  for(i=0;i<message_count;i++)
+    for(j=0;j<messages[i].field_count;j++)
+      if(messages[i].fields[j].type->kind==kind
+         && (array==-1 || messages[i].fields[j].array==array))
+        return 1;
+
+  return 0;
+}
+
+static void
+write_header(FILE *out,const char *base)
+{
+  size_t i,j;
+
+  fprintf(out,"/* Generated by dispatch-idl from %s.  Do not edit. */\n\n",
+          schema_name);
+
+  fprintf(out,"#ifndef _");
+  upper(out,base);
+  fprintf(out,"_IDL_H_\n#define _");
+  upper(out,base);
+  fprintf(out,"_IDL_H_\n\n");
+
+  fprintf(out,"#include <stddef.h>\n#include <inttypes.h>\n"
+          "#include <dispatch.h>\n\n"
+          "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+
+  fprintf(out,
+          "/* For each message:\n\n"
+          "   _size() is the encoded size, not counting the length in front.\n"
+          "   _encode() appends the message to a builder.\n"
+          "   _write() sends the message on a connection in one write.\n"
+          "   _decode() fills in the struct from an encoded message.\n"
+          "   _read() reads a message from a connection and decodes it.\n"
+          "   _free() frees what _decode() or _read() allocated.\n\n"
+          "   They return what the msg_read_* and msg_write_* functions do.\n"
+          "   A message that ends early fails with EPROTO. */\n");
+
+  for(i=0;i<message_count;i++)
+    {
+      const struct message *msg=&messages[i];
+
+      fprintf(out,"\n");
+
+      if(msg->has_type)
+        {
+          fprintf(out,"#define ");
+          upper(out,msg->name);
+          fprintf(out,"_TYPE %ld\n\n",msg->type);
+        }
+
+      fprintf(out,"struct %s\n{\n",msg->name);
+
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *ctype=field->type->ctype;
+          const char *space=ctype[strlen(ctype)-1]=='*'?"":" ";
+
+          fprintf(out,"  %s%s%s%s;\n",ctype,space,field->array?"*":"",
+                  field->name);
+
+          if(field->array)
+            fprintf(out,"  size_t %s_count;\n",field->name);
+          else if(field->type->kind==KIND_BUFFER)
+            fprintf(out,"  size_t %s_length;\n",field->name);
+        }
+
+      fprintf(out,"};\n\n");
+
+      fprintf(out,"size_t %s_size(const struct %s *msg);\n",
+              msg->name,msg->name);
+      fprintf(out,"int %s_encode(struct msg_connection *builder,"
+              "const struct %s *msg);\n",msg->name,msg->name);
+      fprintf(out,"int %s_write(struct msg_connection *conn,"
+              "const struct %s *msg);\n",msg->name,msg->name);
+      fprintf(out,"int %s_decode(struct %s *msg,const void *buffer,"
+              "size_t length);\n",msg->name,msg->name);
+      fprintf(out,"int %s_read(struct msg_connection *conn,struct %s *msg);\n",
+              msg->name,msg->name);
+      fprintf(out,"void %s_free(struct %s *msg);\n",msg->name,msg->name);
+    }
+
+  fprintf(out,"\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+}
+
+static void
+write_check(FILE *out,const char *fail)
+{
+  fprintf(out,"  if(err<1)\n    %s;\n\n",fail);
+}
+
+static void
+write_source(FILE *out,const char *base)
+{
+  size_t i,j;
+  int varints=uses(KIND_VARINT,-1) || uses(KIND_ZIGZAG,-1);
+
+  fprintf(out,"/* Generated by dispatch-idl from %s.  Do not edit. */\n\n",
+          schema_name);
+  fprintf(out,"#include <errno.h>\n#include <stdlib.h>\n#include <string.h>\n"
+          "#include \"%s.h\"\n",base);
+
+  fprintf(out,
+          "\nstatic size_t\n"
+          "length_size(size_t length)\n"
+          "{\n"
+          "  if(length>8383)\n    return 5;\n"
+          "  else if(length>191)\n    return 2;\n"
+          "  else\n    return 1;\n"
+          "}\n");
+
+  if(varints)
+    fprintf(out,
+            "\nstatic size_t\n"
+            "varint_size(uint64_t val)\n"
+            "{\n"
+            "  size_t size=1;\n\n"
+            "  while(val>=0x80)\n"
+            "    {\n"
+            "      val>>=7;\n"
+            "      size++;\n"
+            "    }\n\n"
+            "  return size;\n"
+            "}\n");
+
+  if(uses(KIND_ZIGZAG,-1))
+    fprintf(out,
+            "\nstatic uint64_t\n"
+            "zigzag(int64_t val)\n"
+            "{\n"
+            "  return (uint64_t)val<<1^(uint64_t)(val>>63);\n"
+            "}\n");
+
+  if(uses(KIND_STRING,-1))
+    fprintf(out,
+            "\nstatic size_t\n"
+            "string_size(const char *string)\n"
+            "{\n"
+            "  size_t length;\n\n"
+            "  if(!string)\n    return 1;\n\n"
+            "  length=strlen(string);\n\n"
+            "  return length_size(length)+length;\n"
+            "}\n");
+
+  for(i=0;i<message_count;i++)
+    {
+      const struct message *msg=&messages[i];
+      const char *name=msg->name;
+      size_t fixed=0;
+      int loops=0,allocs=0;
+
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+
+          if(field->type->kind==KIND_FIXED && !field->array)
+            fixed+=field->type->width;
+          if(field->array && field->type->kind==KIND_STRING)
+            loops=1;
+          if(field->array || field->type->kind==KIND_BUFFER
+             || field->type->kind==KIND_STRING)
+            allocs=1;
+        }
+
+      /* _size() */
+
+      fprintf(out,"\nsize_t\n%s_size(const struct %s *msg)\n{\n",name,name);
+      fprintf(out,"  size_t size=%zu;\n",fixed);
+      if(loops)
+        fprintf(out,"  size_t i;\n");
+      fprintf(out,"\n");
+
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *fname=field->name;
+
+          if(field->array && field->type->kind==KIND_STRING)
+            fprintf(out,"  size+=length_size(msg->%s_count);\n"
+                    "  for(i=0;i<msg->%s_count;i++)\n"
+                    "    size+=string_size(msg->%s[i]);\n",
+                    fname,fname,fname);
+          else if(field->array)
+            fprintf(out,"  size+=length_size(msg->%s_count)"
+                    "+msg->%s_count*%zu;\n",fname,fname,field->type->width);
+          else
+            switch(field->type->kind)
+              {
+              case KIND_FIXED:
+                break;
+
+              case KIND_VARINT:
+                fprintf(out,"  size+=varint_size(msg->%s);\n",fname);
+                break;
+
+              case KIND_ZIGZAG:
+                fprintf(out,"  size+=varint_size(zigzag(msg->%s));\n",fname);
+                break;
+
+              case KIND_STRING:
+                fprintf(out,"  size+=string_size(msg->%s);\n",fname);
+                break;
+
+              case KIND_BUFFER:
+                fprintf(out,"  size+=length_size(msg->%s_length)"
+                        "+msg->%s_length;\n",fname,fname);
+                break;
+              }
+        }
+
+      fprintf(out,"\n  return size;\n}\n");
+
+      /* encode_sized(), so _write() only works out the size once. */
+
+      fprintf(out,"\nstatic int\nencode_%s(struct msg_connection *builder,"
+              "const struct %s *msg,\n               size_t size)\n{\n"
+              "  int err;\n\n"
+              "  err=msg_write_buffer_length(builder,size);\n",name,name);
+      write_check(out,"return err");
+
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *fname=field->name;
+          const char *func=field->type->func;
+
+          if(field->array && field->type->kind==KIND_STRING)
+            fprintf(out,"  err=msg_write_string_array(builder,msg->%s,"
+                    "msg->%s_count);\n",fname,fname);
+          else if(field->array)
+            fprintf(out,"  err=msg_write_%s_array(builder,msg->%s,"
+                    "msg->%s_count);\n",func,fname,fname);
+          else if(field->type->kind==KIND_BUFFER)
+            {
+              fprintf(out,"  err=msg_write_buffer_length(builder,"
+                      "msg->%s_length);\n",fname);
+              write_check(out,"return err");
+              fprintf(out,"  err=msg_write_buffer(builder,msg->%s,"
+                      "msg->%s_length);\n",fname,fname);
+            }
+          else
+            fprintf(out,"  err=msg_write_%s(builder,msg->%s);\n",func,fname);
+
+          write_check(out,"return err");
+        }
+
+      fprintf(out,"  return 1;\n}\n");
+
+      /* _encode() */
+
+      fprintf(out,"\nint\n%s_encode(struct msg_connection *builder,"
+              "const struct %s *msg)\n{\n"
+              "  return encode_%s(builder,msg,%s_size(msg));\n}\n",
+              name,name,name,name);
+
+      /* _write() */
+
+      fprintf(out,"\nint\n%s_write(struct msg_connection *conn,"
+              "const struct %s *msg)\n{\n"
+              "  struct msg_connection *builder;\n"
+              "  size_t size=%s_size(msg);\n"
+              "  int err;\n\n"
+              "  builder=msg_builder_new(length_size(size)+size);\n"
+              "  if(!builder)\n    return -1;\n\n"
+              "  err=encode_%s(builder,msg,size);\n"
+              "  if(err>0)\n    err=msg_builder_send(builder,conn);\n\n"
+              "  msg_close(builder);\n\n"
+              "  return err;\n}\n",name,name,name,name);
+
+      /* _decode() */
+
+      fprintf(out,"\nint\n%s_decode(struct %s *msg,const void *buffer,"
+              "size_t length)\n{\n"
+              "  struct msg_connection *reader;\n"
+              "  int err;\n\n"
+              "  memset(msg,0,sizeof(*msg));\n\n"
+              "  reader=msg_reader_new(buffer,length);\n"
+              "  if(!reader)\n    return -1;\n\n",name,name);
+
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *fname=field->name;
+          const char *func=field->type->func;
+
+          if(field->array)
+            {
+              fprintf(out,"  err=msg_read_array_length(reader,"
+                      "&msg->%s_count);\n",fname);
+              write_check(out,"goto fail");
+
+              /* Every element takes at least a byte, so a count
+                 bigger than the message is a lie. */
+              fprintf(out,"  if(msg->%s_count>length)\n"
+                      "    {\n      err=0;\n      goto fail;\n    }\n\n",
+                      fname);
+              fprintf(out,"  msg->%s=calloc(msg->%s_count?msg->%s_count:1,"
+                      "sizeof(*msg->%s));\n"
+                      "  if(!msg->%s)\n"
+                      "    {\n      err=-1;\n      goto fail;\n    }\n\n",
+                      fname,fname,fname,fname,fname);
+
+              if(field->type->kind==KIND_STRING)
+                fprintf(out,"  err=msg_read_string_array(reader,msg->%s,"
+                        "msg->%s_count);\n",fname,fname);
+              else
+                fprintf(out,"  err=msg_read_%s_array(reader,msg->%s,"
+                        "msg->%s_count);\n",func,fname,fname);
+            }
+          else if(field->type->kind==KIND_BUFFER)
+            {
+              fprintf(out,"  err=msg_read_buffer_length(reader,"
+                      "&msg->%s_length);\n",fname);
+              write_check(out,"goto fail");
+              fprintf(out,"  if(msg->%s_length>length)\n"
+                      "    {\n      err=0;\n      goto fail;\n    }\n\n",
+                      fname);
+              fprintf(out,"  msg->%s=malloc(msg->%s_length?msg->%s_length:1);\n"
+                      "  if(!msg->%s)\n"
+                      "    {\n      err=-1;\n      goto fail;\n    }\n\n",
+                      fname,fname,fname,fname);
+              fprintf(out,"  err=msg_read_buffer(reader,msg->%s,"
+                      "msg->%s_length);\n",fname,fname);
+            }
+          else
+            fprintf(out,"  err=msg_read_%s(reader,&msg->%s);\n",func,fname);
+
+          write_check(out,"goto fail");
+        }
+
+      fprintf(out,"  msg_close(reader);\n\n  return 1;\n\n"
+              " fail:\n"
+              "  /* Running out of message means it was malformed. */\n"
+              "  if(err==0)\n    errno=EPROTO;\n\n"
+              "  msg_close(reader);\n"
+              "  %s_free(msg);\n\n"
+              "  return -1;\n}\n",name);
+
+      /* _read() */
+
+      fprintf(out,"\nint\n%s_read(struct msg_connection *conn,"
+              "struct %s *msg)\n{\n"
+              "  size_t length;\n"
+              "  void *buffer;\n"
+              "  int err;\n\n"
+              "  memset(msg,0,sizeof(*msg));\n\n"
+              "  err=msg_read_buffer_length(conn,&length);\n",name,name);
+      write_check(out,"return err");
+      fprintf(out,"  buffer=malloc(length?length:1);\n"
+              "  if(!buffer)\n    return -1;\n\n"
+              "  err=msg_read_buffer(conn,buffer,length);\n"
+              "  if(err>0)\n    err=%s_decode(msg,buffer,length);\n\n"
+              "  free(buffer);\n\n"
+              "  return err;\n}\n",name);
+
+      /* _free() */
+
+      fprintf(out,"\nvoid\n%s_free(struct %s *msg)\n{\n",name,name);
+      if(loops)
+        fprintf(out,"  size_t i;\n\n");
+
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *fname=field->name;
+
+          if(field->array && field->type->kind==KIND_STRING)
+            fprintf(out,"  if(msg->%s)\n"
+                    "    for(i=0;i<msg->%s_count;i++)\n"
+                    "      free(msg->%s[i]);\n",fname,fname,fname);
+
+          if(field->array || field->type->kind==KIND_BUFFER
+             || field->type->kind==KIND_STRING)
+            fprintf(out,"  free(msg->%s);\n",fname);
+        }
+
+      if(allocs)
+        fprintf(out,"\n");
+      fprintf(out,"  memset(msg,0,sizeof(*msg));\n}\n");
+    }
+}
+
+/* Python output */
+
+static const char python_helpers[]=
+  "import errno\n"
+  "import struct\n"
+  "\n"
+  "import dsdispatch\n"
+  "\n"
+  "\n"
+  "def _length(length, special=0):\n"
+  "    if special:\n"
+  "        return chr(0xE0 + special)\n"
+  "    elif length > 8383:\n"
+  "        return '\\xff' + struct.pack('>I', length)\n"
+  "    elif length > 191:\n"
+  "        length -= 192\n"
+  "        return chr(192 + (length >> 8)) + chr(length & 0xFF)\n"
+  "    else:\n"
+  "        return chr(length)\n"
+  "\n"
+  "\n"
+  "def _read_length(data, pos):\n"
+  "    first = ord(data[pos])\n"
+  "    if first < 192:\n"
+  "        return first, 0, pos + 1\n"
+  "    elif first < 224:\n"
+  "        return (first - 192) * 256 + ord(data[pos + 1]) + 192, 0, pos + 2\n"
+  "    elif first < 255:\n"
+  "        return 0, first & 0x1F, pos + 1\n"
+  "    else:\n"
+  "        return struct.unpack_from('>I', data, pos + 1)[0], 0, pos + 5\n"
+  "\n"
+  "\n"
+  "def _read_count(data, pos):\n"
+  "    count, special, pos = _read_length(data, pos)\n"
+  "    if special or count > len(data) - pos:\n"
+  "        raise IndexError\n"
+  "    return count, pos\n"
+  "\n"
+  "\n"
+  "def _varint(val):\n"
+  "    out = []\n"
+  "    while val >= 0x80:\n"
+  "        out.append(chr(val & 0x7F | 0x80))\n"
+  "        val >>= 7\n"
+  "    out.append(chr(val))\n"
+  "    return ''.join(out)\n"
+  "\n"
+  "\n"
+  "def _read_varint(data, pos):\n"
+  "    val = shift = 0\n"
+  "    while shift < 70:\n"
+  "        byte = ord(data[pos])\n"
+  "        pos += 1\n"
+  "        val |= (byte & 0x7F) << shift\n"
+  "        if byte < 0x80:\n"
+  "            return val, pos\n"
+  "        shift += 7\n"
+  "    raise IndexError\n"
+  "\n"
+  "\n"
+  "def _zigzag(val):\n"
+  "    return (val << 1) ^ (val >> 63)\n"
+  "\n"
+  "\n"
+  "def _unzigzag(val):\n"
+  "    return (val >> 1) ^ -(val & 1)\n"
+  "\n"
+  "\n"
+  "def _string(val):\n"
+  "    if val is None:\n"
+  "        return _length(0, 1)\n"
+  "    return _length(len(val)) + val\n"
+  "\n"
+  "\n"
+  "def _read_string(data, pos):\n"
+  "    length, special, pos = _read_length(data, pos)\n"
+  "    if special == 1:\n"
+  "        return None, pos\n"
+  "    elif special or length > len(data) - pos:\n"
+  "        raise IndexError\n"
+  "    return data[pos:pos + length], pos + length\n"
+  "\n"
+  "\n"
+  "def _read_buffer(data, pos):\n"
+  "    length, pos = _read_count(data, pos)\n"
+  "    return data[pos:pos + length], pos + length\n";
+
+static void
+python_class_name(FILE *out,const char *name)
+{
+  int up=1;
+
+  for(;*name;name++)
+    if(*name=='_')
+      up=1;
+    else
+      {
+        fputc(up?toupper((unsigned char)*name):*name,out);
+        up=0;
+      }
+}
+
+/* Runs of fixed width fields are packed and unpacked together. */
+
+static size_t
+fixed_run(const struct message *msg,size_t start,char *fmt,size_t *width)
+{
+  size_t j;
+
+  *width=0;
+  strcpy(fmt,">");
+
+  for(j=start;j<msg->field_count;j++)
+    {
+      const struct field *field=&msg->fields[j];
+
+      if(field->array || field->type->kind!=KIND_FIXED)
+        break;
+
+      strcat(fmt,field->type->pyfmt);
+      *width+=field->type->width;
+    }
+
+  return j;
+}
+
+static void
+write_python(FILE *out)
+{
+  size_t i,j,k,end,width;
+  char *fmt;
+
+  fprintf(out,"# Generated by dispatch-idl from %s.  Do not edit.\n\n",
+          schema_name);
+  fputs(python_helpers,out);
+
+  for(i=0;i<message_count;i++)
+    {
+      const struct message *msg=&messages[i];
+
+      fmt=malloc(msg->field_count+2);
+      if(!fmt)
+        die("Out of memory");
+
+      fprintf(out,"\n\nclass ");
+      python_class_name(out,msg->name);
+      fprintf(out,"(object):\n    \"\"\"Message %s\"\"\"\n\n",msg->name);
+
+      if(msg->has_type)
+        fprintf(out,"    TYPE = %ld\n",msg->type);
+
+      fprintf(out,"    __slots__ = (");
+      for(j=0;j<msg->field_count;j++)
+        fprintf(out,"'%s',%s",msg->fields[j].name,
+                j+1<msg->field_count?" ":"");
+      fprintf(out,")\n\n");
+
+      fprintf(out,"    def __init__(self");
+      for(j=0;j<msg->field_count;j++)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *def="0";
+
+          if(field->array)
+            def="()";
+          else if(field->type->kind==KIND_STRING)
+            def="None";
+          else if(field->type->kind==KIND_BUFFER)
+            def="''";
+
+          fprintf(out,", %s=%s",field->name,def);
+        }
+      fprintf(out,"):\n");
+      for(j=0;j<msg->field_count;j++)
+        fprintf(out,"        self.%s = %s\n",msg->fields[j].name,
+                msg->fields[j].name);
+
+      /* encode() */
+
+      fprintf(out,"\n    def encode(self):\n        parts = []\n");
+      for(j=0;j<msg->field_count;j=end)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *fname=field->name;
+
+          end=fixed_run(msg,j,fmt,&width);
+          if(end>j)
+            {
+              fprintf(out,"        parts.append(struct.pack('%s'",fmt);
+              for(k=j;k<end;k++)
+                fprintf(out,", self.%s",msg->fields[k].name);
+              fprintf(out,"))\n");
+              continue;
+            }
+
+          end=j+1;
+
+          if(field->array && field->type->kind==KIND_STRING)
+            fprintf(out,"        parts.append(_length(len(self.%s)))\n"
+                    "        parts.extend(_string(s) for s in self.%s)\n",
+                    fname,fname);
+          else if(field->array)
+            fprintf(out,"        parts.append(_length(len(self.%s)))\n"
+                    "        parts.append(struct.pack('>%%d%s' %% "
+                    "len(self.%s), *self.%s))\n",
+                    fname,field->type->pyfmt,fname,fname);
+          else
+            switch(field->type->kind)
+              {
+              case KIND_FIXED:
+                break;
+
+              case KIND_VARINT:
+                fprintf(out,"        parts.append(_varint(self.%s))\n",fname);
+                break;
+
+              case KIND_ZIGZAG:
+                fprintf(out,"        parts.append(_varint(_zigzag(self.%s)))\n",
+                        fname);
+                break;
+
+              case KIND_STRING:
+                fprintf(out,"        parts.append(_string(self.%s))\n",fname);
+                break;
+
+              case KIND_BUFFER:
+                fprintf(out,"        parts.append(_length(len(self.%s)))\n"
+                        "        parts.append(self.%s)\n",fname,fname);
+                break;
+              }
+        }
+      fprintf(out,"        return ''.join(parts)\n");
+
+      /* decode() */
+
+      fprintf(out,"\n    @classmethod\n    def decode(cls, data):\n"
+              "        self = cls()\n        pos = 0\n        try:\n");
+      for(j=0;j<msg->field_count;j=end)
+        {
+          const struct field *field=&msg->fields[j];
+          const char *fname=field->name;
+
+          end=fixed_run(msg,j,fmt,&width);
+          if(end>j)
+            {
+              fprintf(out,"            %s",end-j==1?"(":"");
+              for(k=j;k<end;k++)
+                fprintf(out,"self.%s%s",msg->fields[k].name,
+                        k+1<end?", ":end-j==1?",)":"");
+              fprintf(out," = struct.unpack_from('%s', data, pos)\n"
+                      "            pos += %zu\n",fmt,width);
+              continue;
+            }
+
+          end=j+1;
+
+          if(field->array && field->type->kind==KIND_STRING)
+            fprintf(out,"            count, pos = _read_count(data, pos)\n"
+                    "            self.%s = []\n"
+                    "            for _ in xrange(count):\n"
+                    "                val, pos = _read_string(data, pos)\n"
+                    "                self.%s.append(val)\n",fname,fname);
+          else if(field->array)
+            fprintf(out,"            count, pos = _read_count(data, pos)\n"
+                    "            self.%s = list(struct.unpack_from("
+                    "'>%%d%s' %% count, data, pos))\n"
+                    "            pos += count * %zu\n",
+                    fname,field->type->pyfmt,field->type->width);
+          else
+            switch(field->type->kind)
+              {
+              case KIND_FIXED:
+                break;
+
+              case KIND_VARINT:
+                fprintf(out,"            self.%s, pos = _read_varint(data, pos)\n",
+                        fname);
+                break;
+
+              case KIND_ZIGZAG:
+                fprintf(out,"            val, pos = _read_varint(data, pos)\n"
+                        "            self.%s = _unzigzag(val)\n",fname);
+                break;
+
+              case KIND_STRING:
+                fprintf(out,"            self.%s, pos = _read_string(data, pos)\n",
+                        fname);
+                break;
+
+              case KIND_BUFFER:
+                fprintf(out,"            self.%s, pos = _read_buffer(data, pos)\n",
+                        fname);
+                break;
+              }
+        }
+      fprintf(out,"        except (IndexError, struct.error):\n"
+              "            raise IOError(errno.EPROTO, 'malformed %s message')\n"
+              "        return self\n",msg->name);
+
+      /* write() and read() */
+
+      fprintf(out,"\n    def write(self, conn):\n"
+              "        return dsdispatch.msg_write_bytes(conn, self.encode())\n"
+              "\n    @classmethod\n    def read(cls, conn):\n"
+              "        return cls.decode(dsdispatch.msg_read_bytes(conn))\n");
+
+      free(fmt);
+    }
+}
+
+static FILE *
+create(const char *dir,const char *base,const char *ext)
+{
+  char path[4096];
+  FILE *out;
+
+  snprintf(path,sizeof(path),"%s/%s%s",dir,base,ext);
+
+  out=fopen(path,"w");
+  if(!out)
+    {
+      fprintf(stderr,"Unable to create %s: %s\n",path,strerror(errno));
+      exit(1);
+    }
+
+  return out;
+}
+
+static void
+finish(FILE *out,const char *base,const char *ext)
+{
+  if(ferror(out) | fclose(out))
+    {
+      fprintf(stderr,"Unable to write %s%s\n",base,ext);
+      exit(1);
+    }
+}
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr,"Usage: %s [-c] [-p] [-o directory] schema.idl\n"
+          "  -c writes the C header and source, -p the Python module,"
+          " and the default is both\n",name);
+  exit(1);
+}
+
+int
+main(int argc,char *argv[])
+{
+  int arg,want_c=0,want_python=0;
+  const char *dir=".";
+  char *base,*dot;
+  FILE *in,*out;
+  long size;
+
+  while((arg=getopt(argc,argv,"cpo:"))!=-1)
+    switch(arg)
+      {
+      case 'c':
+        want_c=1;
+        break;
+
+      case 'p':
+        want_python=1;
+        break;
+
+      case 'o':
+        dir=optarg;
+        break;
+
+      default:
+        usage(argv[0]);
+      }
+
+  if(optind!=argc-1)
+    usage(argv[0]);
+
+  if(!want_c && !want_python)
+    want_c=want_python=1;
+
+  schema_file=argv[optind];
+
+  in=fopen(schema_file,"r");
+  if(!in || fseek(in,0,SEEK_END)==-1 || (size=ftell(in))==-1
+     || fseek(in,0,SEEK_SET)==-1)
+    {
+      fprintf(stderr,"Unable to read %s: %s\n",schema_file,strerror(errno));
+      return 1;
+    }
+
+  text=calloc(1,size+1);
+  if(!text || fread(text,1,size,in)!=size)
+    {
+      fprintf(stderr,"Unable to read %s\n",schema_file);
+      return 1;
+    }
+
+  fclose(in);
+
+  parse_schema();
+
+  /* Output is named after the schema, less any directory and .idl */
+
+  schema_name=strrchr(schema_file,'/');
+  schema_name=schema_name?schema_name+1:schema_file;
+
+  base=strdup(schema_name);
+  if(!base)
+    die("Out of memory");
+
+  dot=strrchr(base,'.');
+  if(dot && strcmp(dot,".idl")==0)
+    *dot='\0';
+
+  if(want_c)
+    {
+      out=create(dir,base,".h");
+      write_header(out,base);
+      finish(out,base,".h");
+
+      out=create(dir,base,".c");
+      write_source(out,base);
+      finish(out,base,".c");
+    }
+
+  if(want_python)
+    {
+      out=create(dir,base,".py");
+      write_python(out);
+      finish(out,base,".py");
+    }
+
+  return 0;
+}
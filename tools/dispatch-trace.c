@@ -0,0 +1,221 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "trace.h"
+
+/* Turn a flight recorder dump into a timeline, oldest event first.
+   Times are wall clock, followed by the gap since the previous event.
+   Handler ends also show how long the handler ran. */
+
+static const char *event_names[TRACE_MAX_EVENT]=
+  {
+    [TRACE_NONE]="none",
+    [TRACE_ACCEPT]="accept",
+    [TRACE_ACCEPT_ERROR]="accept-error",
+    [TRACE_HEADER]="header",
+    [TRACE_HEADER_EOF]="header-eof",
+    [TRACE_HEADER_ERROR]="header-error",
+    [TRACE_DISPATCH]="dispatch",
+    [TRACE_UNKNOWN_TYPE]="unknown-type",
+    [TRACE_THREAD_ERROR]="thread-error",
+    [TRACE_HANDLER_START]="handler-start",
+    [TRACE_HANDLER_END]="handler-end",
+    [TRACE_CLOSE]="close",
+    [TRACE_PANIC]="panic",
+    [TRACE_EXPIRED]="expired",
+    [TRACE_CACHE_HIT]="cache-hit",
+    [TRACE_COALESCED]="coalesced"
+  };
+
+struct start
+{
+  uint32_t thread;
+  uint64_t nsec;
+};
+
+static int
+compare_events(const void *a,const void *b)
+{
+  const struct trace_event *ea=a,*eb=b;
+
+  if(ea->nsec<eb->nsec)
+    return -1;
+  else if(ea->nsec>eb->nsec)
+    return 1;
+  else
+    return 0;
+}
+
+static void
+print_time(uint64_t nsec)
+{
+  time_t secs=nsec/1000000000;
+  struct tm tm;
+  char buf[64];
+
+  localtime_r(&secs,&tm);
+  strftime(buf,sizeof(buf),"%Y-%m-%d %H:%M:%S",&tm);
+  printf("%s.%09u",buf,(unsigned int)(nsec%1000000000));
+}
+
+static void
+print_event(const struct trace_event *ev)
+{
+  if(ev->event<TRACE_MAX_EVENT && event_names[ev->event])
+    printf(" %-13s",event_names[ev->event]);
+  else
+    printf(" event-%-7u",ev->event);
+
+  switch(ev->event)
+    {
+    case TRACE_ACCEPT:
+    case TRACE_HEADER_EOF:
+      printf(" fd=%d",ev->arg);
+      break;
+
+    case TRACE_HEADER:
+      printf(" version=%d flags=0x%02X",ev->arg>>8,ev->arg&0xFF);
+      break;
+
+    case TRACE_DISPATCH:
+    case TRACE_UNKNOWN_TYPE:
+    case TRACE_HANDLER_START:
+      printf(" type=%u",ev->type);
+      break;
+
+    case TRACE_HANDLER_END:
+      printf(" type=%u ret=%d",ev->type,ev->arg);
+      break;
+
+    case TRACE_CLOSE:
+      printf(" type=%u fd=%d",ev->type,ev->arg);
+      break;
+
+    case TRACE_THREAD_ERROR:
+      printf(" type=%u",ev->type);
+      break;
+    }
+
+  if(ev->err)
+    printf(" error=%s",strerror(ev->err));
+}
+
+int
+main(int argc,char *argv[])
+{
+  FILE *file=stdin;
+  struct trace_header header;
+  struct trace_event *events=NULL;
+  struct start *starts=NULL;
+  size_t count=0,alloced=0,nstarts=0,i;
+  int64_t offset;
+  uint64_t last=0;
+
+  if(argc>2)
+    {
+      fprintf(stderr,"Usage: %s [dump-file]\n",argv[0]);
+      return 1;
+    }
+
+  if(argc==2)
+    {
+      file=fopen(argv[1],"rb");
+      if(!file)
+        {
+          fprintf(stderr,"Unable to open %s: %s\n",argv[1],strerror(errno));
+          return 1;
+        }
+    }
+
+  if(fread(&header,sizeof(header),1,file)!=1
+     || header.magic!=TRACE_MAGIC)
+    {
+      fprintf(stderr,"Not a dispatch trace dump\n");
+      return 1;
+    }
+
+  if(header.version!=TRACE_VERSION
+     || header.event_size!=sizeof(struct trace_event))
+    {
+      fprintf(stderr,"Unsupported trace version %u (event size %u)\n",
+              header.version,header.event_size);
+      return 1;
+    }
+
+  for(;;)
+    {
+      if(count==alloced)
+        {
+          alloced=alloced?alloced*2:1024;
+          events=realloc(events,alloced*sizeof(*events));
+          if(!events)
+            {
+              fprintf(stderr,"Out of memory\n");
+              return 1;
+            }
+        }
+
+      if(fread(&events[count],sizeof(*events),1,file)!=1)
+        break;
+
+      /* Rings never written past their first lap are zero filled. */
+      if(events[count].event!=TRACE_NONE)
+        count++;
+    }
+
+  if(file!=stdin)
+    fclose(file);
+
+  qsort(events,count,sizeof(*events),compare_events);
+
+  offset=header.realtime-header.monotonic;
+
+  printf("Dispatch trace of pid %u, %u events\n",header.pid,
+         (unsigned int)count);
+
+  starts=calloc(count+1,sizeof(*starts));
+  if(!starts)
+    {
+      fprintf(stderr,"Out of memory\n");
+      return 1;
+    }
+
+  for(i=0;i<count;i++)
+    {
+      const struct trace_event *ev=&events[i];
+      size_t j;
+
+      print_time(ev->nsec+offset);
+      printf(" +%10.6f [%u]",last?(ev->nsec-last)/1e9:0.0,ev->thread);
+      print_event(ev);
+
+      for(j=0;j<nstarts;j++)
+        if(starts[j].thread==ev->thread)
+          break;
+
+      if(ev->event==TRACE_HANDLER_START)
+        {
+          starts[j].thread=ev->thread;
+          starts[j].nsec=ev->nsec;
+          if(j==nstarts)
+            nstarts++;
+        }
+      else if(ev->event==TRACE_HANDLER_END && j<nstarts && starts[j].nsec)
+        {
+          printf(" took=%.6f",(ev->nsec-starts[j].nsec)/1e9);
+          starts[j].nsec=0;
+        }
+
+      printf("\n");
+
+      last=ev->nsec;
+    }
+
+  free(starts);
+  free(events);
+
+  return 0;
+}